@@ -0,0 +1,133 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "fx-bits.h"
+
+int fx_bits_get(struct fx_serial *s, int flag, int first, int n, uint64_t *bits)
+{
+	// bytes first/8.. and a zero byte past the last word
+	uint8_t b[FX_BITS_M / 8 + 16];
+	int words[FX_BLOCK_MAX];
+	int lo, nb, at, k, i, sh, ret;
+
+	if (bits == NULL || first < 0 || n <= 0)
+		return -1;
+	if (flag == 0 || flag == 1) {
+		if (first + n > FX_BITS_XY)
+			return -1;
+	} else if (flag != 3 || first + n > FX_BITS_M) {
+		return -1;
+	}
+
+	lo = first / 8;
+	nb = (first + n - 1) / 8 - lo + 1;
+	memset(b, 0, sizeof(b));
+	for (at = 0; at < nb; at += k * 2) {
+		// the byte at id is the high half of a word
+		k = (nb - at + 1) / 2;
+		if (k > FX_BLOCK_MAX)
+			k = FX_BLOCK_MAX;
+		ret = fx_register_get_block(s, lo + at, k, words, flag);
+		if (ret != 0)
+			return ret;
+		for (i = 0; i < k; i++) {
+			b[at + i*2] = words[i] >> 8;
+			b[at + i*2 + 1] = words[i];
+		}
+	}
+	// an odd count read one byte too many
+	b[nb] = 0;
+
+	sh = first % 8;
+	for (i = 0; i < FX_BITS_WORDS(n); i++) {
+		uint64_t x = 0;
+		for (k = 0; k < 8; k++)
+			x |= (uint64_t)b[i*8 + k] << (k * 8);
+		if (sh)
+			x = x >> sh | (uint64_t)b[i*8 + 8] << (64 - sh);
+		bits[i] = x;
+	}
+	if (n % 64)
+		bits[n / 64] &= (1ULL << (n % 64)) - 1;
+	return 0;
+}
+
+int fx_bits_count(const uint64_t *bits, int n)
+{
+	int i, c = 0;
+
+	for (i = 0; i < n / 64; i++)
+		c += __builtin_popcountll(bits[i]);
+	if (n % 64)
+		c += __builtin_popcountll(bits[i] & ((1ULL << (n % 64)) - 1));
+	return c;
+}
+
+void fx_bits_unpack(const uint64_t *bits, int n, uint8_t *out)
+{
+	int i = 0;
+
+#if defined(__SSE2__)
+	// 16 bits a go: every lane gets its byte, keeps its own bit and
+	// turns it into 0 or 1
+	const __m128i sel = _mm_set_epi8(-128, 64, 32, 16, 8, 4, 2, 1,
+					 -128, 64, 32, 16, 8, 4, 2, 1);
+	const __m128i one = _mm_set1_epi8(1);
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_cvtsi32_si128((int)(bits[i / 64] >> (i % 64)) & 0xFFFF);
+		v = _mm_unpacklo_epi8(v, v);
+		v = _mm_unpacklo_epi16(v, v);
+		v = _mm_unpacklo_epi32(v, v);
+		v = _mm_cmpeq_epi8(_mm_and_si128(v, sel), sel);
+		_mm_storeu_si128((__m128i *)(out + i), _mm_and_si128(v, one));
+	}
+#elif defined(__ARM_NEON)
+	// the same with a bit test
+	static const uint8_t sel_b[16] = { 1, 2, 4, 8, 16, 32, 64, 128,
+					   1, 2, 4, 8, 16, 32, 64, 128 };
+	const uint8x16_t sel = vld1q_u8(sel_b);
+	const uint8x16_t one = vdupq_n_u8(1);
+
+	for (; i + 16 <= n; i += 16) {
+		unsigned x = bits[i / 64] >> (i % 64);
+		uint8x16_t v = vcombine_u8(vdup_n_u8(x & 0xFF), vdup_n_u8(x >> 8 & 0xFF));
+		vst1q_u8(out + i, vandq_u8(vtstq_u8(v, sel), one));
+	}
+#endif
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	// 8 bits a go: the multiply puts bit k of the low seven at bit 8k,
+	// bit 7 is moved on its own
+	for (; i + 8 <= n; i += 8) {
+		uint64_t x = bits[i / 64] >> (i % 64) & 0xFF;
+		x = ((x & 0x7F) * 0x0002040810204081ULL & 0x0101010101010101ULL) | (x >> 7) << 56;
+		memcpy(out + i, &x, 8);
+	}
+#endif
+	for (; i < n; i++)
+		out[i] = fx_bits_test(bits, i);
+}
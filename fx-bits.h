@@ -0,0 +1,89 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FX_BITS_H_
+#define FX_BITS_H_
+
+#include <stdint.h>
+#include "fx-serial.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Packed bit images of X, Y and M
+//
+// fx_bits_get() reads a range of bit devices into 64 bit words, bit 0
+// of bits[0] first. Bit i is device first + i in the PLC's numbering:
+// octal for X and Y (in an image from X0, X17 is bit 15), decimal for
+// M. A whole image is then tested, compared or scanned a word at a
+// time instead of a bit at a time.
+//
+// for example, the inputs that are on:
+// uint64_t in[FX_BITS_WORDS(256)];
+// fx_bits_get(s, 0, 0, 256, in);
+// for (i = fx_bits_next(in, 256, 0); i >= 0; i = fx_bits_next(in, 256, i + 1))
+//	printf("X%o\n", i);
+//////////////////////////////////////////////////////////////////
+
+#define FX_BITS_XY   256	/* X0..X377, Y0..Y377 */
+#define FX_BITS_M    1024	/* M0..M1023 */
+#define FX_BITS_WORDS(n) (((n) + 63) / 64)
+
+// n bits of device flag (0 X, 1 Y, 3 M, as fx_register_get_block())
+// from device first, in one frame per 512 bits. The bits of the last
+// word past n are zero. 0, -1 or FX_EQUEUE.
+int fx_bits_get(struct fx_serial *ss, int flag, int first, int n, uint64_t *bits);
+
+static inline int fx_bits_test(const uint64_t *bits, int i)
+{
+	return bits[i / 64] >> (i % 64) & 1;
+}
+
+// the first set bit from bit from on, -1 if there is none below n
+static inline int fx_bits_next(const uint64_t *bits, int n, int from)
+{
+	int w = from / 64;
+	uint64_t x;
+
+	if (from < 0 || from >= n)
+		return -1;
+	x = bits[w] & ~0ULL << (from % 64);
+	while (x == 0) {
+		if (++w >= FX_BITS_WORDS(n))
+			return -1;
+		x = bits[w];
+	}
+	from = w * 64 + __builtin_ctzll(x);
+	return from < n ? from : -1;
+}
+
+// set bits below n
+int fx_bits_count(const uint64_t *bits, int n);
+
+// out[i] = bit i, 0 or 1, for i < n
+void fx_bits_unpack(const uint64_t *bits, int n, uint8_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,392 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "fx-bulk.h"
+
+#define BULK_MAGIC "FXBULK1"
+
+enum { BULK_READ = 1, BULK_WRITE };
+
+struct bulk_ckpt {
+	char magic[8];
+	uint32_t op;
+	uint32_t addr;
+	uint32_t len;
+	uint32_t done;
+	uint32_t crc;
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void _crc_init(void)
+{
+	uint32_t c;
+	int k, j;
+
+	for (k = 0; k < 256; k++) {
+		c = k;
+		for (j = 0; j < 8; j++)
+			c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+		crc_table[k] = c;
+	}
+}
+
+uint32_t fx_crc32(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	size_t i;
+
+	// transfers on several ports may get here at once
+	pthread_once(&crc_once, _crc_init);
+	crc = ~crc;
+	for (i = 0; i < len; i++)
+		crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+static char _hexc(int v)
+{
+	return "0123456789ABCDEF"[v & 0xF];
+}
+
+static int _unhex(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * STX cmd addr(4) count(2) [data] ETX sum(2), data two hex digits per
+ * byte in memory order.
+ */
+static int _frame(char *buf, char cmd, int addr, int n, const uint8_t *data)
+{
+	int i, len = 0, sum = 0;
+
+	buf[len++] = 0x02;
+	buf[len++] = cmd;
+	for (i = 12; i >= 0; i -= 4)
+		buf[len++] = _hexc(addr >> i);
+	buf[len++] = _hexc(n >> 4);
+	buf[len++] = _hexc(n);
+	for (i = 0; data && i < n; i++) {
+		buf[len++] = _hexc(data[i] >> 4);
+		buf[len++] = _hexc(data[i]);
+	}
+	buf[len++] = 0x03;
+	for (i = 1; i < len; i++)
+		sum += buf[i];
+	buf[len++] = _hexc(sum >> 4);
+	buf[len++] = _hexc(sum);
+	return len;
+}
+
+static int _read_frame(struct fx_serial *s, int addr, int n, uint8_t *out)
+{
+	char frame[16], resp[FX_BULK_FRAME*2 + 4];
+	int i, sz, try;
+
+	sz = _frame(frame, '0', addr, n, NULL);
+	for (try = 0; try < FX_BULK_RETRIES; try++) {
+		int ret = fx_raw_command(s, frame, sz, resp, sizeof(resp));
+		if (ret == FX_EQUEUE)
+			return FX_EQUEUE;
+		if (ret != n*2 + 4 || resp[0] != 0x02)
+			continue;
+		for (i = 0; i < n; i++) {
+			int hi = _unhex(resp[1+i*2]), lo = _unhex(resp[2+i*2]);
+			if (hi < 0 || lo < 0)
+				break;
+			out[i] = hi << 4 | lo;
+		}
+		if (i == n)
+			return 0;
+	}
+	return -1;
+}
+
+static int _write_frame(struct fx_serial *s, int addr, int n, const uint8_t *data, int verify)
+{
+	char frame[FX_BULK_FRAME*2 + 16], resp[8];
+	uint8_t back[FX_BULK_FRAME];
+	int sz, try;
+
+	sz = _frame(frame, '1', addr, n, data);
+	for (try = 0; try < FX_BULK_RETRIES; try++) {
+		int ret = fx_raw_command(s, frame, sz, resp, sizeof(resp));
+		if (ret == FX_EQUEUE)
+			return FX_EQUEUE;
+		if (ret < 1 || resp[0] != 0x06)
+			continue;
+		if (!verify)
+			return 0;
+		ret = _read_frame(s, addr, n, back);
+		if (ret == FX_EQUEUE)
+			return FX_EQUEUE;
+		if (ret == 0 && memcmp(back, data, n) == 0)
+			return 0;
+	}
+	return -1;
+}
+
+static int _full_read(int fd, uint8_t *buf, size_t n)
+{
+	size_t got = 0;
+
+	while (got < n) {
+		ssize_t r = read(fd, buf + got, n - got);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		got += r;
+	}
+	return 0;
+}
+
+static int _full_write(int fd, const uint8_t *buf, size_t n)
+{
+	size_t put = 0;
+
+	while (put < n) {
+		ssize_t r = write(fd, buf + put, n - put);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		put += r;
+	}
+	return 0;
+}
+
+/*
+ * Opens the checkpoint and returns how many bytes of b may be skipped:
+ * those the checkpoint vouches for and the image still matches. The
+ * CRC so far goes to *crc.
+ */
+static uint32_t _resume(struct fx_bulk *b, int op, int *ck, uint32_t *crc)
+{
+	struct bulk_ckpt c;
+	uint8_t buf[FX_BULK_CHECKPOINT];
+	uint32_t at = 0, x = 0;
+	int fd;
+
+	*crc = 0;
+	*ck = -1;
+	if (b->checkpoint == NULL)
+		return 0;
+	*ck = open(b->checkpoint, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (*ck < 0)
+		return 0;
+	if (pread(*ck, &c, sizeof(c), 0) != sizeof(c) ||
+			memcmp(c.magic, BULK_MAGIC, sizeof(c.magic)) != 0 ||
+			c.op != (uint32_t)op || c.addr != b->addr || c.len != b->len || c.done > b->len)
+		return 0;
+
+	fd = open(b->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	while (at < c.done) {
+		uint32_t n = c.done - at < sizeof(buf) ? c.done - at : sizeof(buf);
+		if (_full_read(fd, buf, n) != 0)
+			break;
+		x = fx_crc32(x, buf, n);
+		at += n;
+	}
+	close(fd);
+	if (at != c.done || x != c.crc)
+		return 0;
+
+	*crc = x;
+	return c.done;
+}
+
+static int _checkpoint(struct fx_bulk *b, int op, int ck, uint32_t done, uint32_t crc)
+{
+	struct bulk_ckpt c;
+
+	if (ck < 0)
+		return 0;
+	memset(&c, 0, sizeof(c));
+	memcpy(c.magic, BULK_MAGIC, sizeof(c.magic));
+	c.op = op;
+	c.addr = b->addr;
+	c.len = b->len;
+	c.done = done;
+	c.crc = crc;
+	if (pwrite(ck, &c, sizeof(c), 0) != sizeof(c))
+		return -1;
+	return fdatasync(ck);
+}
+
+static void _finish(struct fx_bulk *b, int ck, int ret)
+{
+	if (ck < 0)
+		return;
+	close(ck);
+	if (ret == 0)
+		unlink(b->checkpoint);
+}
+
+static int _range_ok(const struct fx_bulk *b)
+{
+	return b->path && b->len > 0 && b->addr < 0x10000 && b->len <= 0x10000 - b->addr;
+}
+
+int fx_bulk_read(struct fx_serial *s, struct fx_bulk *b)
+{
+	uint8_t buf[FX_BULK_CHECKPOINT];
+	uint32_t crc, fill = 0;
+	int fd, ck, ret = 0;
+
+	if (!_range_ok(b))
+		return -1;
+
+	b->done = _resume(b, BULK_READ, &ck, &crc);
+	if (b->done) {
+		fd = open(b->path, O_WRONLY | O_CLOEXEC);
+		if (fd >= 0 && (lseek(fd, b->done, SEEK_SET) < 0 || ftruncate(fd, b->done) != 0)) {
+			close(fd);
+			fd = -1;
+		}
+	} else {
+		fd = open(b->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	}
+	if (fd < 0) {
+		_finish(b, ck, -1);
+		return -1;
+	}
+
+	while (b->done < b->len) {
+		uint32_t n = b->len - b->done < FX_BULK_FRAME ? b->len - b->done : FX_BULK_FRAME;
+
+		ret = _read_frame(s, b->addr + b->done, n, buf + fill);
+		if (ret != 0)
+			break;
+		crc = fx_crc32(crc, buf + fill, n);
+		fill += n;
+
+		// the checkpoint may only cover bytes that are on disk
+		if (fill == sizeof(buf) || b->done + n == b->len) {
+			if (_full_write(fd, buf, fill) != 0 || fdatasync(fd) != 0 ||
+					_checkpoint(b, BULK_READ, ck, b->done + n, crc) != 0) {
+				fill = 0;
+				ret = -1;
+				break;
+			}
+			fill = 0;
+		}
+		b->done += n;
+
+		if (b->progress && b->progress(b, b->done) != 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+	// keep what arrived before a failure, the next run resumes after it
+	if (ret != 0 && fill > 0) {
+		if (_full_write(fd, buf, fill) == 0 && fdatasync(fd) == 0)
+			_checkpoint(b, BULK_READ, ck, b->done, crc);
+	}
+	close(fd);
+	_finish(b, ck, ret);
+	if (ret == 0)
+		b->crc = crc;
+	return ret;
+}
+
+int fx_bulk_write(struct fx_serial *s, struct fx_bulk *b)
+{
+	uint8_t buf[FX_BULK_CHECKPOINT];
+	uint32_t crc, fill = 0, pos = 0;
+	struct stat st;
+	int fd, ck, ret = 0;
+
+	if (!_range_ok(b))
+		return -1;
+
+	fd = open(b->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)b->len) {
+		close(fd);
+		return -1;
+	}
+
+	b->done = _resume(b, BULK_WRITE, &ck, &crc);
+	if (lseek(fd, b->done, SEEK_SET) < 0) {
+		close(fd);
+		_finish(b, ck, -1);
+		return -1;
+	}
+
+	while (b->done < b->len) {
+		uint32_t n = b->len - b->done < FX_BULK_FRAME ? b->len - b->done : FX_BULK_FRAME;
+
+		if (pos == fill) {
+			fill = b->len - b->done < sizeof(buf) ? b->len - b->done : sizeof(buf);
+			pos = 0;
+			if (_full_read(fd, buf, fill) != 0) {
+				ret = -1;
+				break;
+			}
+		}
+		if (n > fill - pos)
+			n = fill - pos;
+
+		ret = _write_frame(s, b->addr + b->done, n, buf + pos, b->verify);
+		if (ret != 0)
+			break;
+		crc = fx_crc32(crc, buf + pos, n);
+		pos += n;
+		b->done += n;
+
+		if (pos == fill && _checkpoint(b, BULK_WRITE, ck, b->done, crc) != 0) {
+			ret = -1;
+			break;
+		}
+		if (b->progress && b->progress(b, b->done) != 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+	if (ret != 0)
+		_checkpoint(b, BULK_WRITE, ck, b->done, crc);
+	close(fd);
+	_finish(b, ck, ret);
+	if (ret == 0)
+		b->crc = crc;
+	return ret;
+}
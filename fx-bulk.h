@@ -0,0 +1,77 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FX_BULK_H_
+#define FX_BULK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "fx-serial.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bulk memory transfer over the programming port
+//
+// Moves a range of PLC memory, by byte address as in the '0' and '1'
+// commands (D registers from 0x1000, two bytes each), between the PLC
+// and an image file, 64 bytes per frame, the most a frame carries. The
+// image is streamed, never held in memory.
+//
+// With a checkpoint file the transfer records how far it got every
+// FX_BULK_CHECKPOINT bytes (image flushed first). A later call with
+// the same op, address and length carries on from there after checking
+// the image against the recorded CRC; any mismatch starts over. The
+// checkpoint is removed when the transfer completes.
+//////////////////////////////////////////////////////////////////
+
+#define FX_BULK_FRAME      64
+#define FX_BULK_CHECKPOINT 4096
+#define FX_BULK_RETRIES    3	/* per frame, for NAKs and timeouts */
+
+struct fx_bulk {
+	uint32_t addr;
+	uint32_t len;
+	const char *path;		/* image file */
+	const char *checkpoint;		/* NULL: no resume */
+	int verify;			/* writes: read each frame back */
+
+	// after every frame; returning non-zero stops the transfer
+	int (*progress)(struct fx_bulk *b, uint32_t done);
+	void *user;
+
+	uint32_t done;			/* bytes moved, also on failure */
+	uint32_t crc;			/* CRC-32 of the image, on success */
+};
+
+// PLC to image file, image file to PLC. 0, -1 on error or when
+// progress stopped it, FX_EQUEUE when the queue had no room.
+int fx_bulk_read(struct fx_serial *ss, struct fx_bulk *b);
+int fx_bulk_write(struct fx_serial *ss, struct fx_bulk *b);
+
+uint32_t fx_crc32(uint32_t crc, const void *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
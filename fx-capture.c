@@ -0,0 +1,289 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fx-capture.h"
+
+// the file grows and is mapped in windows of this size
+#define CAP_WINDOW (1024*1024)
+
+struct fx_cap_writer {
+	int fd;
+	uint8_t *map;		/* current window */
+	off_t map_off;		/* file offset of the window */
+	off_t off;		/* file offset of the next byte */
+	off_t size;		/* current file size */
+	uint64_t t0;
+	uint64_t last;		/* timestamp of the previous record, us */
+};
+
+struct fx_cap_reader {
+	uint8_t *map;
+	size_t size;
+	size_t pos;
+	uint64_t ts;		/* running timestamp, us */
+};
+
+uint64_t fx_cap_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Writer
+//////////////////////////////////////////////////////////////////
+static int _map_window(struct fx_cap_writer *w, off_t at)
+{
+	if (w->map) {
+		munmap(w->map, CAP_WINDOW);
+		w->map = NULL;
+	}
+
+	if (at + CAP_WINDOW > w->size) {
+		if (ftruncate(w->fd, at + CAP_WINDOW) != 0)
+			return -1;
+		w->size = at + CAP_WINDOW;
+	}
+
+	w->map = mmap(NULL, CAP_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, at);
+	if (w->map == MAP_FAILED) {
+		w->map = NULL;
+		return -1;
+	}
+	w->map_off = at;
+
+	return 0;
+}
+
+static int _put(struct fx_cap_writer *w, const void *data, int len)
+{
+	const uint8_t *p = data;
+
+	while (len > 0) {
+		off_t room = w->map_off + CAP_WINDOW - w->off;
+		int n;
+
+		if (room == 0) {
+			if (_map_window(w, w->off) != 0)
+				return -1;
+			room = CAP_WINDOW;
+		}
+
+		n = len < room ? len : (int)room;
+		memcpy(w->map + (w->off - w->map_off), p, n);
+		w->off += n;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int _put_varint(struct fx_cap_writer *w, uint64_t v)
+{
+	uint8_t buf[10];
+	int n = 0;
+
+	do {
+		buf[n] = v & 0x7F;
+		v >>= 7;
+		if (v) buf[n] |= 0x80;
+		n++;
+	} while (v);
+
+	return _put(w, buf, n);
+}
+
+struct fx_cap_writer *fx_cap_create(const char *path, const struct fx_cap_header *h)
+{
+	struct fx_cap_writer *w = calloc(1, sizeof(*w));
+	struct fx_cap_header hdr = *h;
+
+	if (w == NULL)
+		return NULL;
+
+	w->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (w->fd < 0) {
+		free(w);
+		return NULL;
+	}
+
+	memcpy(hdr.magic, FX_CAP_MAGIC, sizeof(hdr.magic));
+	hdr.version = FX_CAP_VERSION;
+	w->t0 = hdr.t0;
+
+	if (_map_window(w, 0) != 0 || _put(w, &hdr, sizeof(hdr)) != 0) {
+		fx_cap_close(w);
+		unlink(path);
+		return NULL;
+	}
+
+	return w;
+}
+
+int fx_cap_append(struct fx_cap_writer *w, int dir, uint64_t ts, const void *data, int len)
+{
+	uint64_t us = ts > w->t0 ? (ts - w->t0) / 1000 : 0;
+	uint64_t delta = us > w->last ? us - w->last : 0;
+	off_t start = w->off;
+	uint8_t d = dir;
+
+	if (_put_varint(w, delta) != 0 ||
+			_put(w, &d, 1) != 0 ||
+			_put_varint(w, len) != 0 ||
+			_put(w, data, len) != 0) {
+		// leave an end marker where the partial record began
+		w->off = start;
+		if (w->off >= w->map_off && w->off < w->map_off + CAP_WINDOW)
+			w->map[w->off - w->map_off] = 0;
+		return -1;
+	}
+
+	w->last += delta;
+	return 0;
+}
+
+int fx_cap_close(struct fx_cap_writer *w)
+{
+	int ret = 0;
+
+	if (w->map)
+		munmap(w->map, CAP_WINDOW);
+	if (w->fd >= 0) {
+		// drop the unused tail of the last window
+		if (ftruncate(w->fd, w->off) != 0)
+			ret = -1;
+		close(w->fd);
+	}
+	free(w);
+
+	return ret;
+}
+
+// Reader
+//////////////////////////////////////////////////////////////////
+struct fx_cap_reader *fx_cap_open(const char *path)
+{
+	struct fx_cap_reader *r;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct fx_cap_header)) {
+		close(fd);
+		return NULL;
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	r->size = st.st_size;
+	r->map = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (r->map == MAP_FAILED) {
+		free(r);
+		return NULL;
+	}
+
+	if (memcmp(r->map, FX_CAP_MAGIC, 8) != 0 ||
+			((struct fx_cap_header *)r->map)->version != FX_CAP_VERSION) {
+		fx_cap_free(r);
+		return NULL;
+	}
+
+	fx_cap_rewind(r);
+	return r;
+}
+
+const struct fx_cap_header *fx_cap_get_header(struct fx_cap_reader *r)
+{
+	return (const struct fx_cap_header *)r->map;
+}
+
+static int _get_varint(struct fx_cap_reader *r, uint64_t *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	while (r->pos < r->size && shift < 64) {
+		uint8_t b = r->map[r->pos++];
+		*v |= (uint64_t)(b & 0x7F) << shift;
+		if (!(b & 0x80))
+			return 0;
+		shift += 7;
+	}
+
+	return -1;
+}
+
+/*
+ * Returns 1 and fills rec for each record, 0 at the end of the capture
+ * and -1 if the file is truncated in the middle of a record.
+ */
+int fx_cap_next(struct fx_cap_reader *r, struct fx_cap_rec *rec)
+{
+	uint64_t delta, len;
+	uint8_t dir;
+
+	if (_get_varint(r, &delta) != 0)
+		return 0;
+	if (r->pos >= r->size)
+		return 0;
+	dir = r->map[r->pos++];
+	if (dir == FX_CAP_END)
+		return 0;
+	if (_get_varint(r, &len) != 0 || len > r->size - r->pos)
+		return -1;
+
+	r->ts += delta;
+	rec->ts = r->ts * 1000;
+	rec->dir = dir;
+	rec->len = (int)len;
+	rec->data = r->map + r->pos;
+	r->pos += len;
+
+	return 1;
+}
+
+void fx_cap_rewind(struct fx_cap_reader *r)
+{
+	r->pos = sizeof(struct fx_cap_header);
+	r->ts = 0;
+}
+
+void fx_cap_free(struct fx_cap_reader *r)
+{
+	munmap(r->map, r->size);
+	free(r);
+}
@@ -0,0 +1,84 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FX_CAPTURE_H_
+#define FX_CAPTURE_H_
+
+#include <stdint.h>
+
+// Wire capture file
+//
+// A fixed header followed by records of
+//   varint  microseconds since the previous record
+//   byte    direction (FX_CAP_TX, FX_CAP_RX, FX_CAP_TIMEOUT)
+//   varint  length
+//   bytes   what crossed the line
+// A direction byte of 0 marks the end of the data, so a file left
+// behind by a crashed writer (zero filled tail) still reads back.
+//////////////////////////////////////////////////////////////////
+
+#define FX_CAP_MAGIC   "FXCAP\r\n"
+#define FX_CAP_VERSION 1
+
+enum fx_cap_dir {
+	FX_CAP_END = 0,
+	FX_CAP_TX,		/* frame written to the PLC */
+	FX_CAP_RX,		/* complete response */
+	FX_CAP_TIMEOUT,		/* no complete response, bytes received so far */
+};
+
+struct fx_cap_header {
+	char magic[8];
+	uint32_t version;
+	int32_t baude;
+	char bits;
+	char parity;
+	char stop;
+	char pad;
+	uint32_t reserved;
+	uint64_t t0;		/* CLOCK_MONOTONIC of the first record, ns */
+	int64_t wall;		/* time(NULL) when the capture started */
+	char device[32];
+};
+
+struct fx_cap_rec {
+	uint64_t ts;		/* ns relative to the start of the capture */
+	int dir;
+	int len;
+	const uint8_t *data;	/* points into the mapped file */
+};
+
+struct fx_cap_writer;
+struct fx_cap_reader;
+
+uint64_t fx_cap_now(void);
+
+struct fx_cap_writer *fx_cap_create(const char *path, const struct fx_cap_header *h);
+int fx_cap_append(struct fx_cap_writer *w, int dir, uint64_t ts, const void *data, int len);
+int fx_cap_close(struct fx_cap_writer *w);
+
+struct fx_cap_reader *fx_cap_open(const char *path);
+const struct fx_cap_header *fx_cap_get_header(struct fx_cap_reader *r);
+int fx_cap_next(struct fx_cap_reader *r, struct fx_cap_rec *rec);
+void fx_cap_rewind(struct fx_cap_reader *r);
+void fx_cap_free(struct fx_cap_reader *r);
+
+#endif
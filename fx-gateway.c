@@ -0,0 +1,845 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// fx-gateway: owns the PLC links and serves many clients
+//
+// usage: fx-gateway -l device[,baud[,7E1]] [-l ...] [-s socket] [-m port] [-v]
+//   -l  a link, as for fx_serial_start(); links are numbered from 0
+//   -s  local socket path (default /tmp/fx-gateway.sock), see fx-gateway.h
+//   -m  Modbus TCP port (off by default); unit id N is link N-1,
+//       unit 0 and 255 are link 0
+//   -v  print request and wire transaction rates every second
+//
+// Client requests are cut into parts of at most one frame and attached
+// to wire transactions queued on their link. A read that is covered by
+// a queued or running read of the same device shares its answer; a read
+// next to a queued one widens it instead of costing another frame. A
+// write closes all earlier reads to attachment so nobody is answered
+// with data older than a write they could have seen.
+//
+// Modbus mapping: holding and input registers are D, coils are Y bits,
+// discrete inputs are X bits (octal numbering flattened: coil 8 is Y10).
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "fx-serial.h"
+#include "fx-gateway.h"
+
+#define MAX_LINKS    16
+#define LINK_WORKERS 2		/* keeps the library queue one frame ahead */
+#define MERGE_GAP    8		/* units a merge may read but nobody asked for */
+#define MAX_UNITS    256	/* per job */
+#define INBUF        8192
+
+#define D_LIMIT  8000		/* D0..D7999 */
+#define XY_LIMIT 32		/* X/Y 0..377 octal, in bytes */
+
+enum { FRONT_LOCAL, FRONT_MODBUS };
+
+struct client {
+	int fd;
+	int front;
+	int refs;		/* event loop + jobs in flight */
+	int closed;
+	pthread_mutex_t wlock;
+	int len;
+	unsigned char in[INBUF];
+};
+
+/*
+ * What one client request asked for. Units are words for D and bytes
+ * for X/Y, so reads of neighbouring X/Y bytes can share a frame.
+ */
+struct job {
+	struct client *c;
+	int write;
+	int flag, id, count;
+	int pending;		/* parts not done yet */
+	int status;
+	struct job *done_next;
+
+	// local front end
+	uint32_t tag;
+	int words;		/* words asked for (X/Y: units = words*2) */
+
+	// Modbus front end
+	uint8_t mbap[7];
+	int fc, mb_addr, mb_qty;
+
+	uint16_t val[MAX_UNITS];
+};
+
+struct part {
+	struct job *job;
+	int off;		/* index into job->val */
+	int id, count;
+	struct part *next;
+};
+
+struct wire_op {
+	int write;
+	int flag, id, count;	/* units */
+	int closed;		/* no more parts may attach */
+	int status;
+	uint16_t val[64];
+	struct part *parts;
+	struct wire_op *next;
+};
+
+struct link {
+	char *device;
+	struct fx_serial *s;
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	struct wire_op *head, *tail;	/* queued */
+	struct wire_op *busy;		/* on the wire */
+	int busy_write;
+	pthread_t tid[LINK_WORKERS];
+};
+
+static struct link links[MAX_LINKS];
+static int n_links;
+static volatile sig_atomic_t quit;
+
+static unsigned long n_requests, n_wire, n_shared;
+
+// clients
+//////////////////////////////////////////////////////////////////
+static void client_get(struct client *c)
+{
+	__atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void client_put(struct client *c)
+{
+	if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		close(c->fd);
+		pthread_mutex_destroy(&c->wlock);
+		free(c);
+	}
+}
+
+static void client_send(struct client *c, const void *buf, int len)
+{
+	pthread_mutex_lock(&c->wlock);
+	if (!c->closed && send(c->fd, buf, len, MSG_NOSIGNAL) != len)
+		c->closed = 1;
+	pthread_mutex_unlock(&c->wlock);
+}
+
+// responses
+//////////////////////////////////////////////////////////////////
+static void put16(uint8_t *p, int v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static int get16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static void modbus_reply(struct job *j, const uint8_t *pdu, int len)
+{
+	uint8_t out[7 + 260];
+
+	memcpy(out, j->mbap, 7);
+	put16(out + 4, len + 1);
+	memcpy(out + 7, pdu, len);
+	client_send(j->c, out, 7 + len);
+}
+
+static void modbus_exception(struct job *j, int code)
+{
+	uint8_t pdu[2] = { j->fc | 0x80, code };
+	modbus_reply(j, pdu, 2);
+}
+
+static void job_respond(struct job *j)
+{
+	int i;
+
+	if (j->c->front == FRONT_LOCAL) {
+		uint8_t out[sizeof(struct fxgw_resp) + FXGW_MAX_WORDS*2];
+		struct fxgw_resp *r = (struct fxgw_resp *)out;
+		uint16_t *w = (uint16_t *)(r + 1);
+
+		r->tag = j->tag;
+		r->status = j->status;
+		r->count = 0;
+		r->reserved = 0;
+		if (j->status == FXGW_OK && !j->write) {
+			r->count = j->words;
+			for (i = 0; i < j->words; i++)
+				w[i] = j->flag == 2 ? j->val[i] :
+					(j->val[i*2] << 8) | j->val[i*2+1];
+		}
+		client_send(j->c, out, sizeof(*r) + r->count*2);
+		return;
+	}
+
+	if (j->status != FXGW_OK) {
+		modbus_exception(j, 0x0B);	/* target failed to respond */
+		return;
+	}
+
+	uint8_t pdu[260];
+	int n;
+
+	pdu[0] = j->fc;
+	switch (j->fc) {
+	case 1:
+	case 2:
+		n = (j->mb_qty + 7) / 8;
+		pdu[1] = n;
+		memset(pdu + 2, 0, n);
+		for (i = 0; i < j->mb_qty; i++) {
+			int bit = j->mb_addr + i;
+			if (j->val[bit/8 - j->id] & (1 << (bit % 8)))
+				pdu[2 + i/8] |= 1 << (i % 8);
+		}
+		modbus_reply(j, pdu, 2 + n);
+		break;
+	case 3:
+	case 4:
+		pdu[1] = j->count * 2;
+		for (i = 0; i < j->count; i++)
+			put16(pdu + 2 + i*2, j->val[i]);
+		modbus_reply(j, pdu, 2 + j->count*2);
+		break;
+	case 6:
+		put16(pdu + 1, j->mb_addr);
+		put16(pdu + 3, j->val[0]);
+		modbus_reply(j, pdu, 5);
+		break;
+	case 16:
+		put16(pdu + 1, j->mb_addr);
+		put16(pdu + 3, j->mb_qty);
+		modbus_reply(j, pdu, 5);
+		break;
+	}
+}
+
+static void job_finish(struct job *j)
+{
+	job_respond(j);
+	client_put(j->c);
+	free(j);
+}
+
+// links
+//////////////////////////////////////////////////////////////////
+static int max_units(int flag)
+{
+	return flag == 2 ? FX_BLOCK_MAX : FX_BLOCK_MAX * 2;
+}
+
+static int op_covers(struct wire_op *op, int flag, int id, int count)
+{
+	return !op->write && !op->closed && op->flag == flag &&
+		op->id <= id && id + count <= op->id + op->count;
+}
+
+/*
+ * Attaches a part to a wire transaction: an existing read that covers
+ * it, a queued read that can be widened to cover it, or a new one.
+ * Called with the link locked.
+ */
+static void link_attach(struct link *l, struct part *p, int write)
+{
+	struct job *j = p->job;
+	struct wire_op *op;
+	int lo, hi;
+
+	if (write) {
+		for (op = l->head; op; op = op->next)
+			op->closed = 1;
+		for (op = l->busy; op; op = op->next)
+			op->closed = 1;
+		goto new_op;
+	}
+
+	for (op = l->busy; op; op = op->next)
+		if (op_covers(op, j->flag, p->id, p->count))
+			goto attach_shared;
+	for (op = l->head; op; op = op->next)
+		if (op_covers(op, j->flag, p->id, p->count))
+			goto attach_shared;
+
+	for (op = l->head; op; op = op->next) {
+		if (op->write || op->closed || op->flag != j->flag)
+			continue;
+		lo = p->id < op->id ? p->id : op->id;
+		hi = p->id + p->count > op->id + op->count ?
+			p->id + p->count : op->id + op->count;
+		if (hi - lo > max_units(j->flag))
+			continue;
+		if (p->id > op->id + op->count + MERGE_GAP ||
+				op->id > p->id + p->count + MERGE_GAP)
+			continue;
+		op->id = lo;
+		op->count = hi - lo;
+		goto attach_shared;
+	}
+
+new_op:
+	op = calloc(1, sizeof(*op));
+	op->write = write;
+	op->flag = j->flag;
+	op->id = p->id;
+	op->count = p->count;
+	if (write)
+		memcpy(op->val, &j->val[p->off], p->count * sizeof(uint16_t));
+	if (l->tail)
+		l->tail->next = op;
+	else
+		l->head = op;
+	l->tail = op;
+	pthread_cond_signal(&l->cv);
+	goto attach;
+
+attach_shared:
+	__atomic_add_fetch(&n_shared, 1, __ATOMIC_RELAXED);
+attach:
+	p->next = op->parts;
+	op->parts = p;
+}
+
+static int wire_exec(struct link *l, struct wire_op *op)
+{
+	int v[FX_BLOCK_MAX], i, n;
+
+	if (op->flag == 2) {
+		if (op->write) {
+			for (i = 0; i < op->count; i++)
+				v[i] = op->val[i];
+			return fx_register_set_block(l->s, op->id, op->count, v, 2);
+		}
+		if (fx_register_get_block(l->s, op->id, op->count, v, 2) != 0)
+			return -1;
+		for (i = 0; i < op->count; i++)
+			op->val[i] = v[i];
+		return 0;
+	}
+
+	// X/Y: units are bytes, frames carry words of two bytes
+	n = (op->count + 1) / 2;
+	if (op->write) {
+		if (op->count & 1)
+			return -1;
+		// the write frame puts the low half of a word first
+		for (i = 0; i < n; i++)
+			v[i] = op->val[i*2] | (op->val[i*2+1] << 8);
+		return fx_register_set_block(l->s, op->id, n, v, op->flag);
+	}
+	if (fx_register_get_block(l->s, op->id, n, v, op->flag) != 0)
+		return -1;
+	for (i = 0; i < op->count; i++)
+		op->val[i] = i & 1 ? v[i/2] & 0xFF : (v[i/2] >> 8) & 0xFF;
+	return 0;
+}
+
+static void *link_worker(void *arg)
+{
+	struct link *l = arg;
+
+	for (;;) {
+		struct wire_op *op, **pp;
+		struct part *p, *next;
+		struct job *done = NULL;
+
+		// a write goes out alone so reads on either side of it keep
+		// their order on the wire
+		pthread_mutex_lock(&l->lock);
+		while (!quit && (l->head == NULL || l->busy_write ||
+				(l->head->write && l->busy)))
+			pthread_cond_wait(&l->cv, &l->lock);
+		if (quit) {
+			pthread_mutex_unlock(&l->lock);
+			break;
+		}
+		op = l->head;
+		l->head = op->next;
+		if (l->head == NULL)
+			l->tail = NULL;
+		op->next = l->busy;
+		l->busy = op;
+		l->busy_write = op->write;
+		pthread_mutex_unlock(&l->lock);
+
+		op->status = wire_exec(l, op) == 0 ? FXGW_OK : FXGW_EIO;
+		__atomic_add_fetch(&n_wire, 1, __ATOMIC_RELAXED);
+
+		pthread_mutex_lock(&l->lock);
+		for (pp = &l->busy; *pp != op; pp = &(*pp)->next)
+			;
+		*pp = op->next;
+		l->busy_write = 0;
+		pthread_cond_broadcast(&l->cv);
+		for (p = op->parts; p; p = next) {
+			struct job *j = p->job;
+
+			next = p->next;
+			if (op->status != FXGW_OK)
+				j->status = op->status;
+			else if (!op->write)
+				memcpy(&j->val[p->off], &op->val[p->id - op->id],
+						p->count * sizeof(uint16_t));
+			if (--j->pending == 0) {
+				j->done_next = done;
+				done = j;
+			}
+			free(p);
+		}
+		pthread_mutex_unlock(&l->lock);
+
+		// answer outside the lock, a slow client must not stall the link
+		while (done) {
+			struct job *j = done;
+			done = j->done_next;
+			job_finish(j);
+		}
+		free(op);
+	}
+
+	return NULL;
+}
+
+/*
+ * Cuts a job into frame sized parts and queues them on its link.
+ */
+static void job_submit(struct link *l, struct job *j)
+{
+	int max = max_units(j->flag), off;
+
+	__atomic_add_fetch(&n_requests, 1, __ATOMIC_RELAXED);
+	client_get(j->c);
+	j->pending = (j->count + max - 1) / max;
+	j->status = FXGW_OK;
+
+	pthread_mutex_lock(&l->lock);
+	for (off = 0; off < j->count; off += max) {
+		struct part *p = calloc(1, sizeof(*p));
+
+		p->job = j;
+		p->off = off;
+		p->id = j->id + off;
+		p->count = j->count - off < max ? j->count - off : max;
+		link_attach(l, p, j->write);
+	}
+	pthread_mutex_unlock(&l->lock);
+}
+
+static int range_ok(int flag, int id, int count)
+{
+	if (count <= 0 || count > MAX_UNITS || id < 0)
+		return 0;
+	return id + count <= (flag == 2 ? D_LIMIT : XY_LIMIT);
+}
+
+// front ends
+//////////////////////////////////////////////////////////////////
+
+/*
+ * Returns bytes consumed, 0 if the request is not complete yet, -1 if
+ * the stream is unusable.
+ */
+static int local_request(struct client *c, const uint8_t *buf, int len)
+{
+	const struct fxgw_req *q = (const struct fxgw_req *)buf;
+	const uint16_t *w = (const uint16_t *)(q + 1);
+	struct job *j;
+	int need, i;
+
+	if (len < (int)sizeof(*q))
+		return 0;
+	if (q->op != FXGW_OP_READ && q->op != FXGW_OP_WRITE)
+		return -1;
+	need = sizeof(*q) + (q->op == FXGW_OP_WRITE ? q->count * 2 : 0);
+	if (len < need)
+		return 0;
+
+	j = calloc(1, sizeof(*j));
+	j->c = c;
+	j->tag = q->tag;
+	j->write = q->op == FXGW_OP_WRITE;
+	j->flag = q->flag;
+	j->id = q->id;
+	j->words = q->count;
+	j->count = q->flag == 2 ? q->count : q->count * 2;
+
+	if (q->link >= n_links || q->flag > 2 || q->count == 0 ||
+			q->count > FXGW_MAX_WORDS || !range_ok(j->flag, j->id, j->count)) {
+		j->status = FXGW_EINVAL;
+		job_respond(j);
+		free(j);
+		return need;
+	}
+
+	for (i = 0; j->write && i < q->count; i++) {
+		if (j->flag == 2) {
+			j->val[i] = w[i];
+		} else {
+			j->val[i*2] = w[i] >> 8;
+			j->val[i*2+1] = w[i] & 0xFF;
+		}
+	}
+
+	job_submit(&links[q->link], j);
+	return need;
+}
+
+static int modbus_request(struct client *c, const uint8_t *buf, int len)
+{
+	struct job *j;
+	const uint8_t *pdu;
+	int need, unit, link, i, first, last;
+
+	if (len < 8)
+		return 0;
+	need = 6 + get16(buf + 4);
+	if (get16(buf + 2) != 0 || need < 8 || need > 7 + 253)
+		return -1;
+	if (len < need)
+		return 0;
+
+	j = calloc(1, sizeof(*j));
+	j->c = c;
+	memcpy(j->mbap, buf, 7);
+	pdu = buf + 7;
+	j->fc = pdu[0];
+
+	unit = buf[6];
+	link = (unit == 0 || unit == 255) ? 0 : unit - 1;
+	if (link >= n_links) {
+		modbus_exception(j, 0x0A);	/* gateway path unavailable */
+		goto drop;
+	}
+
+	switch (j->fc) {
+	case 1:		/* coils: Y */
+	case 2:		/* discrete inputs: X */
+		if (need < 12)
+			goto bad_value;
+		j->mb_addr = get16(pdu + 1);
+		j->mb_qty = get16(pdu + 3);
+		if (j->mb_qty < 1 || j->mb_qty > 2000)
+			goto bad_value;
+		first = j->mb_addr / 8;
+		last = (j->mb_addr + j->mb_qty - 1) / 8;
+		j->flag = j->fc == 1 ? 1 : 0;
+		j->id = first;
+		j->count = last - first + 1;
+		break;
+	case 3:		/* holding registers: D */
+	case 4:		/* input registers: D */
+		if (need < 12)
+			goto bad_value;
+		j->flag = 2;
+		j->id = get16(pdu + 1);
+		j->count = get16(pdu + 3);
+		if (j->count < 1 || j->count > 125)
+			goto bad_value;
+		break;
+	case 6:
+		if (need < 12)
+			goto bad_value;
+		j->write = 1;
+		j->flag = 2;
+		j->id = j->mb_addr = get16(pdu + 1);
+		j->count = 1;
+		j->val[0] = get16(pdu + 3);
+		break;
+	case 16:
+		if (need < 13)
+			goto bad_value;
+		j->write = 1;
+		j->flag = 2;
+		j->id = j->mb_addr = get16(pdu + 1);
+		j->count = j->mb_qty = get16(pdu + 3);
+		if (j->count < 1 || j->count > 123 || pdu[5] != j->count * 2 ||
+				need < 13 + j->count * 2)
+			goto bad_value;
+		for (i = 0; i < j->count; i++)
+			j->val[i] = get16(pdu + 6 + i*2);
+		break;
+	default:
+		modbus_exception(j, 0x01);
+		goto drop;
+	}
+
+	if (!range_ok(j->flag, j->id, j->count)) {
+		modbus_exception(j, 0x02);
+		goto drop;
+	}
+
+	job_submit(&links[link], j);
+	return need;
+
+bad_value:
+	modbus_exception(j, 0x03);
+drop:
+	free(j);
+	return need;
+}
+
+// event loop
+//////////////////////////////////////////////////////////////////
+/*
+ * Returns -1 when the client is gone or sent garbage.
+ */
+static int client_input(struct client *c)
+{
+	int n, used, off = 0;
+
+	n = read(c->fd, c->in + c->len, sizeof(c->in) - c->len);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (n <= 0)
+		return -1;
+	c->len += n;
+
+	while (off < c->len) {
+		if (c->front == FRONT_LOCAL)
+			used = local_request(c, c->in + off, c->len - off);
+		else
+			used = modbus_request(c, c->in + off, c->len - off);
+		if (used < 0)
+			return -1;
+		if (used == 0)
+			break;
+		off += used;
+	}
+
+	memmove(c->in, c->in + off, c->len - off);
+	c->len -= off;
+	return 0;
+}
+
+static int listen_unix(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+	unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0 ||
+			listen(fd, 64) != 0)
+		return -1;
+	return fd;
+}
+
+static int listen_tcp(int port)
+{
+	struct sockaddr_in sin;
+	int fd, one = 1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0 || listen(fd, 64) != 0)
+		return -1;
+	return fd;
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	quit = 1;
+}
+
+static int add_link(const char *spec)
+{
+	char dev[256], par[4] = "7E1";
+	int baud = 9600;
+	struct link *l;
+	char *comma;
+
+	if (n_links == MAX_LINKS)
+		return -1;
+
+	snprintf(dev, sizeof(dev), "%s", spec);
+	comma = strchr(dev, ',');
+	if (comma) {
+		*comma = '\0';
+		sscanf(comma + 1, "%d,%3s", &baud, par);
+	}
+
+	l = &links[n_links];
+	l->device = strdup(dev);
+	l->s = fx_serial_start(l->device, baud, par[0], par[1], par[2]);
+	if (l->s == NULL)
+		return -1;
+	pthread_mutex_init(&l->lock, NULL);
+	pthread_cond_init(&l->cv, NULL);
+	n_links++;
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s -l device[,baud[,7E1]] [-l ...] [-s socket] [-m port] [-v]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *sock_path = "/tmp/fx-gateway.sock";
+	int mb_port = 0, verbose = 0, opt, i, k;
+	int efd, lfd, mfd = -1;
+	struct epoll_event ev;
+
+	while ((opt = getopt(argc, argv, "l:s:m:v")) != -1) {
+		switch (opt) {
+		case 'l':
+			if (add_link(optarg) != 0) {
+				fprintf(stderr, "%s: cannot start link\n", optarg);
+				return 1;
+			}
+			break;
+		case 's': sock_path = optarg; break;
+		case 'm': mb_port = atoi(optarg); break;
+		case 'v': verbose = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (n_links == 0)
+		usage(argv[0]);
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	efd = epoll_create1(EPOLL_CLOEXEC);
+	lfd = listen_unix(sock_path);
+	if (lfd < 0) {
+		perror(sock_path);
+		return 1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(efd, EPOLL_CTL_ADD, lfd, &ev);
+
+	if (mb_port) {
+		mfd = listen_tcp(mb_port);
+		if (mfd < 0) {
+			perror("modbus");
+			return 1;
+		}
+		ev.data.ptr = &mfd;
+		epoll_ctl(efd, EPOLL_CTL_ADD, mfd, &ev);
+	}
+
+	for (i = 0; i < n_links; i++)
+		for (k = 0; k < LINK_WORKERS; k++)
+			pthread_create(&links[i].tid[k], NULL, link_worker, &links[i]);
+
+	unsigned long last_req = 0, last_wire = 0, last_shared = 0;
+	time_t last = time(NULL);
+
+	while (!quit) {
+		struct epoll_event evs[64];
+		int n = epoll_wait(efd, evs, 64, 1000);
+
+		for (i = 0; i < n; i++) {
+			struct client *c = evs[i].data.ptr;
+
+			if (c == NULL || evs[i].data.ptr == &mfd) {
+				int listener = c == NULL ? lfd : mfd;
+				int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+				struct timeval tv = { 1, 0 };
+				int one = 1;
+
+				if (fd < 0)
+					continue;
+				// a client that stops reading is dropped, not waited for
+				setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+				c = calloc(1, sizeof(*c));
+				c->fd = fd;
+				c->refs = 1;
+				c->front = listener == lfd ? FRONT_LOCAL : FRONT_MODBUS;
+				pthread_mutex_init(&c->wlock, NULL);
+				if (c->front == FRONT_MODBUS)
+					setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+				ev.events = EPOLLIN;
+				ev.data.ptr = c;
+				epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
+				continue;
+			}
+
+			if (client_input(c) != 0) {
+				epoll_ctl(efd, EPOLL_CTL_DEL, c->fd, NULL);
+				pthread_mutex_lock(&c->wlock);
+				c->closed = 1;
+				pthread_mutex_unlock(&c->wlock);
+				client_put(c);
+			}
+		}
+
+		if (verbose && time(NULL) != last) {
+			unsigned long req = n_requests, wire = n_wire, shared = n_shared;
+			fprintf(stderr, "requests/s %lu  wire/s %lu  shared/s %lu\n",
+					req - last_req, wire - last_wire, shared - last_shared);
+			last_req = req;
+			last_wire = wire;
+			last_shared = shared;
+			last = time(NULL);
+		}
+	}
+
+	for (i = 0; i < n_links; i++) {
+		pthread_mutex_lock(&links[i].lock);
+		pthread_cond_broadcast(&links[i].cv);
+		pthread_mutex_unlock(&links[i].lock);
+		for (k = 0; k < LINK_WORKERS; k++)
+			pthread_join(links[i].tid[k], NULL);
+		fx_serial_stop(links[i].s);
+	}
+	unlink(sock_path);
+
+	return 0;
+}
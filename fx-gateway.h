@@ -0,0 +1,67 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FX_GATEWAY_H_
+#define FX_GATEWAY_H_
+
+#include <stdint.h>
+
+// fx-gateway local socket protocol
+//
+// A client connects to the daemon's Unix socket and writes requests
+// back to back without waiting; each response carries the tag of its
+// request and responses come back in completion order, not request
+// order. All fields are in host byte order.
+//
+// X and Y words follow fx_register_get(): id is a byte address and the
+// byte at id is the high half of the word.
+//////////////////////////////////////////////////////////////////
+
+#define FXGW_OP_READ  1
+#define FXGW_OP_WRITE 2
+
+#define FXGW_MAX_WORDS 125
+
+// status
+#define FXGW_OK      0
+#define FXGW_EINVAL -1	/* malformed request, unknown link, bad range */
+#define FXGW_EIO    -2	/* the PLC did not answer or answered NAK */
+
+struct fxgw_req {
+	uint32_t tag;		/* echoed in the response */
+	uint8_t op;		/* FXGW_OP_* */
+	uint8_t link;		/* index of -l on the daemon command line */
+	uint8_t flag;		/* 0 X, 1 Y, 2 D */
+	uint8_t count;		/* words, 1..FXGW_MAX_WORDS */
+	uint16_t id;
+	uint16_t reserved;
+	// FXGW_OP_WRITE: count uint16_t values follow
+};
+
+struct fxgw_resp {
+	uint32_t tag;
+	int16_t status;		/* FXGW_OK or FXGW_E* */
+	uint8_t count;		/* words that follow, reads only */
+	uint8_t reserved;
+	// count uint16_t values follow
+};
+
+#endif
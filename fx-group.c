@@ -0,0 +1,186 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "fx-group.h"
+
+// The operations outlive a call that gave up on them, so they live in
+// a block shared by the caller and the workers and freed by whichever
+// lets go of it last.
+struct group_op {
+	struct fx_async a;
+	struct group *g;
+	int done;
+	int64_t t_us;
+	int words[FX_BLOCK_MAX];
+};
+
+struct group {
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	int pending;		/* submitted, not done */
+	int refs;		/* the caller and every pending op */
+	struct group_op op[];
+};
+
+static int64_t _mono_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static void _group_put(struct group *g)
+{
+	int last;
+
+	pthread_mutex_lock(&g->lock);
+	last = --g->refs == 0;
+	pthread_mutex_unlock(&g->lock);
+	if (last) {
+		pthread_cond_destroy(&g->cv);
+		pthread_mutex_destroy(&g->lock);
+		free(g);
+	}
+}
+
+// on the worker thread of the op's port
+static void _group_done(struct fx_async *a)
+{
+	struct group_op *op = a->user;
+	struct group *g = op->g;
+	int64_t t = _mono_us();
+
+	pthread_mutex_lock(&g->lock);
+	op->t_us = t;
+	op->done = 1;
+	if (--g->pending == 0)
+		pthread_cond_signal(&g->cv);
+	pthread_mutex_unlock(&g->lock);
+	_group_put(g);
+}
+
+static struct group *_group_alloc(int n)
+{
+	struct group *g = calloc(1, sizeof(*g) + n*sizeof(struct group_op));
+	pthread_condattr_t ca;
+
+	if (g == NULL)
+		return NULL;
+	pthread_mutex_init(&g->lock, NULL);
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&g->cv, &ca);
+	pthread_condattr_destroy(&ca);
+	g->refs = 1;
+	return g;
+}
+
+int fx_group_read(struct fx_group_read *r, int n, int timeout_ms, struct fx_group_result *res)
+{
+	struct group *g;
+	struct timespec ts;
+	int64_t t0 = _mono_us(), end, first = 0, last = 0;
+	int i, ret, ok = 0;
+
+	if (n <= 0 || timeout_ms <= 0)
+		return -1;
+	for (i = 0; i < n; i++)
+		if (r[i].s == NULL || r[i].n < 1 || r[i].n > FX_BLOCK_MAX || r[i].data == NULL)
+			return -1;
+	g = _group_alloc(n);
+	if (g == NULL)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		struct group_op *op = &g->op[i];
+
+		op->g = g;
+		op->a.op = r[i].station == FX_STATION_NONE ? FX_OP_READ : FX_OP_STATION_READ;
+		op->a.station = r[i].station;
+		op->a.flag = r[i].flag;
+		op->a.id = r[i].id;
+		op->a.n = r[i].n;
+		op->a.data = op->words;
+		op->a.timeout = timeout_ms;	/* dropped if still queued then */
+		op->a.done = _group_done;
+		op->a.user = op;
+
+		pthread_mutex_lock(&g->lock);
+		g->pending++;
+		g->refs++;
+		pthread_mutex_unlock(&g->lock);
+
+		ret = fx_async_submit(r[i].s, &op->a);
+		if (ret != 0) {
+			pthread_mutex_lock(&g->lock);
+			g->pending--;
+			g->refs--;
+			pthread_mutex_unlock(&g->lock);
+			op->a.status = ret;
+			op->done = 1;
+			op->t_us = 0;
+		}
+	}
+
+	end = t0 + (int64_t)timeout_ms*1000;
+	ts.tv_sec = end / 1000000;
+	ts.tv_nsec = end % 1000000 * 1000;
+
+	pthread_mutex_lock(&g->lock);
+	while (g->pending > 0)
+		if (pthread_cond_timedwait(&g->cv, &g->lock, &ts) == ETIMEDOUT)
+			break;
+
+	// what is not done now is left to the workers
+	for (i = 0; i < n; i++) {
+		struct group_op *op = &g->op[i];
+
+		if (!op->done) {
+			r[i].status = FX_ETIMEDOUT;
+			r[i].t_us = 0;
+			continue;
+		}
+		r[i].status = op->a.status;
+		r[i].t_us = op->t_us;
+		if (op->a.status != 0)
+			continue;
+		memcpy(r[i].data, op->words, r[i].n * sizeof(int));
+		if (ok++ == 0 || op->t_us < first)
+			first = op->t_us;
+		if (op->t_us > last)
+			last = op->t_us;
+	}
+	pthread_mutex_unlock(&g->lock);
+	_group_put(g);
+
+	if (res) {
+		res->ok = ok;
+		res->elapsed_us = _mono_us() - t0;
+		res->skew_us = ok ? last - first : 0;
+	}
+	return ok == n ? 0 : -1;
+}
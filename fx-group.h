@@ -0,0 +1,75 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FX_GROUP_H_
+#define FX_GROUP_H_
+
+#include <stdint.h>
+#include "fx-serial.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Group reads across ports
+//
+// One snapshot from many PLCs, each on its own port (or RS-485 station):
+// the reads are queued on every port at once and fx_group_read() returns
+// when all have answered or the shared deadline passes, so a snapshot
+// takes as long as the slowest port instead of the sum of them. A read
+// still queued at the deadline is dropped, never sent; one already on
+// the wire finishes on its own and its answer is thrown away.
+//
+// for example, D100..D107 from every line PLC:
+// for (i = 0; i < 12; i++)
+//	r[i] = (struct fx_group_read){ port[i], FX_STATION_NONE, 2, 100, 8, v[i] };
+// fx_group_read(r, 12, 500, &res);
+//////////////////////////////////////////////////////////////////
+
+#define FX_ETIMEDOUT -3		/* no answer by the deadline */
+
+struct fx_group_read {
+	struct fx_serial *s;
+	int station;		/* FX_STATION_NONE: programming port */
+	int flag;		/* as fx_register_get_block() */
+	int id;
+	int n;			/* words, 1..FX_BLOCK_MAX */
+	int *data;
+
+	int status;		/* 0, -1, FX_EQUEUE or FX_ETIMEDOUT */
+	int64_t t_us;		/* CLOCK_MONOTONIC us the answer came in */
+};
+
+struct fx_group_result {
+	int ok;			/* reads answered */
+	int elapsed_us;		/* call to return */
+	int skew_us;		/* last minus first answer of those ok */
+};
+
+// 0 when every read got its answer, -1 otherwise (see each status).
+// res may be NULL.
+int fx_group_read(struct fx_group_read *r, int n, int timeout_ms, struct fx_group_result *res);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,536 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fx-hist.h"
+
+// the file grows and is mapped in windows of whole segments
+#define HIST_WINDOW (64 * FX_HIST_SEGMENT)
+#define HIST_SEG_HDR ((int)sizeof(struct fx_hist_seg))
+
+struct series {
+	uint32_t key;
+	int n;			/* deltas held, samples - 1 */
+	int64_t t0, tlast;
+	int32_t v0, vlast;
+	int32_t dtmin, dtmax;
+	int32_t dvmin, dvmax;
+	// grown as samples come, up to FX_HIST_SEG_SAMPLES - 1
+	int cap;
+	int32_t *dt;
+	int32_t *dv;
+};
+
+struct fx_hist_writer {
+	int fd;
+	uint8_t *map;		/* current window */
+	off_t map_off;
+	off_t off;		/* next segment */
+	off_t size;
+	off_t synced;		/* on disk up to here, see fx_hist_flush() */
+
+	// open addressing, power of two, at most half full
+	struct series **tab;
+	int cap;
+	int count;
+};
+
+struct fx_hist_reader {
+	uint8_t *map;
+	size_t size;
+};
+
+int64_t fx_hist_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int _bits(uint32_t x)
+{
+	return x ? 32 - __builtin_clz(x) : 0;
+}
+
+static int _seg_bytes(int n, int tbits, int vbits)
+{
+	return HIST_SEG_HDR + (n*tbits + 7) / 8 + (n*vbits + 7) / 8;
+}
+
+// records are 8 byte aligned, for the int64_t in their header
+static int _rec_bytes(int n, int tbits, int vbits)
+{
+	return (_seg_bytes(n, tbits, vbits) + 7) & ~7;
+}
+
+// Writer
+//////////////////////////////////////////////////////////////////
+static int _map_window(struct fx_hist_writer *w, off_t at)
+{
+	if (w->map) {
+		munmap(w->map, HIST_WINDOW);
+		w->map = NULL;
+	}
+
+	// windows start on window boundaries, so a segment never straddles two
+	at -= at % HIST_WINDOW;
+	if (at + HIST_WINDOW > w->size) {
+		if (ftruncate(w->fd, at + HIST_WINDOW) != 0)
+			return -1;
+		w->size = at + HIST_WINDOW;
+	}
+
+	w->map = mmap(NULL, HIST_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, at);
+	if (w->map == MAP_FAILED) {
+		w->map = NULL;
+		return -1;
+	}
+	w->map_off = at;
+
+	return 0;
+}
+
+static void _pack(uint8_t *out, const int32_t *d, int n, int32_t min, int bits)
+{
+	uint64_t acc = 0;
+	int have = 0, i;
+
+	if (bits == 0)
+		return;
+	for (i = 0; i < n; i++) {
+		acc |= (uint64_t)((uint32_t)d[i] - (uint32_t)min) << have;
+		have += bits;
+		while (have >= 8) {
+			*out++ = acc & 0xFF;
+			acc >>= 8;
+			have -= 8;
+		}
+	}
+	if (have)
+		*out = acc & 0xFF;
+}
+
+// the next segment of the file, cleared; NULL if it cannot be mapped
+static uint8_t *_next_segment(struct fx_hist_writer *w)
+{
+	uint8_t *seg;
+
+	if (w->map == NULL || w->off >= w->map_off + HIST_WINDOW) {
+		if (_map_window(w, w->off) != 0)
+			return NULL;
+	}
+	seg = w->map + (w->off - w->map_off);
+	memset(seg, 0, FX_HIST_SEGMENT);
+	return seg;
+}
+
+static int _series_bits(const struct series *s, int *tbits, int *vbits)
+{
+	*tbits = s->n ? _bits((uint32_t)s->dtmax - (uint32_t)s->dtmin) : 0;
+	*vbits = s->n ? _bits((uint32_t)s->dvmax - (uint32_t)s->dvmin) : 0;
+	return _rec_bytes(s->n, *tbits, *vbits);
+}
+
+/*
+ * Encodes s as a record at seg, which is zeroed, and empties it. The
+ * magic goes in last, a reader never sees a half written record as
+ * valid.
+ */
+static void _write_record(uint8_t *seg, struct series *s)
+{
+	struct fx_hist_seg h;
+	int tbits, vbits;
+
+	_series_bits(s, &tbits, &vbits);
+	memset(&h, 0, sizeof(h));
+	h.key = s->key;
+	h.count = s->n + 1;
+	h.tbits = tbits;
+	h.vbits = vbits;
+	h.v0 = s->v0;
+	h.t0 = s->t0;
+	h.t1 = s->tlast;
+	h.dtmin = s->dtmin;
+	h.dvmin = s->dvmin;
+
+	_pack(seg + HIST_SEG_HDR, s->dt, s->n, s->dtmin, h.tbits);
+	_pack(seg + HIST_SEG_HDR + (s->n*h.tbits + 7) / 8, s->dv, s->n, s->dvmin, h.vbits);
+	memcpy(seg + sizeof(h.magic), (char *)&h + sizeof(h.magic), sizeof(h) - sizeof(h.magic));
+	__sync_synchronize();
+	*(volatile uint32_t *)seg = FX_HIST_SEG_MAGIC;
+
+	s->n = -1;
+}
+
+// a series that filled up gets a segment of its own
+static int _write_segment(struct fx_hist_writer *w, struct series *s)
+{
+	uint8_t *seg;
+
+	if (s->n < 0)
+		return 0;
+	if ((seg = _next_segment(w)) == NULL)
+		return -1;
+	_write_record(seg, s);
+	w->off += FX_HIST_SEGMENT;
+	return 0;
+}
+
+static struct series *_series(struct fx_hist_writer *w, uint32_t key)
+{
+	uint32_t i, mask = w->cap - 1;
+
+	for (i = (key * 0x9E3779B1u) & mask; w->tab[i]; i = (i + 1) & mask)
+		if (w->tab[i]->key == key)
+			return w->tab[i];
+
+	if ((w->count + 1) * 2 > w->cap) {
+		struct series **old = w->tab;
+		int j, cap = w->cap;
+		w->tab = calloc(cap * 2, sizeof(*w->tab));
+		if (w->tab == NULL) {
+			w->tab = old;
+			return NULL;
+		}
+		w->cap = cap * 2;
+		mask = w->cap - 1;
+		for (j = 0; j < cap; j++) {
+			if (old[j] == NULL)
+				continue;
+			for (i = (old[j]->key * 0x9E3779B1u) & mask; w->tab[i]; i = (i + 1) & mask)
+				;
+			w->tab[i] = old[j];
+		}
+		free(old);
+		for (i = (key * 0x9E3779B1u) & mask; w->tab[i]; i = (i + 1) & mask)
+			;
+	}
+
+	w->tab[i] = calloc(1, sizeof(struct series));
+	if (w->tab[i] == NULL)
+		return NULL;
+	w->tab[i]->key = key;
+	w->tab[i]->n = -1;
+	w->count++;
+	return w->tab[i];
+}
+
+struct fx_hist_writer *fx_hist_create(const char *path)
+{
+	struct fx_hist_writer *w = calloc(1, sizeof(*w));
+	struct fx_hist_header hdr;
+	struct stat st;
+
+	if (w == NULL)
+		return NULL;
+	w->cap = 64;
+	w->tab = calloc(w->cap, sizeof(*w->tab));
+	w->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (w->tab == NULL || w->fd < 0 || fstat(w->fd, &st) != 0)
+		goto err;
+	w->size = st.st_size;
+
+	if (w->size == 0) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, FX_HIST_MAGIC, sizeof(hdr.magic));
+		hdr.version = FX_HIST_VERSION;
+		hdr.segment = FX_HIST_SEGMENT;
+		hdr.created = fx_hist_now();
+		if (_map_window(w, 0) != 0)
+			goto err;
+		memcpy(w->map, &hdr, sizeof(hdr));
+		w->off = FX_HIST_SEGMENT;
+		return w;
+	}
+
+	// append after the last valid segment
+	if (w->size < FX_HIST_SEGMENT || _map_window(w, 0) != 0)
+		goto err;
+	memcpy(&hdr, w->map, sizeof(hdr));
+	if (memcmp(hdr.magic, FX_HIST_MAGIC, sizeof(hdr.magic)) != 0 ||
+			hdr.version < 1 || hdr.version > FX_HIST_VERSION ||
+			hdr.segment != FX_HIST_SEGMENT)
+		goto err;
+	// what is appended may be packed
+	((struct fx_hist_header *)w->map)->version = FX_HIST_VERSION;
+	for (w->off = FX_HIST_SEGMENT; w->off + FX_HIST_SEGMENT <= w->size; w->off += FX_HIST_SEGMENT) {
+		if (w->off >= w->map_off + HIST_WINDOW && _map_window(w, w->off) != 0)
+			goto err;
+		if (*(uint32_t *)(w->map + (w->off - w->map_off)) != FX_HIST_SEG_MAGIC)
+			break;
+	}
+	w->synced = w->off;
+	return w;
+
+err:
+	if (w->map)
+		munmap(w->map, HIST_WINDOW);
+	if (w->fd >= 0)
+		close(w->fd);
+	free(w->tab);
+	free(w);
+	return NULL;
+}
+
+// most devices change seldom, their columns stay small
+static int _grow(struct series *s)
+{
+	int cap = s->cap ? s->cap * 2 : 16;
+	int32_t *p;
+
+	if (cap > FX_HIST_SEG_SAMPLES - 1)
+		cap = FX_HIST_SEG_SAMPLES - 1;
+	if ((p = realloc(s->dt, cap * sizeof(*p))) == NULL)
+		return -1;
+	s->dt = p;
+	if ((p = realloc(s->dv, cap * sizeof(*p))) == NULL)
+		return -1;
+	s->dv = p;
+	s->cap = cap;
+	return 0;
+}
+
+int fx_hist_append(struct fx_hist_writer *w, uint32_t key, int64_t t, int32_t v)
+{
+	struct series *s = _series(w, key);
+	int64_t dt, dv;
+	int32_t tmin, tmax, vmin, vmax;
+
+	if (s == NULL)
+		return -1;
+
+	if (s->n >= 0) {
+		dt = t - s->tlast;
+		dv = (int64_t)v - s->vlast;
+		if (dt >= INT32_MIN && dt <= INT32_MAX && s->n + 1 < FX_HIST_SEG_SAMPLES) {
+			tmin = s->n && s->dtmin < dt ? s->dtmin : dt;
+			tmax = s->n && s->dtmax > dt ? s->dtmax : dt;
+			vmin = s->n && s->dvmin < dv ? s->dvmin : dv;
+			vmax = s->n && s->dvmax > dv ? s->dvmax : dv;
+			if (dv >= INT32_MIN && dv <= INT32_MAX &&
+					_seg_bytes(s->n + 1, _bits((uint32_t)tmax - (uint32_t)tmin),
+						_bits((uint32_t)vmax - (uint32_t)vmin)) <= FX_HIST_SEGMENT) {
+				if (s->n == s->cap && _grow(s) != 0)
+					return -1;
+				s->dt[s->n] = dt;
+				s->dv[s->n] = dv;
+				s->n++;
+				s->dtmin = tmin;
+				s->dtmax = tmax;
+				s->dvmin = vmin;
+				s->dvmax = vmax;
+				s->tlast = t;
+				s->vlast = v;
+				return 0;
+			}
+		}
+		if (_write_segment(w, s) != 0)
+			return -1;
+	}
+
+	s->n = 0;
+	s->t0 = s->tlast = t;
+	s->v0 = s->vlast = v;
+	s->dtmin = s->dtmax = 0;
+	s->dvmin = s->dvmax = 0;
+	return 0;
+}
+
+/*
+ * Writing to the map only reaches the page cache. The part of the
+ * current window written since the last flush is msync()ed; windows
+ * unmapped meanwhile and the grown file size go with fdatasync().
+ */
+int fx_hist_flush(struct fx_hist_writer *w)
+{
+	uint8_t *seg = NULL;
+	off_t from;
+	int i, at = 0, tbits, vbits, len;
+
+	// partly filled series back to back, a new segment when one is full
+	for (i = 0; i < w->cap; i++) {
+		struct series *s = w->tab[i];
+
+		if (s == NULL || s->n < 0)
+			continue;
+		len = _series_bits(s, &tbits, &vbits);
+		if (seg == NULL || at + len > FX_HIST_SEGMENT) {
+			if (seg)
+				w->off += FX_HIST_SEGMENT;
+			if ((seg = _next_segment(w)) == NULL)
+				return -1;
+			at = 0;
+		}
+		_write_record(seg + at, s);
+		at += len;
+	}
+	if (seg)
+		w->off += FX_HIST_SEGMENT;
+
+	from = w->synced > w->map_off ? w->synced : w->map_off;
+	if (w->map && w->off > from &&
+			msync(w->map + (from - w->map_off), w->off - from, MS_SYNC) != 0)
+		return -1;
+	if (fdatasync(w->fd) != 0)
+		return -1;
+	w->synced = w->off;
+	return 0;
+}
+
+int fx_hist_close(struct fx_hist_writer *w)
+{
+	int ret = fx_hist_flush(w), i;
+
+	if (w->map)
+		munmap(w->map, HIST_WINDOW);
+	// drop the unused tail of the last window
+	if (ftruncate(w->fd, w->off) != 0)
+		ret = -1;
+	close(w->fd);
+	for (i = 0; i < w->cap; i++) {
+		if (w->tab[i] == NULL)
+			continue;
+		free(w->tab[i]->dt);
+		free(w->tab[i]->dv);
+		free(w->tab[i]);
+	}
+	free(w->tab);
+	free(w);
+
+	return ret;
+}
+
+// Reader
+//////////////////////////////////////////////////////////////////
+struct fx_hist_reader *fx_hist_open(const char *path)
+{
+	struct fx_hist_reader *r;
+	struct fx_hist_header *h;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) != 0 || st.st_size < FX_HIST_SEGMENT) {
+		close(fd);
+		return NULL;
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	r->size = st.st_size - st.st_size % FX_HIST_SEGMENT;
+	r->map = mmap(NULL, r->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r->map == MAP_FAILED) {
+		free(r);
+		return NULL;
+	}
+
+	h = (struct fx_hist_header *)r->map;
+	if (memcmp(h->magic, FX_HIST_MAGIC, sizeof(h->magic)) != 0 ||
+			h->version < 1 || h->version > FX_HIST_VERSION ||
+			h->segment != FX_HIST_SEGMENT) {
+		fx_hist_free(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+static uint32_t _unpack(const uint8_t *p, int i, int bits)
+{
+	int bit = i * bits, k;
+	uint64_t x = 0;
+
+	// at most 32 bits starting anywhere in a byte span 5 bytes
+	for (k = 0; k < 5 && k * 8 < (bit & 7) + bits; k++)
+		x |= (uint64_t)p[bit/8 + k] << (k * 8);
+	return (x >> (bit & 7)) & (((uint64_t)1 << bits) - 1);
+}
+
+int fx_hist_query(struct fx_hist_reader *r, uint32_t key, int64_t from, int64_t to,
+		struct fx_hist_sample *out, int max)
+{
+	size_t off;
+	int at, got = 0;
+
+	// records in a segment, segments in the file, in writing order
+	for (off = FX_HIST_SEGMENT, at = 0; off < r->size && got < max; ) {
+		const struct fx_hist_seg *h = (const struct fx_hist_seg *)(r->map + off + at);
+		const uint8_t *tcol, *vcol;
+		int64_t t;
+		int32_t v;
+		int i;
+
+		if (at + HIST_SEG_HDR > FX_HIST_SEGMENT || h->magic != FX_HIST_SEG_MAGIC) {
+			if (at == 0)
+				break;
+			off += FX_HIST_SEGMENT;
+			at = 0;
+			continue;
+		}
+		at += _rec_bytes(h->count - 1, h->tbits, h->vbits);
+		if (h->key != key || h->t1 < from || h->t0 > to)
+			continue;
+
+		tcol = (const uint8_t *)h + HIST_SEG_HDR;
+		vcol = tcol + ((h->count - 1) * h->tbits + 7) / 8;
+		t = h->t0;
+		v = h->v0;
+		for (i = 0; i < h->count && got < max; i++) {
+			if (i > 0) {
+				uint32_t dt = h->dtmin, dv = h->dvmin;
+				if (h->tbits)
+					dt += _unpack(tcol, i-1, h->tbits);
+				if (h->vbits)
+					dv += _unpack(vcol, i-1, h->vbits);
+				t += (int32_t)dt;
+				v = (int32_t)((uint32_t)v + dv);
+			}
+			if (t < from)
+				continue;
+			if (t > to)
+				break;
+			out[got].t = t;
+			out[got].v = v;
+			got++;
+		}
+	}
+
+	return got;
+}
+
+void fx_hist_free(struct fx_hist_reader *r)
+{
+	munmap(r->map, r->size);
+	free(r);
+}
@@ -0,0 +1,105 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FX_HIST_H_
+#define FX_HIST_H_
+
+#include <stdint.h>
+
+// Historian file
+//
+// The file is a run of FX_HIST_SEGMENT byte segments, the first holding
+// struct fx_hist_header, every other one records of the samples of a
+// device: struct fx_hist_seg followed by two bit-packed columns, the
+// time deltas and then the value deltas of samples 1..count-1, each
+// stored as (delta - min) in tbits / vbits bits. A record that filled
+// up has a segment of its own; a flush packs the partly filled ones
+// back to back, each starting 8 byte aligned, into as few segments as
+// they fit. A segment is filled in memory and written once, whole and
+// page aligned, so the flash sees each page written a single time. A
+// record whose magic is 0 ends its segment, a segment that starts with
+// one ends the data, which is what a writer that died leaves behind.
+// That holds for a process that dies; after a power loss only what the
+// last fx_hist_flush() put on disk is sure to be there. Version 1 files
+// are the same with one record per segment.
+//
+// Devices are keyed by FX_HIST_KEY(): station (FX_STATION_NONE for the
+// programming port), flag (0 X, 1 Y, 2 D) and id, the byte address for
+// X and Y, the register for D. X and Y samples are the byte, D samples
+// the register; times are CLOCK_REALTIME in microseconds.
+//////////////////////////////////////////////////////////////////
+
+#define FX_HIST_MAGIC       "FXHIST\r\n"
+#define FX_HIST_VERSION     2
+#define FX_HIST_SEGMENT     4096
+#define FX_HIST_SEG_MAGIC   0x47455346	/* "FSEG" */
+#define FX_HIST_SEG_SAMPLES 2048
+
+#define FX_HIST_KEY(station, flag, id) \
+	((uint32_t)((station) & 0xFF) << 24 | (uint32_t)(flag) << 16 | (uint32_t)(id))
+
+struct fx_hist_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t segment;	/* FX_HIST_SEGMENT */
+	int64_t created;	/* us */
+};
+
+struct fx_hist_seg {
+	uint32_t magic;		/* FX_HIST_SEG_MAGIC */
+	uint32_t key;
+	uint16_t count;
+	uint8_t tbits;
+	uint8_t vbits;
+	int32_t v0;		/* first value */
+	int64_t t0;		/* first and last time */
+	int64_t t1;
+	int32_t dtmin;
+	int32_t dvmin;
+};
+
+struct fx_hist_sample {
+	int64_t t;
+	int32_t v;
+};
+
+struct fx_hist_writer;
+struct fx_hist_reader;
+
+int64_t fx_hist_now(void);
+
+// opens path for appending, creating it if needed
+struct fx_hist_writer *fx_hist_create(const char *path);
+int fx_hist_append(struct fx_hist_writer *w, uint32_t key, int64_t t, int32_t v);
+// writes out every partly filled series, packed together, and waits
+// until everything written so far is on disk
+int fx_hist_flush(struct fx_hist_writer *w);
+int fx_hist_close(struct fx_hist_writer *w);
+
+struct fx_hist_reader *fx_hist_open(const char *path);
+// samples of key with from <= t <= to, oldest first, at most max of
+// them; returns how many were stored. To page through a long range ask
+// again from the last t + 1.
+int fx_hist_query(struct fx_hist_reader *r, uint32_t key, int64_t from, int64_t to,
+		struct fx_hist_sample *out, int max);
+void fx_hist_free(struct fx_hist_reader *r);
+
+#endif
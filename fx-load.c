@@ -0,0 +1,367 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// fx-load: load generator
+//
+// usage: fx-load [-d device] [-b baud] [-f 7E1] [-c clients] [-w write%]
+//                [-a ranges] [-n words] [-q rate] [-t seconds] [-T ms] [-M unit]
+//   -d  as for fx_serial_start(), or "sim" (default) to start fx-plcsim
+//       on a pty, paced at the baud rate, and use that
+//   -c  client threads (default 4)
+//   -w  percentage of requests that are writes (default 10)
+//   -a  device ranges to pick from, e.g. D0-999,X0-3,Y0-3 (X/Y in
+//       bytes); a range is chosen at random, then an address in it
+//   -n  words per request (default 1)
+//   -q  total requests per second, spread over the clients; 0 (default)
+//       runs closed loop, each client sending as soon as it has an answer
+//   -t  duration in seconds (default 10)
+//   -T  call timeout in ms (default the library's)
+//   -M  Modbus RTU to this unit (default format 8N1), also for the sim
+//
+// With a rate, requests go out on a fixed schedule and latency counts
+// from when a request was due, so a stalled link shows up as latency
+// instead of as fewer requests. Prints a line per second and a summary:
+// throughput, latency percentiles, failures by kind and how busy the
+// line was, from the characters moved and the measured PLC turnaround.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "fx-serial.h"
+
+#define MAX_RANGES 16
+
+struct range {
+	int flag;
+	int lo, hi;
+};
+
+struct client {
+	pthread_t tid;
+	int idx;
+	unsigned int seed;
+	int64_t *lat;		/* us, one per finished request */
+	int nlat, cap;
+	unsigned long ok, fail, queue;
+	unsigned long chars;	/* on the line, both ways */
+	unsigned long frames;
+};
+
+static struct fx_serial *s;
+static struct range ranges[MAX_RANGES];
+static int nranges;
+static int clients = 4, write_pct = 10, words = 1, duration = 10;
+static int modbus;		/* -M: unit */
+static double rate;
+static int64_t t_start, t_end;
+
+static int64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static void sleep_until_us(int64_t t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = t / 1000000;
+	ts.tv_nsec = t % 1000000 * 1000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static int parse_ranges(char *arg)
+{
+	char *tok;
+
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		struct range *r = &ranges[nranges];
+		if (nranges == MAX_RANGES)
+			return -1;
+		switch (tok[0]) {
+		case 'X': r->flag = 0; break;
+		case 'Y': r->flag = 1; break;
+		case 'D': r->flag = 2; break;
+		default: return -1;
+		}
+		if (sscanf(tok + 1, "%d-%d", &r->lo, &r->hi) != 2) {
+			if (sscanf(tok + 1, "%d", &r->lo) != 1)
+				return -1;
+			r->hi = r->lo;
+		}
+		if (r->lo < 0 || r->hi < r->lo)
+			return -1;
+		nranges++;
+	}
+	return nranges ? 0 : -1;
+}
+
+static void *client_main(void *arg)
+{
+	struct client *c = arg;
+	int64_t period = rate > 0 ? (int64_t)(1e6 * clients / rate) : 0;
+	int64_t due = t_start + (period ? period * c->idx / clients : 0);
+	int data[FX_BLOCK_MAX];
+
+	while (1) {
+		const struct range *r = &ranges[rand_r(&c->seed) % nranges];
+		int id = r->lo + rand_r(&c->seed) % (r->hi - r->lo + 1);
+		int wr = (int)(rand_r(&c->seed) % 100) < write_pct;
+		int64_t t0, t1;
+		int ret, i;
+
+		if (period) {
+			if (due >= t_end)
+				break;
+			sleep_until_us(due);
+			t0 = due;
+			due += period;
+		} else {
+			t0 = now_us();
+			if (t0 >= t_end)
+				break;
+		}
+
+		if (wr) {
+			for (i = 0; i < words; i++)
+				data[i] = rand_r(&c->seed) & 0xFFFF;
+			ret = fx_register_set_block(s, id, words, data, r->flag);
+		} else {
+			ret = fx_register_get_block(s, id, words, data, r->flag);
+		}
+		t1 = now_us();
+
+		if (c->nlat == c->cap) {
+			c->cap = c->cap ? c->cap * 2 : 4096;
+			c->lat = realloc(c->lat, c->cap * sizeof(int64_t));
+		}
+		c->lat[c->nlat++] = t1 - t0;
+		if (ret == 0) {
+			c->ok++;
+			c->frames++;
+			// request and answer characters, as in the frame builders
+			if (modbus)
+				c->chars += wr ? 9 + words*2 + 8 : 8 + 5 + words*2;
+			else
+				c->chars += wr ? 11 + words*4 + 1 : 11 + words*4 + 4;
+		} else if (ret == FX_EQUEUE) {
+			c->queue++;
+		} else {
+			c->fail++;
+		}
+	}
+	return NULL;
+}
+
+static int cmp64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static pid_t sim_pid;
+
+/*
+ * Starts fx-plcsim next to this program on a pty and returns its path.
+ */
+static char *start_sim(const char *argv0, int baud)
+{
+	static char path[256];
+	char prog[512], b[16], u[16];
+	const char *slash = strrchr(argv0, '/');
+	int fd[2];
+	FILE *f;
+
+	snprintf(prog, sizeof(prog), "%.*sfx-plcsim", slash ? (int)(slash - argv0 + 1) : 2,
+			slash ? argv0 : "./");
+	snprintf(b, sizeof(b), "%d", baud);
+	snprintf(u, sizeof(u), "%d", modbus);
+	if (pipe(fd) != 0)
+		return NULL;
+	sim_pid = fork();
+	if (sim_pid < 0)
+		return NULL;
+	if (sim_pid == 0) {
+		dup2(fd[1], 1);
+		close(fd[0]);
+		close(fd[1]);
+		if (modbus)
+			execl(prog, prog, "-p", "-b", b, "-c", "4", "-M", u, (char *)NULL);
+		else
+			execl(prog, prog, "-p", "-b", b, "-c", "4", (char *)NULL);
+		_exit(127);
+	}
+	close(fd[1]);
+	f = fdopen(fd[0], "r");
+	if (f == NULL || fgets(path, sizeof(path), f) == NULL)
+		return NULL;
+	path[strcspn(path, "\r\n")] = 0;
+	return path;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d device] [-b baud] [-f 7E1] [-c clients] [-w write%%]\n"
+			"       [-a ranges] [-n words] [-q rate] [-t seconds] [-T ms] [-M unit]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *device = "sim", *fmt = NULL;
+	char def_ranges[] = "D0-999";
+	int baud = 9600, call_timeout = 0, opt, i, sec;
+	struct client *cl;
+	struct fx_stats st0, st1;
+	struct fx_timing tm;
+	int64_t *all;
+	unsigned long ok = 0, fail = 0, queue = 0, chars = 0, frames = 0, n = 0, last = 0;
+	double el;
+
+	while ((opt = getopt(argc, argv, "d:b:f:c:w:a:n:q:t:T:M:")) != -1) {
+		switch (opt) {
+		case 'd': device = optarg; break;
+		case 'b': baud = atoi(optarg); break;
+		case 'f': fmt = optarg; break;
+		case 'c': clients = atoi(optarg); break;
+		case 'w': write_pct = atoi(optarg); break;
+		case 'a':
+			if (parse_ranges(optarg) != 0)
+				usage(argv[0]);
+			break;
+		case 'n': words = atoi(optarg); break;
+		case 'q': rate = atof(optarg); break;
+		case 't': duration = atoi(optarg); break;
+		case 'T': call_timeout = atoi(optarg); break;
+		case 'M': modbus = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (fmt == NULL)
+		fmt = modbus ? "8N1" : "7E1";
+	if (strlen(fmt) != 3 || clients < 1 || words < 1 || words > FX_BLOCK_MAX ||
+			write_pct < 0 || write_pct > 100 || duration < 1)
+		usage(argv[0]);
+	if (nranges == 0)
+		parse_ranges(def_ranges);
+
+	if (strcmp(device, "sim") == 0) {
+		device = start_sim(argv[0], baud);
+		if (device == NULL) {
+			fprintf(stderr, "cannot start fx-plcsim\n");
+			return 1;
+		}
+	}
+	s = fx_serial_start((char *)device, baud, fmt[0], fmt[1], fmt[2]);
+	if (s == NULL) {
+		fprintf(stderr, "%s: cannot open\n", device);
+		if (sim_pid > 0)
+			kill(sim_pid, SIGTERM);
+		return 1;
+	}
+	if (call_timeout > 0)
+		fx_serial_set_call_timeout(s, call_timeout);
+	if (modbus && fx_serial_set_modbus(s, modbus, NULL) != 0)
+		usage(argv[0]);
+
+	printf("%s %d %s: %d clients, %d%% writes, %d words, %s%.0f req/s, %d s\n",
+			device, baud, fmt, clients, write_pct, words,
+			rate > 0 ? "" : "closed loop, ", rate, duration);
+
+	cl = calloc(clients, sizeof(*cl));
+	fx_serial_get_stats(s, &st0);
+	t_start = now_us() + 10000;
+	t_end = t_start + (int64_t)duration * 1000000;
+	for (i = 0; i < clients; i++) {
+		cl[i].idx = i;
+		cl[i].seed = 12345 + i;
+		pthread_create(&cl[i].tid, NULL, client_main, &cl[i]);
+	}
+
+	// the counters are read racily, good enough for a progress line
+	for (sec = 1; sec <= duration; sec++) {
+		unsigned long done = 0, bad = 0;
+		sleep_until_us(t_start + (int64_t)sec * 1000000);
+		for (i = 0; i < clients; i++) {
+			done += cl[i].ok + cl[i].fail + cl[i].queue;
+			bad += cl[i].fail + cl[i].queue;
+		}
+		printf("%4d s  %6lu req/s  %lu failed\n", sec, done - last, bad);
+		fflush(stdout);
+		last = done;
+	}
+
+	for (i = 0; i < clients; i++) {
+		pthread_join(cl[i].tid, NULL);
+		ok += cl[i].ok;
+		fail += cl[i].fail;
+		queue += cl[i].queue;
+		chars += cl[i].chars;
+		frames += cl[i].frames;
+		n += cl[i].nlat;
+	}
+	el = (now_us() - t_start) / 1e6;
+	fx_serial_get_stats(s, &st1);
+	fx_serial_get_timing(s, &tm);
+
+	all = malloc((n ? n : 1) * sizeof(int64_t));
+	for (i = 0, n = 0; i < clients; i++) {
+		memcpy(all + n, cl[i].lat, cl[i].nlat * sizeof(int64_t));
+		n += cl[i].nlat;
+		free(cl[i].lat);
+	}
+	qsort(all, n, sizeof(int64_t), cmp64);
+
+	printf("\nrequests   %lu in %.1f s: %.1f req/s, %lu ok, %lu failed, %lu queue full\n",
+			n, el, n / el, ok, fail, queue);
+	if (n) {
+		printf("latency    p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f ms\n",
+				all[n/2] / 1e3, all[n*90/100] / 1e3, all[n*99/100] / 1e3,
+				all[n*999/1000] / 1e3, all[n-1] / 1e3);
+	}
+	printf("link       %lu timeouts, %lu bad answers, %lu expired, %lu cancelled, %lu reconnects\n",
+			st1.timeouts - st0.timeouts, st1.errors - st0.errors,
+			st1.expired - st0.expired, st1.cancelled - st0.cancelled,
+			st1.reconnects - st0.reconnects);
+	printf("line       %.1f%% data, %.1f%% busy (char %d us, turnaround %d us)\n",
+			100.0 * chars * tm.char_us / (el * 1e6),
+			100.0 * ((double)chars * tm.char_us + (double)frames * tm.turnaround_us) / (el * 1e6),
+			tm.char_us, tm.turnaround_us);
+
+	free(all);
+	free(cl);
+	fx_serial_stop(s);
+	if (sim_pid > 0) {
+		kill(sim_pid, SIGTERM);
+		waitpid(sim_pid, NULL, 0);
+	}
+	return fail || queue ? 1 : 0;
+}
@@ -0,0 +1,248 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include "fx-modbus.h"
+
+#define MB_READ_COILS     0x01
+#define MB_READ_INPUTS    0x02
+#define MB_READ_HOLDING   0x03
+#define MB_WRITE_COIL     0x05
+#define MB_WRITE_COILS    0x0F
+#define MB_WRITE_HOLDING  0x10
+
+static uint16_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void _crc_init(void)
+{
+	uint16_t c;
+	int k, j;
+
+	for (k = 0; k < 256; k++) {
+		c = k;
+		for (j = 0; j < 8; j++)
+			c = c & 1 ? 0xA001 ^ (c >> 1) : c >> 1;
+		crc_table[k] = c;
+	}
+}
+
+uint16_t fx_modbus_crc(const void *buf, int len)
+{
+	const uint8_t *p = buf;
+	uint16_t crc = 0xFFFF;
+	int i;
+
+	// one worker per port may get here first
+	pthread_once(&crc_once, _crc_init);
+	for (i = 0; i < len; i++)
+		crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+static int _hexv(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static int _hex(const char *p, int n)
+{
+	int v = 0, d;
+
+	while (n--) {
+		if ((d = _hexv(*p++)) < 0)
+			return -1;
+		v = v << 4 | d;
+	}
+	return v;
+}
+
+static void _put_hex(char *p, int v, int n)
+{
+	while (n--) {
+		p[n] = "0123456789ABCDEF"[v & 0xF];
+		v >>= 4;
+	}
+}
+
+static int _put16(uint8_t *p, int v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+	return 2;
+}
+
+static int _seal(uint8_t *out, int n)
+{
+	uint16_t crc = fx_modbus_crc(out, n);
+
+	// the CRC goes low byte first, unlike everything else
+	out[n] = crc & 0xFF;
+	out[n+1] = crc >> 8;
+	return n + 2;
+}
+
+/*
+ * Bit number in the Modbus space for programming port byte address a,
+ * with *input set for X. -1 for bytes that have no bits there.
+ */
+static int _bit(const struct fx_modbus_map *map, int a, int *input)
+{
+	*input = 0;
+	if (a >= 0x80 && a < 0xA0) {
+		*input = 1;
+		return map->x + (a - 0x80)*8;
+	}
+	if (a >= 0xA0 && a < 0xC0)
+		return map->y + (a - 0xA0)*8;
+	if (a >= 0x100 && a < 0x180)
+		return map->m + (a - 0x100)*8;
+	return -1;
+}
+
+int fx_modbus_request(const struct fx_modbus_map *map, int unit, const char *frame, int sz,
+		uint8_t *out, int *answer)
+{
+	int a, n, i, bit, input, k = 0;
+
+	if (sz < 9 || frame[0] != 0x02)
+		return -1;
+	out[k++] = unit;
+
+	// force on / off: bit address, low byte first
+	if (frame[1] == '7' || frame[1] == '8') {
+		a = _hex(frame + 4, 2) << 8 | _hex(frame + 2, 2);
+		if (a < 0 || (bit = _bit(map, a / 8, &input)) < 0 || input)
+			return -1;
+		out[k++] = MB_WRITE_COIL;
+		k += _put16(out + k, bit + a % 8);
+		k += _put16(out + k, frame[1] == '7' ? 0xFF00 : 0x0000);
+		*answer = 8;
+		return _seal(out, k);
+	}
+
+	if (sz < 11 || (frame[1] != '0' && frame[1] != '1'))
+		return -1;
+	a = _hex(frame + 2, 4);
+	n = _hex(frame + 6, 2);
+	if (a < 0 || n <= 0 || (frame[1] == '1' && sz != 11 + n*2))
+		return -1;
+
+	if (a >= 0x0E00) {
+		// D: two bytes a register, low byte first on the programming
+		// port; D8000..D8255 come before D0 there, after D7999 here
+		int reg = a < 0x1000 ? 8000 + (a - 0x0E00)/2 : (a - 0x1000)/2;
+		if ((a & 1) || (n & 1) || (a < 0x1000 && a + n > 0x1000))
+			return -1;
+		if (frame[1] == '0') {
+			out[k++] = MB_READ_HOLDING;
+			k += _put16(out + k, map->d + reg);
+			k += _put16(out + k, n/2);
+			*answer = 5 + n;
+			return _seal(out, k);
+		}
+		out[k++] = MB_WRITE_HOLDING;
+		k += _put16(out + k, map->d + reg);
+		k += _put16(out + k, n/2);
+		out[k++] = n;
+		for (i = 0; i < n; i += 2) {
+			int lo = _hex(frame + 8 + i*2, 2), hi = _hex(frame + 10 + i*2, 2);
+			if (lo < 0 || hi < 0)
+				return -1;
+			out[k++] = hi;
+			out[k++] = lo;
+		}
+		*answer = 8;
+		return _seal(out, k);
+	}
+
+	// bit devices, eight to a byte, lowest bit first in both
+	if ((bit = _bit(map, a, &input)) < 0 || _bit(map, a + n - 1, &i) < 0 || i != input)
+		return -1;
+	if (frame[1] == '0') {
+		out[k++] = input ? MB_READ_INPUTS : MB_READ_COILS;
+		k += _put16(out + k, bit);
+		k += _put16(out + k, n*8);
+		*answer = 5 + n;
+		return _seal(out, k);
+	}
+	if (input)
+		return -1;
+	out[k++] = MB_WRITE_COILS;
+	k += _put16(out + k, bit);
+	k += _put16(out + k, n*8);
+	out[k++] = n;
+	for (i = 0; i < n; i++) {
+		int v = _hex(frame + 8 + i*2, 2);
+		if (v < 0)
+			return -1;
+		out[k++] = v;
+	}
+	*answer = 8;
+	return _seal(out, k);
+}
+
+int fx_modbus_answer(const uint8_t *req, const uint8_t *in, int n, char *resp)
+{
+	int i, sum, cnt;
+
+	if (n < 5 || fx_modbus_crc(in, n - 2) != (in[n-2] | in[n-1] << 8))
+		return -1;
+	if (in[0] != req[0] || (in[1] & 0x7F) != req[1])
+		return -1;
+
+	if (in[1] & 0x80) {
+		resp[0] = 0x15;
+		return 1;
+	}
+
+	switch (in[1]) {
+	case MB_READ_COILS:
+	case MB_READ_INPUTS:
+	case MB_READ_HOLDING:
+		cnt = in[2];
+		if (cnt != n - 5)
+			return -1;
+		resp[0] = 0x02;
+		for (i = 0; i < cnt; i++) {
+			// registers come high byte first
+			int b = in[1] == MB_READ_HOLDING ? in[3 + (i ^ 1)] : in[3 + i];
+			_put_hex(resp + 1 + i*2, b, 2);
+		}
+		resp[1 + cnt*2] = 0x03;
+		for (i = 1, sum = 0; i <= 1 + cnt*2; i++)
+			sum += resp[i];
+		_put_hex(resp + 2 + cnt*2, sum & 0xFF, 2);
+		return cnt*2 + 4;
+
+	default:
+		// writes echo function, address and quantity or value
+		if (n != 8 || memcmp(in + 2, req + 2, 4) != 0)
+			return -1;
+		resp[0] = 0x06;
+		return 1;
+	}
+}
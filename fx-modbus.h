@@ -0,0 +1,77 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FX_MODBUS_H_
+#define FX_MODBUS_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Modbus RTU
+//
+// With fx_serial_set_modbus() the worker translates each programming
+// port frame into a Modbus RTU request on the way out and the answer
+// back on the way in, so every call above works unchanged:
+//   X bytes (0x80..)        read discrete inputs (02)
+//   Y bytes (0xA0..)        read coils (01), write multiple coils (15)
+//   M bytes (0x100..)       as Y
+//   D registers (0x1000.., D8000.. at 0x0E00)
+//                           read / write holding registers (03, 16)
+//   force on / off          write single coil (05)
+// Data goes binary with a CRC-16 instead of two hex characters a byte,
+// so the same line carries about twice as much. Frames are told apart
+// by silence: a request goes out only after 3.5 characters of quiet
+// (1.75 ms above 19200 baud).
+//////////////////////////////////////////////////////////////////
+
+#define FX_MODBUS_MAX 260	/* largest RTU frame we send or expect */
+
+// where devices start in the Modbus address spaces; the default is the
+// FX3U-485ADP-MB default assignment
+struct fx_modbus_map {
+	int x;			/* discrete input of X000 */
+	int y;			/* coil of Y000 */
+	int m;			/* coil of M0 */
+	int d;			/* holding register of D0 */
+};
+#define FX_MODBUS_MAP_DEFAULT { 0x0000, 0x3300, 0x0000, 0x0000 }
+
+uint16_t fx_modbus_crc(const void *buf, int len);
+
+// Programming port frame to RTU request for unit; returns the request
+// size and the size of a good answer in *answer, -1 if the frame has no
+// Modbus counterpart (other devices, odd D addresses, forcing X).
+int fx_modbus_request(const struct fx_modbus_map *map, int unit, const char *frame, int sz,
+		uint8_t *out, int *answer);
+
+// RTU answer to out back to what the programming port would have
+// answered: STX data ETX sum, ACK, or NAK for an exception. -1 for a
+// bad CRC or an answer that does not belong to the request.
+int fx_modbus_answer(const uint8_t *req, const uint8_t *in, int n, char *resp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
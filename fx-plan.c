@@ -0,0 +1,307 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fx-plan.h"
+
+#define PLAN_FRAME_BYTES 64	/* largest read of the programming port */
+#define PLAN_REQ_CHARS   11	/* STX '0' addr(4) count(2) ETX sum(2) */
+#define PLAN_RESP_CHARS  4	/* STX, ETX, sum(2) around the data */
+#define PLAN_GAP_US      1000	/* worker pause between transactions */
+
+struct plan_frame {
+	int addr;		/* first byte */
+	int bytes;
+	int at;			/* offset of its data in the execute buffer */
+};
+
+struct fx_plan {
+	int n;			/* addresses */
+	int nframes;
+	int bytes;		/* sum of all frames */
+	int cost_us;
+	int *at;		/* per address: offset of its first byte */
+	int *len;		/* per address: 1 or 2 bytes */
+	struct plan_frame *frames;
+};
+
+struct plan_item {
+	int addr;
+	int len;
+};
+
+static int _plan_addr(const struct fx_addr *a, int *len)
+{
+	int x;
+
+	switch (a->flag) {
+	case 0:
+		x = 0x80 + a->id;
+		*len = 1;
+		break;
+	case 1:
+		x = 0xA0 + a->id;
+		*len = 1;
+		break;
+	case 3:
+		x = a->id < 0x80 ? 0x100 + a->id : 0x10000;
+		*len = 1;
+		break;
+	case 2:
+		// D8000..D8255 below D0, as the PLC has them
+		x = a->id >= 8000 && a->id < 8256 ? 0x0E00 + (a->id - 8000)*2 : 0x1000 + a->id*2;
+		*len = 2;
+		break;
+	default:
+		return -1;
+	}
+	if (a->id < 0 || x + *len > 0x10000)
+		return -1;
+	return x;
+}
+
+static int _item_cmp(const void *a, const void *b)
+{
+	const struct plan_item *x = a, *y = b;
+
+	if (x->addr != y->addr)
+		return x->addr - y->addr;
+	return x->len - y->len;
+}
+
+static int _frame_cost(const struct fx_timing *t, int bytes)
+{
+	return t->turnaround_us + PLAN_GAP_US + (PLAN_REQ_CHARS + PLAN_RESP_CHARS + bytes*2) * t->char_us;
+}
+
+/*
+ * Items are sorted by address, so a frame is always a run of them and
+ * the best cut is a shortest path: best[j] is the cheapest way to read
+ * the first j items, trying every frame that can end with item j-1.
+ */
+static int _plan_cut(const struct fx_timing *t, const struct plan_item *it, int n,
+		struct plan_frame *frames)
+{
+	int *best = malloc((n+1) * sizeof(int));
+	int *from = malloc((n+1) * sizeof(int));
+	int i, j, nframes = 0;
+
+	if (best == NULL || from == NULL) {
+		free(best);
+		free(from);
+		return -1;
+	}
+
+	best[0] = 0;
+	for (j = 1; j <= n; j++) {
+		int end = it[j-1].addr + it[j-1].len;
+
+		best[j] = -1;
+		for (i = j; i > 0; i--) {
+			if (it[i-1].addr + it[i-1].len > end)
+				end = it[i-1].addr + it[i-1].len;
+			int bytes = end - it[i-1].addr;
+			if (bytes > PLAN_FRAME_BYTES)
+				break;
+			int c = best[i-1] + _frame_cost(t, bytes);
+			if (best[j] < 0 || c < best[j]) {
+				best[j] = c;
+				from[j] = i-1;
+			}
+		}
+	}
+
+	// walk the cuts back, then put the frames in address order
+	for (j = n; j > 0; j = from[j])
+		nframes++;
+	i = nframes;
+	for (j = n; j > 0; j = from[j]) {
+		int k, end = 0;
+		for (k = from[j]; k < j; k++)
+			if (it[k].addr + it[k].len > end)
+				end = it[k].addr + it[k].len;
+		frames[--i].addr = it[from[j]].addr;
+		frames[i].bytes = end - it[from[j]].addr;
+	}
+
+	free(best);
+	free(from);
+	return nframes;
+}
+
+struct fx_plan *fx_plan_create(struct fx_serial *s, const struct fx_addr *addrs, int n)
+{
+	struct fx_timing t;
+	struct plan_item *it;
+	struct fx_plan *p;
+	int i, j, m;
+
+	if (s == NULL || addrs == NULL || n <= 0)
+		return NULL;
+	fx_serial_get_timing(s, &t);
+
+	p = calloc(1, sizeof(*p));
+	it = malloc(n * sizeof(*it));
+	if (p == NULL || it == NULL)
+		goto err;
+	p->n = n;
+	p->at = malloc(n * sizeof(int));
+	p->len = malloc(n * sizeof(int));
+	p->frames = malloc(n * sizeof(struct plan_frame));
+	if (p->at == NULL || p->len == NULL || p->frames == NULL)
+		goto err;
+
+	for (i = 0; i < n; i++) {
+		it[i].addr = _plan_addr(&addrs[i], &it[i].len);
+		if (it[i].addr < 0)
+			goto err;
+	}
+
+	// duplicates cost nothing extra, the same bytes scatter twice
+	qsort(it, n, sizeof(*it), _item_cmp);
+	for (i = 1, m = 1; i < n; i++)
+		if (it[i].addr != it[m-1].addr || it[i].len != it[m-1].len)
+			it[m++] = it[i];
+
+	p->nframes = _plan_cut(&t, it, m, p->frames);
+	if (p->nframes < 0)
+		goto err;
+	for (i = 0; i < p->nframes; i++) {
+		p->frames[i].at = p->bytes;
+		p->bytes += p->frames[i].bytes;
+		p->cost_us += _frame_cost(&t, p->frames[i].bytes);
+	}
+
+	// frames are sorted and disjoint: find each address's frame
+	for (i = 0; i < n; i++) {
+		int len, x = _plan_addr(&addrs[i], &len);
+		int lo = 0, hi = p->nframes - 1;
+		while (lo < hi) {
+			j = (lo + hi + 1) / 2;
+			if (p->frames[j].addr <= x)
+				lo = j;
+			else
+				hi = j - 1;
+		}
+		p->at[i] = p->frames[lo].at + x - p->frames[lo].addr;
+		p->len[i] = len;
+	}
+
+	free(it);
+	return p;
+
+err:
+	free(it);
+	fx_plan_free(p);
+	return NULL;
+}
+
+void fx_plan_free(struct fx_plan *p)
+{
+	if (p == NULL)
+		return;
+	free(p->at);
+	free(p->len);
+	free(p->frames);
+	free(p);
+}
+
+int fx_plan_frames(const struct fx_plan *p)
+{
+	return p->nframes;
+}
+
+int fx_plan_cost_us(const struct fx_plan *p)
+{
+	return p->cost_us;
+}
+
+static int _hex(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static int _plan_read(struct fx_serial *s, const struct plan_frame *f, unsigned char *out)
+{
+	char frame[16], resp[PLAN_FRAME_BYTES*2 + PLAN_RESP_CHARS];
+	int i, sum = 0, sz;
+
+	snprintf(frame, sizeof(frame), "\x02" "0%04X%02X\x03", f->addr, f->bytes);
+	for (i = 1; i < 9; i++)
+		sum += frame[i];
+	snprintf(frame + 9, sizeof(frame) - 9, "%02X", sum & 0xFF);
+
+	sz = fx_raw_command(s, frame, 11, resp, sizeof(resp));
+	if (sz == FX_EQUEUE)
+		return FX_EQUEUE;
+	if (sz != f->bytes*2 + PLAN_RESP_CHARS || resp[0] != 0x02)
+		return -1;
+
+	for (i = 0; i < f->bytes; i++) {
+		int hi = _hex(resp[1+i*2]), lo = _hex(resp[2+i*2]);
+		if (hi < 0 || lo < 0)
+			return -1;
+		out[i] = hi << 4 | lo;
+	}
+	return 0;
+}
+
+int fx_plan_execute(struct fx_serial *s, const struct fx_plan *p, int *values)
+{
+	unsigned char *buf;
+	int i, ret = 0;
+
+	if (s == NULL || p == NULL || values == NULL)
+		return -1;
+	buf = malloc(p->bytes);
+	if (buf == NULL)
+		return -1;
+
+	for (i = 0; i < p->nframes && ret == 0; i++)
+		ret = _plan_read(s, &p->frames[i], buf + p->frames[i].at);
+
+	if (ret == 0) {
+		for (i = 0; i < p->n; i++) {
+			const unsigned char *b = buf + p->at[i];
+			values[i] = p->len[i] == 1 ? b[0] : b[0] | b[1] << 8;
+		}
+	}
+	free(buf);
+	return ret;
+}
+
+int fx_read_many(struct fx_serial *s, const struct fx_addr *addrs, int n, int *values)
+{
+	struct fx_plan *p = fx_plan_create(s, addrs, n);
+	int ret;
+
+	if (p == NULL)
+		return -1;
+	ret = fx_plan_execute(s, p, values);
+	fx_plan_free(p);
+	return ret;
+}
@@ -0,0 +1,67 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FX_PLAN_H_
+#define FX_PLAN_H_
+
+#include "fx-serial.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Reads of scattered devices, batched into block frames
+//
+// fx_plan_create() sorts the addresses by PLC memory address and cuts
+// them into read frames so that the estimated line time is smallest: a
+// frame costs the PLC turnaround, the worker gap and the request and
+// answer characters, a gap between two wanted addresses costs two
+// characters per unwanted byte. Timing comes from fx_serial_get_timing(),
+// so a plan made after the first answers uses the measured turnaround.
+// A plan does not change; keep it and execute it every poll.
+//
+// values[i] gets addrs[i]: the byte at id for X, Y and M (X0..X7 in bit
+// 0..7 of id 0), the register for D.
+//////////////////////////////////////////////////////////////////
+
+struct fx_addr {
+	int flag;		/* 0 X, 1 Y, 2 D, 3 M */
+	int id;			/* X/Y/M byte address, D register number */
+};
+
+struct fx_plan;
+
+struct fx_plan *fx_plan_create(struct fx_serial *ss, const struct fx_addr *addrs, int n);
+int fx_plan_execute(struct fx_serial *ss, const struct fx_plan *plan, int *values);
+void fx_plan_free(struct fx_plan *plan);
+
+// frames per execution and their estimated line time
+int fx_plan_frames(const struct fx_plan *plan);
+int fx_plan_cost_us(const struct fx_plan *plan);
+
+// plan, execute and free in one go
+int fx_read_many(struct fx_serial *ss, const struct fx_addr *addrs, int n, int *values);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
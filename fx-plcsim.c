@@ -0,0 +1,730 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// fx-plcsim: a PLC stand-in that speaks the programming port protocol
+//
+// usage: fx-plcsim [-t port | -u path | -p] [-b baud [-c bytes]] [-r us] [-s us] [-S stations | -M unit]
+//   -t  listen on a TCP port (raw, or RFC2217: telnet commands are ignored)
+//   -u  listen on a Unix stream socket
+//   -p  create a pty and print its path (default)
+//   -b  pace the line as if at this baud rate (10 bit characters): a
+//       frame is taken as received when its last character would have
+//       arrived, and responses take as long to go out
+//   -c  with -b, write responses this many bytes at a time as they would
+//       come off a UART, instead of all at once after the whole time
+//   -r  turnaround time before each response, in microseconds
+//   -s  scan time in microseconds, shown in D8010..D8012 (current,
+//       shortest, longest, 0.1 ms units) with 10% of jitter
+//   -S  also be an RS-485 bus with these stations, e.g. 0,1,5: answer
+//       dedicated protocol format 1 WR/WW frames addressed to them
+//   -M  speak Modbus RTU instead, as this unit, with the default device
+//       assignment of fx-modbus.h (raw connections only, no telnet)
+//
+// Device memory is emulated, so what is written can be read back. Each
+// station has memory of its own.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include "fx-modbus.h"
+
+#define STX 0x02
+#define ETX 0x03
+#define ENQ 0x05
+#define ACK 0x06
+#define NAK 0x15
+
+#define MAX_CONN 16
+#define MAX_STATION 16
+
+static unsigned char mem[0x10000];
+static unsigned char (*st_mem)[0x10000];
+static int stations;		/* bit per station on the bus */
+static int baud;
+static int chunk;
+static int turnaround;
+static int mb_unit;		/* -M: Modbus RTU slave */
+static int scan_us;
+
+struct conn {
+	int fd;
+	int pty;
+	int len;
+	unsigned char buf[1024];
+	int telnet;		/* inside an IAC sequence */
+};
+
+static struct conn conns[MAX_CONN];
+
+static int hexval(unsigned char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+static int hex(const unsigned char *p, int n)
+{
+	int v = 0;
+
+	while (n--) {
+		int d = hexval(*p++);
+		if (d < 0)
+			return -1;
+		v = v * 16 + d;
+	}
+	return v;
+}
+
+static void put_hex(unsigned char *p, int v, int n)
+{
+	static const char digits[] = "0123456789ABCDEF";
+
+	while (n--) {
+		p[n] = digits[v & 0xF];
+		v >>= 4;
+	}
+}
+
+// a frame that came in all at once over a pty or socket
+static void receive_time(int len)
+{
+	if (baud)
+		usleep((long long)len * 10 * 1000000 / baud);
+}
+
+static void reply(struct conn *c, const unsigned char *buf, int len)
+{
+	int n;
+
+	if (turnaround)
+		usleep(turnaround);
+	for (; len > 0; buf += n, len -= n) {
+		n = chunk > 0 && chunk < len ? chunk : len;
+		if (baud)
+			usleep((long long)n * 10 * 1000000 / baud);
+		if (write(c->fd, buf, n) < 0) {
+			perror("write");
+			return;
+		}
+	}
+}
+
+static void reply_byte(struct conn *c, unsigned char b)
+{
+	reply(c, &b, 1);
+}
+
+static void put_word(int addr, int v)
+{
+	mem[addr] = v & 0xFF;
+	mem[addr + 1] = v >> 8;
+}
+
+// D8010..D8012 as the PLC keeps them
+static void scan_registers(void)
+{
+	int t = scan_us / 100;
+
+	if (t == 0)
+		return;
+	put_word(0x0E14, t - t/10 + rand() % (t/5 + 1));
+	put_word(0x0E16, t - t/10);
+	put_word(0x0E18, t + t/10);
+}
+
+/*
+ * Handles one complete STX ... ETX sum frame.
+ */
+static void serve_frame(struct conn *c, const unsigned char *f, int len)
+{
+	unsigned char out[600];
+	int i, sum = 0, addr, cnt;
+
+	for (i = 1; i < len - 2; i++)
+		sum += f[i];
+	if (hex(f + len - 2, 2) != (sum & 0xFF)) {
+		reply_byte(c, NAK);
+		return;
+	}
+
+	switch (f[1]) {
+	case '0':	/* read: addr(4) count(2) */
+		addr = hex(f + 2, 4);
+		cnt = hex(f + 6, 2);
+		if (len != 11 || addr < 0 || cnt <= 0 || addr + cnt > (int)sizeof(mem)) {
+			reply_byte(c, NAK);
+			return;
+		}
+		out[0] = STX;
+		for (i = 0; i < cnt; i++)
+			put_hex(out + 1 + i*2, mem[addr + i], 2);
+		out[1 + cnt*2] = ETX;
+		for (sum = 0, i = 1; i <= 1 + cnt*2; i++)
+			sum += out[i];
+		put_hex(out + 2 + cnt*2, sum & 0xFF, 2);
+		reply(c, out, cnt*2 + 4);
+		return;
+
+	case '1':	/* write: addr(4) count(2) data(count*2) */
+		addr = hex(f + 2, 4);
+		cnt = hex(f + 6, 2);
+		if (addr < 0 || cnt <= 0 || len != 11 + cnt*2 || addr + cnt > (int)sizeof(mem)) {
+			reply_byte(c, NAK);
+			return;
+		}
+		for (i = 0; i < cnt; i++) {
+			int v = hex(f + 8 + i*2, 2);
+			if (v < 0) {
+				reply_byte(c, NAK);
+				return;
+			}
+			mem[addr + i] = v;
+		}
+		reply_byte(c, ACK);
+		return;
+
+	case '7':	/* force on / off: addr(4), bit address */
+	case '8':
+		addr = hex(f + 2, 4);
+		if (len != 9 || addr < 0) {
+			reply_byte(c, NAK);
+			return;
+		}
+		// bit addresses are little endian within the word
+		i = ((addr >> 8) | ((addr & 0xFF) << 8)) & 0xFFFF;
+		if (f[1] == '7')
+			mem[i / 8] |= 1 << (i % 8);
+		else
+			mem[i / 8] &= ~(1 << (i % 8));
+		reply_byte(c, ACK);
+		return;
+	}
+
+	reply_byte(c, NAK);
+}
+
+/*
+ * Telnet commands from an RFC2217 client are dropped. Returns 1 if b
+ * is a data byte.
+ */
+static int telnet_data(struct conn *c, unsigned char b)
+{
+	switch (c->telnet) {
+	case 1:		/* after IAC */
+		if (b == 255) {
+			c->telnet = 0;
+			return 1;
+		}
+		c->telnet = b == 250 ? 3 : (b >= 251 ? 2 : 0);
+		return 0;
+	case 2:		/* option of WILL/WONT/DO/DONT */
+		c->telnet = 0;
+		return 0;
+	case 3:		/* inside SB */
+		if (b == 255)
+			c->telnet = 4;
+		return 0;
+	case 4:		/* IAC inside SB */
+		c->telnet = b == 240 ? 0 : 3;
+		return 0;
+	}
+
+	if (b == 255) {
+		c->telnet = 1;
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Byte address of a format 1 device name such as D0100 or X0020, -1
+ * if it is not one we emulate.
+ */
+static int station_device(const unsigned char *d)
+{
+	int i, n = 0;
+
+	for (i = 1; i < 5; i++) {
+		if (d[i] < '0' || d[i] > '9')
+			return -1;
+		n = n * (d[0] == 'D' || d[0] == 'M' ? 10 : 8) + d[i] - '0';
+	}
+
+	switch (d[0]) {
+	case 'D': return n >= 8000 && n < 8256 ? 0x0E00 + (n - 8000)*2 : 0x1000 + n*2;
+	case 'X': return n % 16 ? -1 : 0x80 + n/8;
+	case 'Y': return n % 16 ? -1 : 0xA0 + n/8;
+	case 'M': return n % 16 || n >= 1024 ? -1 : 0x100 + n/8;
+	}
+	return -1;
+}
+
+/*
+ * Bytes a format 1 frame starting in buf has in total, 0 if more are
+ * needed to tell.
+ */
+static int station_frame_size(const unsigned char *buf, int len)
+{
+	int cnt;
+
+	if (len < 15)
+		return 0;
+	cnt = hex(buf + 13, 2);
+	if (cnt < 0)
+		return -1;
+	if (buf[5] == 'W' && buf[6] == 'W')
+		return 17 + cnt*4;
+	return 17;
+}
+
+static void serve_station(struct conn *c, const unsigned char *f, int len)
+{
+	unsigned char out[600], *m;
+	int i, sum = 0, st, addr, cnt;
+
+	st = hex(f + 1, 2);
+	if (st < 0 || st >= MAX_STATION || !(stations & (1 << st)))
+		return;		/* someone else on the bus */
+	m = st_mem[st];
+
+	for (i = 1; i < len - 2; i++)
+		sum += f[i];
+	addr = station_device(f + 8);
+	cnt = hex(f + 13, 2);
+
+	memcpy(out + 1, f + 1, 4);	/* station, PC number */
+	if (hex(f + len - 2, 2) != (sum & 0xFF) || addr < 0 || cnt <= 0 ||
+			addr + cnt*2 > (int)sizeof(mem)) {
+		out[0] = NAK;
+		put_hex(out + 5, hex(f + len - 2, 2) != (sum & 0xFF) ? 2 : 6, 2);
+		reply(c, out, 7);
+		return;
+	}
+
+	if (f[5] == 'W' && f[6] == 'R') {
+		out[0] = STX;
+		for (i = 0; i < cnt; i++)
+			put_hex(out + 5 + i*4, m[addr + i*2] | (m[addr + i*2 + 1] << 8), 4);
+		out[5 + cnt*4] = ETX;
+		for (sum = 0, i = 1; i <= 5 + cnt*4; i++)
+			sum += out[i];
+		put_hex(out + 6 + cnt*4, sum & 0xFF, 2);
+		reply(c, out, cnt*4 + 8);
+		return;
+	}
+
+	if (f[5] == 'W' && f[6] == 'W') {
+		for (i = 0; i < cnt; i++) {
+			int v = hex(f + 15 + i*4, 4);
+			m[addr + i*2] = v;
+			m[addr + i*2 + 1] = v >> 8;
+		}
+		out[0] = ACK;
+		reply(c, out, 5);
+		return;
+	}
+
+	out[0] = NAK;
+	put_hex(out + 5, 6, 2);
+	reply(c, out, 7);
+}
+
+// Modbus RTU
+//////////////////////////////////////////////////////////////////
+static const struct fx_modbus_map mb_map = FX_MODBUS_MAP_DEFAULT;
+
+/*
+ * Bit address in mem (byte*8 + bit) of Modbus input or coil b, -1 if
+ * there is none.
+ */
+static int mb_bit(int input, int b)
+{
+	if (input)
+		return b >= mb_map.x && b < mb_map.x + 256 ? 0x80*8 + b - mb_map.x : -1;
+	if (b >= mb_map.y && b < mb_map.y + 256)
+		return 0xA0*8 + b - mb_map.y;
+	if (b >= mb_map.m && b < mb_map.m + 1024)
+		return 0x100*8 + b - mb_map.m;
+	return -1;
+}
+
+// address in mem of holding register r, -1 if it is no D register
+static int mb_reg(int r)
+{
+	r -= mb_map.d;
+	if (r >= 0 && r < 8000)
+		return 0x1000 + r*2;
+	if (r >= 8000 && r < 8256)
+		return 0x0E00 + (r - 8000)*2;
+	return -1;
+}
+
+static int mb_frame_size(const unsigned char *buf, int len)
+{
+	if (len < 2)
+		return 0;
+	if (buf[1] == 0x0F || buf[1] == 0x10)
+		return len < 7 ? 0 : 9 + buf[6];
+	return 8;
+}
+
+static void mb_reply(struct conn *c, unsigned char *out, int len)
+{
+	uint16_t crc = fx_modbus_crc(out, len);
+
+	out[len] = crc & 0xFF;
+	out[len+1] = crc >> 8;
+	reply(c, out, len + 2);
+}
+
+static void serve_modbus(struct conn *c, const unsigned char *f, int len)
+{
+	unsigned char out[300];
+	int fn = f[1], addr = f[2] << 8 | f[3], qty = f[4] << 8 | f[5];
+	int i, b, k = 3;
+
+	// a bad CRC or another unit gets no answer at all
+	if (fx_modbus_crc(f, len - 2) != (f[len-2] | f[len-1] << 8) || f[0] != mb_unit)
+		return;
+
+	out[0] = f[0];
+	out[1] = fn;
+	switch (fn) {
+	case 0x01:	/* read coils, inputs */
+	case 0x02:
+		if (qty < 1 || qty > 2000)
+			goto bad_value;
+		out[2] = (qty + 7) / 8;
+		memset(out + 3, 0, out[2]);
+		for (i = 0; i < qty; i++) {
+			if ((b = mb_bit(fn == 0x02, addr + i)) < 0)
+				goto bad_address;
+			if (mem[b / 8] & 1 << (b % 8))
+				out[3 + i/8] |= 1 << (i % 8);
+		}
+		mb_reply(c, out, 3 + out[2]);
+		return;
+
+	case 0x03:	/* read holding registers: D, low byte first in mem */
+		if (qty < 1 || qty > 125)
+			goto bad_value;
+		out[2] = qty * 2;
+		for (i = 0; i < qty; i++) {
+			if ((b = mb_reg(addr + i)) < 0)
+				goto bad_address;
+			out[k++] = mem[b + 1];
+			out[k++] = mem[b];
+		}
+		mb_reply(c, out, k);
+		return;
+
+	case 0x05:	/* write single coil */
+		if (qty != 0xFF00 && qty != 0)
+			goto bad_value;
+		if ((b = mb_bit(0, addr)) < 0)
+			goto bad_address;
+		if (qty)
+			mem[b / 8] |= 1 << (b % 8);
+		else
+			mem[b / 8] &= ~(1 << (b % 8));
+		memcpy(out + 2, f + 2, 4);
+		mb_reply(c, out, 6);
+		return;
+
+	case 0x0F:	/* write multiple coils */
+		if (qty < 1 || f[6] != (qty + 7) / 8)
+			goto bad_value;
+		for (i = 0; i < qty; i++) {
+			if ((b = mb_bit(0, addr + i)) < 0)
+				goto bad_address;
+			if (f[7 + i/8] & 1 << (i % 8))
+				mem[b / 8] |= 1 << (b % 8);
+			else
+				mem[b / 8] &= ~(1 << (b % 8));
+		}
+		memcpy(out + 2, f + 2, 4);
+		mb_reply(c, out, 6);
+		return;
+
+	case 0x10:	/* write holding registers */
+		if (qty < 1 || qty > 123 || f[6] != qty * 2)
+			goto bad_value;
+		for (i = 0; i < qty; i++)
+			if (mb_reg(addr + i) < 0)
+				goto bad_address;
+		for (i = 0; i < qty; i++) {
+			b = mb_reg(addr + i);
+			mem[b + 1] = f[7 + i*2];
+			mem[b] = f[8 + i*2];
+		}
+		memcpy(out + 2, f + 2, 4);
+		mb_reply(c, out, 6);
+		return;
+	}
+
+	// exception: illegal function, address, value
+	out[2] = 0x01;
+	goto exception;
+bad_address:
+	out[2] = 0x02;
+	goto exception;
+bad_value:
+	out[2] = 0x03;
+exception:
+	out[1] = fn | 0x80;
+	mb_reply(c, out, 3);
+}
+
+static void serve_bytes(struct conn *c, const unsigned char *p, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		unsigned char b = p[i];
+
+		if (mb_unit) {
+			// no silence to go by here: frames are cut by size
+			if (c->len == 0 && b != mb_unit)
+				continue;
+			c->buf[c->len++] = b;
+			int size = mb_frame_size(c->buf, c->len);
+			if (size > (int)sizeof(c->buf)) {
+				c->len = 0;
+			} else if (size && c->len == size) {
+				receive_time(c->len);
+				scan_registers();
+				serve_modbus(c, c->buf, c->len);
+				c->len = 0;
+			}
+			continue;
+		}
+
+		if (!c->pty && !telnet_data(c, b))
+			continue;
+
+		if (c->len == 0 && b == ENQ && !stations) {
+			reply_byte(c, ACK);
+			continue;
+		}
+		if (c->len == 0 && b != STX && b != ENQ)
+			continue;
+		if (c->len == (int)sizeof(c->buf)) {
+			c->len = 0;
+			continue;
+		}
+		c->buf[c->len++] = b;
+
+		if (c->buf[0] == ENQ) {
+			int size = station_frame_size(c->buf, c->len);
+			if (size < 0 || size > (int)sizeof(c->buf)) {
+				c->len = 0;
+			} else if (size && c->len == size) {
+				receive_time(c->len);
+				serve_station(c, c->buf, c->len);
+				c->len = 0;
+			}
+			continue;
+		}
+
+		// ETX and two sum characters end a frame
+		if (c->len >= 4 && c->buf[c->len - 3] == ETX) {
+			receive_time(c->len);
+			scan_registers();
+			serve_frame(c, c->buf, c->len);
+			c->len = 0;
+		}
+	}
+}
+
+static int open_pty(void)
+{
+	struct termios tio;
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0)
+		return -1;
+	if (tcgetattr(fd, &tio) == 0) {
+		cfmakeraw(&tio);
+		tcsetattr(fd, TCSANOW, &tio);
+	}
+	printf("%s\n", ptsname(fd));
+	fflush(stdout);
+
+	return fd;
+}
+
+static int open_listener(int port, const char *path)
+{
+	int fd, one = 1;
+
+	if (path) {
+		struct sockaddr_un sun;
+
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+		unlink(path);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0 || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0)
+			return -1;
+	} else {
+		struct sockaddr_in sin;
+
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(port);
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0)
+			return -1;
+	}
+
+	if (listen(fd, 4) != 0)
+		return -1;
+
+	return fd;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-t port | -u path | -p] [-b baud [-c bytes]] [-r us] [-s us] [-S stations | -M unit]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = NULL;
+	int port = 0, lfd = -1, opt, i;
+	char *tok;
+
+	while ((opt = getopt(argc, argv, "t:u:pb:c:r:s:S:M:")) != -1) {
+		switch (opt) {
+		case 't': port = atoi(optarg); break;
+		case 'u': path = optarg; break;
+		case 'p': port = 0; path = NULL; break;
+		case 'b': baud = atoi(optarg); break;
+		case 'c': chunk = atoi(optarg); break;
+		case 'r': turnaround = atoi(optarg); break;
+		case 'M': mb_unit = atoi(optarg); break;
+		case 's': scan_us = atoi(optarg); break;
+		case 'S':
+			for (tok = strtok(optarg, ","); tok; tok = strtok(NULL, ","))
+				if (atoi(tok) >= 0 && atoi(tok) < MAX_STATION)
+					stations |= 1 << atoi(tok);
+			break;
+		default: usage(argv[0]);
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	if (stations)
+		st_mem = calloc(MAX_STATION, sizeof(*st_mem));
+	for (i = 0; i < MAX_CONN; i++)
+		conns[i].fd = -1;
+
+	if (port || path) {
+		lfd = open_listener(port, path);
+		if (lfd < 0) {
+			perror("listen");
+			return 1;
+		}
+	} else {
+		conns[0].fd = open_pty();
+		conns[0].pty = 1;
+		if (conns[0].fd < 0) {
+			perror("pty");
+			return 1;
+		}
+	}
+
+	for (;;) {
+		struct pollfd pfd[MAX_CONN + 1];
+		int n = 0, map[MAX_CONN + 1];
+
+		if (lfd >= 0) {
+			pfd[n].fd = lfd;
+			pfd[n].events = POLLIN;
+			map[n++] = -1;
+		}
+		for (i = 0; i < MAX_CONN; i++) {
+			if (conns[i].fd < 0)
+				continue;
+			pfd[n].fd = conns[i].fd;
+			pfd[n].events = POLLIN;
+			map[n++] = i;
+		}
+
+		if (poll(pfd, n, conns[0].pty ? 100 : -1) < 0 && errno != EINTR)
+			break;
+
+		for (i = 0; i < n; i++) {
+			unsigned char buf[512];
+			struct conn *c;
+			int cnt;
+
+			if (!pfd[i].revents)
+				continue;
+
+			if (map[i] < 0) {
+				int fd = accept(lfd, NULL, NULL), k;
+				for (k = 0; fd >= 0 && k < MAX_CONN; k++) {
+					if (conns[k].fd < 0) {
+						memset(&conns[k], 0, sizeof(conns[k]));
+						conns[k].fd = fd;
+						break;
+					}
+				}
+				if (fd >= 0 && k == MAX_CONN)
+					close(fd);
+				continue;
+			}
+
+			c = &conns[map[i]];
+			cnt = read(c->fd, buf, sizeof(buf));
+			if (cnt > 0) {
+				serve_bytes(c, buf, cnt);
+			} else if (c->pty) {
+				// no peer has the pty open right now
+				usleep(50000);
+			} else if (cnt == 0 || errno != EINTR) {
+				close(c->fd);
+				c->fd = -1;
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,242 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "fx-poll.h"
+
+struct poll_range {
+	struct fx_poll_range r;
+	int64_t period_us;
+	int64_t next;		/* monotonic us the next read is due */
+	int64_t last;		/* of the last good sample, 0: none */
+	int64_t interval_us;
+	int64_t latency_us;
+	unsigned long samples;
+	unsigned long failed;
+};
+
+struct fx_poll {
+	struct fx_serial *s;
+	fx_poll_cb cb;
+	void *user;
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	int stop;
+	struct fx_scan scan;
+	int64_t scan_next;
+	int n;
+	struct poll_range rg[];
+};
+
+static int64_t _now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static int64_t _ewma(int64_t avg, int64_t v)
+{
+	return avg ? avg + (v - avg) / 8 : v;
+}
+
+// with lock held
+static void _set_periods(struct fx_poll *p)
+{
+	int i;
+
+	for (i = 0; i < p->n; i++) {
+		struct poll_range *g = &p->rg[i];
+		int64_t want = (int64_t)g->r.period_ms * 1000;
+
+		if (want == 0 && p->scan.estimate_us == 0)
+			want = FX_POLL_MIN_MS * 1000;
+		g->period_us = want > p->scan.estimate_us ? want : p->scan.estimate_us;
+	}
+}
+
+/*
+ * D8010..D8012 hold the current, shortest and longest scan in 0.1 ms.
+ * A PLC (or adapter mapping) without them leaves the estimate alone.
+ */
+static void _read_scan(struct fx_poll *p)
+{
+	int d[3];
+
+	if (fx_register_get_block(p->s, 8010, 3, d, 2) != 0 || d[0] <= 0)
+		return;
+
+	pthread_mutex_lock(&p->lock);
+	p->scan.current_us = d[0] * 100;
+	p->scan.min_us = d[1] * 100;
+	p->scan.max_us = d[2] * 100;
+	p->scan.estimate_us = _ewma(p->scan.estimate_us, p->scan.current_us);
+	_set_periods(p);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void *_poll_thread(void *arg)
+{
+	struct fx_poll *p = arg;
+	int data[FX_BLOCK_MAX];
+	struct timespec ts;
+	int64_t now, due, t0;
+	int i, ret;
+
+	pthread_mutex_lock(&p->lock);
+	while (!p->stop) {
+		struct poll_range *g = NULL;
+
+		now = _now_us();
+		if (now >= p->scan_next) {
+			p->scan_next = now + FX_POLL_SCAN_MS*1000;
+			pthread_mutex_unlock(&p->lock);
+			_read_scan(p);
+			pthread_mutex_lock(&p->lock);
+			continue;
+		}
+
+		due = p->scan_next;
+		for (i = 0; i < p->n; i++) {
+			if (p->rg[i].next < due) {
+				due = p->rg[i].next;
+				g = &p->rg[i];
+			}
+		}
+		if (due > now) {
+			ts.tv_sec = due / 1000000;
+			ts.tv_nsec = due % 1000000 * 1000;
+			pthread_cond_timedwait(&p->cv, &p->lock, &ts);
+			continue;
+		}
+
+		pthread_mutex_unlock(&p->lock);
+		t0 = _now_us();
+		ret = fx_register_get_block(p->s, g->r.id, g->r.n, data, g->r.flag);
+		now = _now_us();
+		if (ret == 0)
+			p->cb(p->user, g - p->rg, data, g->r.n);
+		pthread_mutex_lock(&p->lock);
+
+		if (ret == 0) {
+			g->latency_us = _ewma(g->latency_us, now - t0);
+			if (g->last)
+				g->interval_us = _ewma(g->interval_us, now - g->last);
+			g->last = now;
+			g->samples++;
+		} else {
+			g->failed++;
+		}
+
+		// stay on the grid, but a range that fell behind does not
+		// make up for it with a burst
+		g->next += g->period_us;
+		if (g->next < now)
+			g->next = now;
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+struct fx_poll *fx_poll_start(struct fx_serial *s, const struct fx_poll_range *r, int n,
+		fx_poll_cb cb, void *user)
+{
+	struct fx_poll *p;
+	pthread_condattr_t ca;
+	int i;
+
+	if (s == NULL || cb == NULL || n <= 0)
+		return NULL;
+	for (i = 0; i < n; i++)
+		if (r[i].n < 1 || r[i].n > FX_BLOCK_MAX || r[i].period_ms < 0)
+			return NULL;
+
+	p = calloc(1, sizeof(*p) + n*sizeof(struct poll_range));
+	if (p == NULL)
+		return NULL;
+	p->s = s;
+	p->cb = cb;
+	p->user = user;
+	p->n = n;
+	for (i = 0; i < n; i++)
+		p->rg[i].r = r[i];
+	_set_periods(p);
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&p->cv, &ca);
+	pthread_condattr_destroy(&ca);
+
+	if (pthread_create(&p->tid, NULL, _poll_thread, p) != 0) {
+		pthread_cond_destroy(&p->cv);
+		pthread_mutex_destroy(&p->lock);
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+void fx_poll_stop(struct fx_poll *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_signal(&p->cv);
+	pthread_mutex_unlock(&p->lock);
+
+	pthread_join(p->tid, NULL);
+	pthread_cond_destroy(&p->cv);
+	pthread_mutex_destroy(&p->lock);
+	free(p);
+}
+
+int fx_poll_get_scan(struct fx_poll *p, struct fx_scan *scan)
+{
+	pthread_mutex_lock(&p->lock);
+	*scan = p->scan;
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+int fx_poll_get_range(struct fx_poll *p, int range, struct fx_poll_info *info)
+{
+	struct poll_range *g;
+
+	if (range < 0 || range >= p->n)
+		return -1;
+	g = &p->rg[range];
+
+	pthread_mutex_lock(&p->lock);
+	info->period_us = g->period_us;
+	info->interval_us = g->interval_us;
+	info->latency_us = g->latency_us;
+	info->age_us = g->last ? _now_us() - g->last : -1;
+	info->samples = g->samples;
+	info->failed = g->failed;
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
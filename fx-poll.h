@@ -0,0 +1,91 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FX_POLL_H_
+#define FX_POLL_H_
+
+#include "fx-serial.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Scan-aware polling
+//
+// A poller reads a set of device ranges over and over, each on a period
+// of its own, on a thread of its own, and hands every answer to a
+// callback. The PLC takes in its inputs and sets its outputs once per
+// scan, so reading a range more often than that only repeats what is
+// already known: the poller reads the scan time registers D8010..D8012
+// every FX_POLL_SCAN_MS and never polls a range faster than the current
+// scan time (smoothed), whatever period it asked for. The line time
+// saved goes to everything else. While the scan time is unknown the
+// wanted periods stand, FX_POLL_MIN_MS for "every scan".
+//
+// How fresh values really are comes back per range: the interval
+// achieved between samples (longer than the period when the line
+// cannot keep up) and the read round trip, so a value handed to the
+// callback reflects the PLC at most about interval + latency ago.
+//////////////////////////////////////////////////////////////////
+
+#define FX_POLL_SCAN_MS 1000
+#define FX_POLL_MIN_MS  10
+
+struct fx_poll_range {
+	int flag;		/* as fx_register_get_block() */
+	int id;
+	int n;			/* words, 1..FX_BLOCK_MAX */
+	int period_ms;		/* wanted, 0: every scan */
+};
+
+// on the poller thread, with the n words of range
+typedef void (*fx_poll_cb)(void *user, int range, const int *data, int n);
+
+struct fx_poll;
+
+struct fx_poll *fx_poll_start(struct fx_serial *ss, const struct fx_poll_range *r, int n,
+		fx_poll_cb cb, void *user);
+void fx_poll_stop(struct fx_poll *p);
+
+struct fx_scan {
+	int current_us;		/* D8010 */
+	int min_us;		/* D8011 */
+	int max_us;		/* D8012 */
+	int estimate_us;	/* moving average of current, 0: unknown */
+};
+int fx_poll_get_scan(struct fx_poll *p, struct fx_scan *scan);
+
+// 64 bit: a range failing for an hour, or polled that seldom, is past an int
+struct fx_poll_info {
+	int64_t period_us;	/* aimed at: wanted, at least one scan */
+	int64_t interval_us;	/* achieved between samples, moving average */
+	int64_t latency_us;	/* read round trip, moving average */
+	int64_t age_us;		/* since the last good sample, -1: none yet */
+	unsigned long samples;
+	unsigned long failed;
+};
+int fx_poll_get_range(struct fx_poll *p, int range, struct fx_poll_info *info);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,483 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// fx-replay: play a wire capture back
+//
+// usage: fx-replay [-s speed] [-n loops] [-R cpu,prio,period_us] -d device capture
+//                                                             (play as client)
+//        fx-replay -p [-s speed] [-d device] capture          (act as the PLC)
+//        fx-replay -x capture                                 (print records)
+//
+// As a client every recorded frame is sent through the library at its
+// recorded time (divided by speed, 0 = back to back) and the answer is
+// compared with the recorded one. -R puts the library worker in real-time
+// mode (pinned, SCHED_FIFO, memory locked, fixed period) and reports
+// how late its cycles started. As a PLC the recorded answer to each
+// frame is sent back after the recorded turnaround; without -d a pty is
+// created and its path printed, so the library can be pointed at it.
+// The link protocol (programming port, RS-485 stations or Modbus RTU)
+// is taken from the first recorded request.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/select.h>
+#include "fx-serial.h"
+#include "fx-capture.h"
+#include "fx-modbus.h"
+
+static double speed = 1.0;
+
+// what the captured link spoke, for framing requests in PLC mode
+enum { LINK_FX, LINK_STATION, LINK_RTU };
+static int link_proto = LINK_FX;
+
+static void sleep_until(uint64_t t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = t / 1000000000ull;
+	ts.tv_nsec = t % 1000000000ull;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static uint64_t scaled(uint64_t ns)
+{
+	return speed > 0 ? (uint64_t)(ns / speed) : 0;
+}
+
+// -x
+//////////////////////////////////////////////////////////////////
+static int print_capture(struct fx_cap_reader *r)
+{
+	static const char *dirs[] = { "END", "TX", "RX", "TIMEOUT" };
+	const struct fx_cap_header *h = fx_cap_get_header(r);
+	struct fx_cap_rec rec;
+	int i, ret;
+
+	printf("# %s %d %c%c%c\n", h->device, h->baude, h->bits, h->parity, h->stop);
+	while ((ret = fx_cap_next(r, &rec)) == 1) {
+		printf("%10.6f %-7s %3d ", rec.ts / 1e9,
+				rec.dir < 4 ? dirs[rec.dir] : "?", rec.len);
+		for (i = 0; i < rec.len; i++) {
+			uint8_t c = rec.data[i];
+			putchar(c >= 0x20 && c < 0x7f ? c : '.');
+		}
+		putchar('\n');
+	}
+
+	return ret < 0 ? 1 : 0;
+}
+
+// client: drive the library with the recorded frames
+//////////////////////////////////////////////////////////////////
+static struct fx_rt_config rt = { -1, 0, 1, 0 };
+static int use_rt;
+
+static int play_client(struct fx_cap_reader *r, const char *device, int loops)
+{
+	const struct fx_cap_header *h = fx_cap_get_header(r);
+	struct fx_serial *s;
+	struct fx_cap_rec rec, next;
+	int n_sent = 0, n_match = 0, n_diff = 0, n_fail = 0;
+	uint64_t lat_sum = 0, lat_max = 0, start, end;
+	char resp[4096];
+
+	s = fx_serial_start((char *)device, h->baude, h->bits, h->parity, h->stop);
+	if (s == NULL) {
+		fprintf(stderr, "%s: cannot open\n", device);
+		return 1;
+	}
+	if (use_rt && fx_serial_set_realtime(s, &rt) != 0)
+		fprintf(stderr, "real-time mode: %s\n", strerror(errno));
+
+	start = fx_cap_now();
+	while (loops-- > 0) {
+		uint64_t base = fx_cap_now();
+		int have_next = 0;
+
+		fx_cap_rewind(r);
+		for (;;) {
+			uint64_t t0, lat;
+			int sz;
+
+			if (have_next) {
+				rec = next;
+				have_next = 0;
+			} else if (fx_cap_next(r, &rec) != 1) {
+				break;
+			}
+			if (rec.dir != FX_CAP_TX)
+				continue;
+
+			if (speed > 0)
+				sleep_until(base + scaled(rec.ts));
+
+			t0 = fx_cap_now();
+			sz = fx_raw_command(s, (const char *)rec.data, rec.len, resp, sizeof(resp));
+			lat = fx_cap_now() - t0;
+			n_sent++;
+
+			have_next = fx_cap_next(r, &next) == 1;
+			if (sz < 0) {
+				n_fail++;
+				continue;
+			}
+			lat_sum += lat;
+			if (lat > lat_max)
+				lat_max = lat;
+
+			if (have_next && next.dir != FX_CAP_TX) {
+				if (next.len == sz && memcmp(next.data, resp, sz) == 0)
+					n_match++;
+				else
+					n_diff++;
+				have_next = 0;
+			}
+		}
+	}
+	end = fx_cap_now();
+
+	struct fx_jitter j;
+	int have_jitter = use_rt && fx_serial_get_jitter(s, &j) == 0;
+
+	fx_serial_stop(s);
+
+	printf("frames     %d\n", n_sent);
+	printf("same       %d\n", n_match);
+	printf("different  %d\n", n_diff);
+	printf("failed     %d\n", n_fail);
+	printf("elapsed    %.3f s\n", (end - start) / 1e9);
+	if (n_sent > n_fail)
+		printf("latency    avg %.3f ms, max %.3f ms\n",
+				lat_sum / 1e6 / (n_sent - n_fail), lat_max / 1e6);
+	if (have_jitter)
+		printf("jitter     %lu cycles, p50 %d us, p99 %d us, p999 %d us, max %d us\n",
+				j.cycles, j.p50_us, j.p99_us, j.p999_us, j.max_us);
+
+	return n_fail || n_diff ? 1 : 0;
+}
+
+// PLC: answer frames with the recorded responses
+//////////////////////////////////////////////////////////////////
+struct answer {
+	const uint8_t *req;
+	int req_len;
+	const uint8_t *resp;	/* NULL: the PLC never answered */
+	int resp_len;
+	uint64_t turnaround;
+	struct answer *next;	/* next recording of the same request */
+	struct answer *cursor;	/* on the head: answer to hand out next */
+};
+
+#define ANSWER_HASH 1024
+
+static unsigned hash(const uint8_t *p, int len)
+{
+	unsigned h = 2166136261u;
+
+	while (len--)
+		h = (h ^ *p++) * 16777619u;
+	return h & (ANSWER_HASH - 1);
+}
+
+/*
+ * One bucket per distinct request frame; its answers are chained in
+ * recording order and handed out round robin.
+ */
+struct bucket {
+	struct answer *head;
+	struct bucket *next;
+};
+
+static struct bucket *buckets[ANSWER_HASH];
+
+static struct answer *lookup(const uint8_t *req, int len)
+{
+	struct bucket *b;
+
+	for (b = buckets[hash(req, len)]; b; b = b->next)
+		if (b->head->req_len == len && memcmp(b->head->req, req, len) == 0)
+			return b->head;
+	return NULL;
+}
+
+static int load_answers(struct fx_cap_reader *r)
+{
+	struct fx_cap_rec rec, next;
+	int n = 0, have_next = 0;
+
+	fx_cap_rewind(r);
+	for (;;) {
+		struct answer *a, *head;
+
+		if (have_next) {
+			rec = next;
+			have_next = 0;
+		} else if (fx_cap_next(r, &rec) != 1) {
+			break;
+		}
+		if (rec.dir != FX_CAP_TX)
+			continue;
+
+		if (n == 0) {
+			if (rec.len >= 4 && fx_modbus_crc(rec.data, rec.len - 2) ==
+					(rec.data[rec.len-2] | rec.data[rec.len-1] << 8))
+				link_proto = LINK_RTU;
+			else if (rec.data[0] == 0x05)
+				link_proto = LINK_STATION;
+		}
+
+		a = calloc(1, sizeof(*a));
+		a->req = rec.data;
+		a->req_len = rec.len;
+		if (fx_cap_next(r, &next) == 1) {
+			if (next.dir == FX_CAP_TX) {
+				have_next = 1;
+			} else {
+				a->resp = next.data;
+				a->resp_len = next.len;
+				a->turnaround = next.ts - rec.ts;
+				// a timeout keeps its partial bytes but never completes
+				if (next.dir == FX_CAP_TIMEOUT && next.len == 0)
+					a->resp = NULL;
+			}
+		}
+
+		head = lookup(a->req, a->req_len);
+		if (head == NULL) {
+			struct bucket *b = calloc(1, sizeof(*b));
+			unsigned h = hash(a->req, a->req_len);
+
+			b->head = a;
+			b->next = buckets[h];
+			buckets[h] = b;
+			a->cursor = a;
+		} else {
+			struct answer *t = head;
+			while (t->next)
+				t = t->next;
+			t->next = a;
+		}
+		n++;
+	}
+
+	return n;
+}
+
+static int open_line(const char *device)
+{
+	struct termios tio;
+	int fd;
+
+	if (device) {
+		fd = open(device, O_RDWR | O_NOCTTY);
+	} else {
+		fd = posix_openpt(O_RDWR | O_NOCTTY);
+		if (fd >= 0 && (grantpt(fd) != 0 || unlockpt(fd) != 0)) {
+			close(fd);
+			fd = -1;
+		}
+		if (fd >= 0) {
+			printf("%s\n", ptsname(fd));
+			fflush(stdout);
+		}
+	}
+	if (fd < 0)
+		return -1;
+
+	if (tcgetattr(fd, &tio) == 0) {
+		cfmakeraw(&tio);
+		tcsetattr(fd, TCSANOW, &tio);
+	}
+
+	return fd;
+}
+
+/*
+ * Returns the length of the first complete frame in buf, 0 if more
+ * bytes are needed. Bytes before an STX (ENQ on a station link) are
+ * noise and skipped. Modbus RTU has no start byte, the function code
+ * gives the length of what the library sends.
+ */
+static int frame_len(uint8_t *buf, int *sz)
+{
+	int i, n, skip = 0, start = link_proto == LINK_STATION ? 0x05 : 0x02;
+
+	if (link_proto == LINK_RTU) {
+		// unit fn addr(2) qty(2) [bytes data] crc(2)
+		if (*sz < 7)
+			return 0;
+		n = buf[1] == 0x0F || buf[1] == 0x10 ? 9 + buf[6] : 8;
+		return n <= *sz ? n : 0;
+	}
+
+	while (skip < *sz && buf[skip] != start)
+		skip++;
+	if (skip) {
+		memmove(buf, buf + skip, *sz - skip);
+		*sz -= skip;
+	}
+
+	if (link_proto == LINK_STATION) {
+		// ENQ st(2) pc(2) cmd(2) wait(1) device(5) count(2) [data] sum(2)
+		char cnt[3] = { 0 };
+		if (*sz < 15)
+			return 0;
+		memcpy(cnt, buf + 13, 2);
+		n = 17;
+		if (buf[5] == 'W' && buf[6] == 'W')
+			n += strtol(cnt, NULL, 16) * 4;
+		return n <= *sz ? n : 0;
+	}
+
+	for (i = 1; i < *sz; i++)
+		if (buf[i] == 0x03)
+			return i + 3 <= *sz ? i + 3 : 0;
+
+	return 0;
+}
+
+static int play_plc(struct fx_cap_reader *r, const char *device)
+{
+	uint8_t buf[8192];
+	int sz = 0, fd, n_ans = 0, n_unknown = 0;
+
+	if (load_answers(r) == 0) {
+		fprintf(stderr, "capture has no frames\n");
+		return 1;
+	}
+
+	fd = open_line(device);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", device ? device : "pty", strerror(errno));
+		return 1;
+	}
+
+	for (;;) {
+		int n, len;
+
+		n = read(fd, buf + sz, sizeof(buf) - sz);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EIO && device == NULL) {
+			// pty without a peer yet (or any more)
+			usleep(100000);
+			continue;
+		}
+		if (n <= 0)
+			break;
+		sz += n;
+
+		while ((len = frame_len(buf, &sz)) > 0) {
+			struct answer *head = lookup(buf, len);
+			uint64_t t = fx_cap_now();
+
+			if (head == NULL) {
+				// a Modbus slave stays quiet; drop what is
+				// buffered, the next request starts clean
+				uint8_t nak = 0x15;
+				n_unknown++;
+				if (link_proto == LINK_RTU) {
+					sz = 0;
+					break;
+				}
+				write(fd, &nak, 1);
+			} else {
+				struct answer *a = head->cursor;
+
+				head->cursor = a->next ? a->next : head;
+				if (speed > 0)
+					sleep_until(t + scaled(a->turnaround));
+				if (a->resp)
+					write(fd, a->resp, a->resp_len);
+				n_ans++;
+			}
+
+			memmove(buf, buf + len, sz - len);
+			sz -= len;
+		}
+		if (sz == sizeof(buf))
+			sz = 0;
+	}
+
+	fprintf(stderr, "answered %d, unknown %d\n", n_ans, n_unknown);
+	close(fd);
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-s speed] [-n loops] [-R cpu,prio,period_us] -d device capture\n"
+		"       %s -p [-s speed] [-d device] capture\n"
+		"       %s -x capture\n", prog, prog, prog);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *device = NULL;
+	struct fx_cap_reader *r;
+	int plc = 0, print = 0, loops = 1, opt, ret;
+
+	while ((opt = getopt(argc, argv, "d:s:n:pxR:")) != -1) {
+		switch (opt) {
+		case 'd': device = optarg; break;
+		case 's': speed = atof(optarg); break;
+		case 'n': loops = atoi(optarg); break;
+		case 'p': plc = 1; break;
+		case 'x': print = 1; break;
+		case 'R':
+			if (sscanf(optarg, "%d,%d,%d", &rt.cpu, &rt.priority, &rt.period_us) != 3)
+				usage(argv[0]);
+			use_rt = 1;
+			break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || (!plc && !print && device == NULL))
+		usage(argv[0]);
+
+	r = fx_cap_open(argv[optind]);
+	if (r == NULL) {
+		fprintf(stderr, "%s: not a capture file\n", argv[optind]);
+		return 1;
+	}
+
+	if (print)
+		ret = print_capture(r);
+	else if (plc)
+		ret = play_plc(r, device);
+	else
+		ret = play_client(r, device, loops);
+
+	fx_cap_free(r);
+	return ret;
+}
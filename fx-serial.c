@@ -19,6 +19,7 @@
  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -38,30 +39,23 @@
 #include <termios.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sched.h>
 #include "fx-serial.h"
+#include "fx-trace.h"
+#include "fx-capture.h"
+#include "fx-hist.h"
+#include "fx-modbus.h"
+#include "fx-transport.h"
 
 #define MTU 4096
 //////////////////////////////////////////////////////////////////
-// DEBUG lib
-// use DEBUG_PRINT to open/close debug info
-//////////////////////////////////////////////////////////////////
-pthread_mutex_t DEBUG_LOCK = PTHREAD_MUTEX_INITIALIZER;
-
-#define DEBUG_PRINT
-#if defined(DEBUG_PRINT)
-#define DEBUG(...) \
-	do { \
-		pthread_mutex_lock(&DEBUG_LOCK);\
-		fprintf(stderr, "[DEBUG]:%s:%d:%s(): ", __FILE__, __LINE__, __FUNCTION__); \
-		fprintf(stderr, __VA_ARGS__); \
-		pthread_mutex_unlock(&DEBUG_LOCK);\
-	} while(0)
-#else
-void no_op(){}
-#define DEBUG(...) no_op()
-#endif /* NO_DEBUG */
-
+// TRACE lib
+// events go to a per-thread binary ring, see fx-trace.h and
+// fx-trace-dump
 //////////////////////////////////////////////////////////////////
 
 // priority queue 
@@ -131,6 +125,7 @@ void create_pool(ptable** p, uint32_t num);
 void create(ptable* p);
 void put_data(ptable* p, void* key, int priority);
 void* get_data(ptable* p, int* pri);
+void* try_get_data(ptable* p, int* pri);
 void cleanup(ptable *p);
 void display(ptable* p);
 
@@ -152,7 +147,7 @@ void add_a_node(ptable* p, node** last, node** m, void* key, int priority)
 	display_buf_pool(p);
 	LOG3("---get_data--\n");
 
-	if (NULL == n) {
+	while (NULL == n) {
 		LOG2("Buf pool is over. Waiting for dequeue\n");
 		pthread_cond_wait(&p->cv, &p->lock);
 		n = (node*)get_buf(p);
@@ -355,6 +350,38 @@ wait_again:
 	goto wait_again;
 }
 
+/*
+ * Like get_data() but returns NULL instead of blocking when the queue
+ * is empty.
+ */
+void* try_get_data(ptable* p, int* pri)
+{
+	ASSERT(p);
+
+	LOCK(p->lock);
+	int i = 0;
+	node* temp = NULL;
+	void *key;
+
+	for (i = 0; i < PRI_MAX; i++) {
+		if (NULL != p->entry[i].n) {
+			temp = (p->entry[i].n);
+
+			key = temp->key;
+			if (pri) *pri = temp->priority;
+
+			p->entry[i].n = temp->next;
+			put_buf(p, temp);
+			pthread_cond_signal(&p->cv);
+			UNLOCK(p->lock);
+			return key;
+		}
+	}
+	p->is_available = false;
+	UNLOCK(p->lock);
+	return NULL;
+}
+
 void cleanup(ptable *p)
 {
 	node *n = p->buf_pool;
@@ -392,75 +419,186 @@ void display(ptable* p)
 // End priority queue
 //////////////////////////////////////////////////////////////////
 
-// Helper Functions
+// serial operation
 //////////////////////////////////////////////////////////////////
-static int safe_read(int fd, void *buffer, int n)
+struct serialcommand;
+
+// sz > 0: the answer, 0: none (timeout, dropped in the queue), -1: I/O
+// error or bad command, FX_EQUEUE: shed to make room
+typedef int (*serial_cb)(struct serialcommand *sc, char *msg, int sz);
+
+static int atoh(char x);
+static void _complete_dropped(struct fx_serial *s);
+
+#define FX_FRAME_MAX 512
+#define FX_CHUNK_DATA 256	/* chunked read: answer data so far, in buf */
+
+/*
+ * Shared by a waiting caller and the worker. The caller cancels it when
+ * it stops waiting; whoever drops the last reference closes the pipe,
+ * so the worker never writes into a closed one.
+ */
+struct serialcall {
+	int refs;
+	int cancelled;
+	int fd[2];
+};
+
+struct serialcommand {
+	int fd;
+	serial_cb cb;
+	int station;	/* FX_STATION_NONE: programming port frame */
+	int pri;	/* ptable priority, 0 is served first */
+	int64_t deadline;	/* monotonic ms, 0: none */
+	struct serialcall *call;
+	struct serialpool *pool;	/* NULL: from malloc */
+	int external;	/* inside a caller's fx_async, never freed here */
+	int result;	/* dropped: sz for the callback */
+	int done;	/* bytes moved so far when sent in chunks */
+	int txn;	/* frames in buf sent as one, see fx_transaction() */
+	int sz;
+	char buf[FX_FRAME_MAX];
+	struct serialcommand *next;	/* station queue */
+};
+
+_Static_assert(sizeof(struct serialcommand) <= FX_ASYNC_PRIV, "FX_ASYNC_PRIV too small");
+_Static_assert(FX_TXN_BYTES <= FX_FRAME_MAX, "a transaction must fit one command");
+
+// put in req by fx_serial_stop() to wake a worker waiting for work
+static struct serialcommand stop_mark;
+
+static int64_t _now_ms(void)
 {
-	fd_set fds;
-	int cnt;
+	struct timespec ts;
 
-	if (fd < 0) {
-		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static int64_t _now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static void _call_put(struct serialcall *call)
+{
+	if (call && __atomic_sub_fetch(&call->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		close(call->fd[0]);
+		close(call->fd[1]);
+		free(call);
 	}
+}
 
-	for (;;) {
-		FD_ZERO(&fds);
-		FD_SET(fd, &fds);
+/*
+ * Commands preallocated for real-time mode, so a request does not fault
+ * in fresh heap pages on its way to the worker. When the pool runs dry
+ * commands come from malloc as usual.
+ */
+#define FX_RT_POOL 256
+#define FX_WORKER_STACK (256*1024)
 
-		cnt = select(fd+1, &fds, NULL, NULL, NULL);
-		if (cnt < 0) {
-			return -1;
-		}
+struct serialpool {
+	pthread_mutex_t lock;
+	struct serialcommand *free;
+	struct serialcommand *mem;
+};
+
+static struct serialcommand *_command_alloc(struct serialpool *pool)
+{
+	struct serialcommand *sc = NULL;
+
+	if (pool) {
+		pthread_mutex_lock(&pool->lock);
+		sc = pool->free;
+		if (sc)
+			pool->free = sc->next;
+		pthread_mutex_unlock(&pool->lock);
+	}
+	if (sc == NULL) {
+		sc = malloc(sizeof(*sc));
+		if (sc)
+			sc->pool = NULL;
+	}
 
-		//		int size;
-		//		int ret = ioctl(fd, FIONREAD, &size);
-		//		if (ret < 0) return -1;
-		//		if (size == 0) continue;
+	return sc;
+}
 
-		cnt = read(fd, buffer, n);
-		if (cnt != 0) {
-			return cnt;
-		}
+static void _command_free(struct serialcommand *sc)
+{
+	struct serialpool *pool = sc->pool;
 
-		if (cnt == 0) return -1;
+	_call_put(sc->call);
+	if (pool == NULL) {
+		free(sc);
+		return;
 	}
+
+	pthread_mutex_lock(&pool->lock);
+	sc->next = pool->free;
+	pool->free = sc;
+	pthread_mutex_unlock(&pool->lock);
 }
 
-static int safe_write(int fd, void *buffer, int count)
+/*
+ * Hands sc's outcome to its owner and retires it. An fx_async command
+ * belongs to the caller again once its callback runs.
+ */
+static void _complete(struct serialcommand *sc, char *msg, int sz)
 {
-	int actual = 0;
+	if (sc->external) {
+		sc->cb(sc, msg, sz);
+		return;
+	}
 
-	if (fd < 0) return -1;
+	sc->cb(sc, msg, sz);
+	_command_free(sc);
+}
 
-	while (count > 0) {
-		int n = write(fd, buffer, count);
-		if (n < 0 && errno == EINTR) {
-			continue;
-		}
+static struct serialpool *_pool_create(int n)
+{
+	struct serialpool *pool = calloc(1, sizeof(*pool));
+	int i;
 
-		if (n <= 0) {
-			actual = -1;
-			break;
-		}
+	if (pool == NULL)
+		return NULL;
+	pool->mem = calloc(n, sizeof(struct serialcommand));
+	if (pool->mem == NULL) {
+		free(pool);
+		return NULL;
+	}
 
-		count  -= n;
-		actual += n;
-		buffer += n;
+	pthread_mutex_init(&pool->lock, NULL);
+	for (i = 0; i < n; i++) {
+		pool->mem[i].pool = pool;
+		pool->mem[i].next = pool->free;
+		pool->free = &pool->mem[i];
 	}
 
-	return actual;
+	return pool;
 }
-//////////////////////////////////////////////////////////////////
-
-// serial operation
-//////////////////////////////////////////////////////////////////
-typedef int (*serial_cb)(int fd, char *msg, int sz);
 
-struct serialcommand {
-	int fd;
-	serial_cb cb;
-	int sz;
-	char buf[4096];
+/*
+ * The worker keeps one queue per RS-485 station, plus one for the
+ * programming port, writes ahead of reads and each kind in order of
+ * arrival. It serves them round robin so a station that does
+ * not answer only costs its own timeout. After FX_STATION_FAILS timeouts
+ * in a row a station is taken off the bus: its requests fail at once
+ * and only one of them is sent every backoff interval as a probe.
+ */
+#define FX_STATION_FAILS       3
+#define FX_STATION_BACKOFF_MIN 1000	/* ms */
+#define FX_STATION_BACKOFF_MAX 30000
+
+struct fx_station {
+	struct serialcommand *head, *tail;
+	struct serialcommand *urgent;	/* last write in the queue */
+	int timeout;		/* ms, 0: transport default */
+	int fails;		/* timeouts in a row */
+	int backoff;		/* ms, 0: station is up */
+	int64_t retry_at;	/* monotonic ms of the next probe */
 };
 
 struct fx_serial {
@@ -472,16 +610,83 @@ struct fx_serial {
 		char stop;
 	} config;
 	
-	int fd;
+	struct fx_transport *tp;
 
-	struct {
-		int n_send;
-		int n_recv;
-		int n_err;
-	} stats;
+	struct fx_stats stats;
+	int call_timeout;	/* ms a caller waits, see fx_serial_set_call_timeout() */
 
 	ptable *req; // queue
 	pthread_t tid_serial;
+
+	// per station queues, the last one is the programming port
+	pthread_mutex_t st_lock;
+	struct fx_station st[FX_STATION_MAX + 1];
+	int st_next;		/* round robin position */
+	int st_pending;		/* commands in the station queues */
+	int busy;		/* worker has taken a command, under q_lock */
+	int stopping;		/* fx_serial_stop(): worker ends after this command */
+
+	pthread_mutex_t io_lock;	/* the line, held from pop to answer */
+
+	// admission control, see fx_serial_set_queue_limit()
+	pthread_mutex_t q_lock;	/* station queues and the counters below */
+	pthread_cond_t q_cv;	/* signalled when a command leaves the queue */
+	int queued;		/* in req and the station queues */
+	struct serialcommand *dropped;	/* to be completed outside q_lock */
+	int q_limit;
+	int submit_timeout;	/* ms, -1: wait for room */
+	int avg_us;		/* moving average time per transaction */
+	int turn_us;		/* moving average PLC turnaround, 0: not measured */
+	int max_block_us;	/* longest transaction, see fx_serial_set_max_block() */
+
+	// Modbus RTU, see fx_serial_set_modbus()
+	int mb_unit;		/* 0: programming port protocol */
+	struct fx_modbus_map mb_map;
+	int64_t mb_idle;	/* monotonic us the line went quiet */
+
+	// real-time mode, see fx_serial_set_realtime()
+	struct fx_rt_config rt;
+	struct serialpool *pool;
+	int64_t rt_next;	/* monotonic ns of the last cycle start */
+	int rt_idle;		/* worker waited for work since then */
+	unsigned int *jit_hist;	/* cycle lateness, 1 us buckets */
+	unsigned long jit_cycles;
+	int jit_max;
+
+	// wire capture, see fx_capture_start()
+	pthread_mutex_t cap_lock;
+	struct fx_cap_writer *cap;
+
+	// read results, see fx_historian_start()
+	pthread_mutex_t hist_lock;
+	struct fx_hist_writer *hist;
+
+	// write-behind, see fx_serial_set_write_behind()
+	pthread_mutex_t wb_lock;
+	pthread_cond_t wb_cv;	/* new batch, batch done, stop */
+	pthread_t wb_tid;
+	int wb_window;		/* ms, 0: off */
+	int wb_running;
+	int wb_stop;
+	struct wb_entry *wb;	/* pending values, by register */
+	int wb_n, wb_cap;
+	unsigned long wb_seq;	/* batch being filled */
+	int64_t wb_due;		/* monotonic ms it goes out */
+	struct wb_wait *wb_waiters;
+};
+
+struct wb_entry {
+	int id;
+	int value;
+};
+
+// a caller waiting for its batch to be confirmed
+struct wb_wait {
+	int id, n;
+	unsigned long seq;
+	int done;
+	int status;
+	struct wb_wait *next;
 };
 
 static int _open_device(struct fx_serial *s, char *device)
@@ -492,11 +697,26 @@ static int _open_device(struct fx_serial *s, char *device)
 
 	memset(s, 0, sizeof(*s));
 	strcpy(s->device, device);
-
-	s->fd = open(device, O_RDWR | O_NOCTTY | O_NDELAY);
-	if (s->fd == -1) {
-		DEBUG("fd = %d, %s\n", s->fd, strerror(errno));
-		//printf("open error");
+	pthread_mutex_init(&s->cap_lock, NULL);
+	pthread_mutex_init(&s->hist_lock, NULL);
+	pthread_mutex_init(&s->st_lock, NULL);
+	pthread_mutex_init(&s->io_lock, NULL);
+	s->call_timeout = 2000;
+
+	pthread_condattr_t ca;
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_mutex_init(&s->q_lock, NULL);
+	pthread_cond_init(&s->q_cv, &ca);
+	pthread_mutex_init(&s->wb_lock, NULL);
+	pthread_cond_init(&s->wb_cv, &ca);
+	pthread_condattr_destroy(&ca);
+	s->q_limit = FX_QUEUE_LIMIT;
+	s->submit_timeout = -1;
+
+	s->tp = fx_transport_open(device);
+	if (s->tp == NULL) {
+		TRACE(FX_EV_OPEN_FAIL, errno, device, strlen(device));
 		return -1;
 	}
 
@@ -506,197 +726,52 @@ static int _open_device(struct fx_serial *s, char *device)
 	return 0;
 }
 
-static tcflag_t parse_baudrate(int requested)
-{
-  int baudrate;
-
-  switch (requested)
-    {
-#ifdef B50
-    case 50: baudrate = B50; break;
-#endif
-#ifdef B75
-    case 75: baudrate = B75; break;
-#endif
-#ifdef B110
-    case 110: baudrate = B110; break;
-#endif
-#ifdef B134
-    case 134: baudrate = B134; break;
-#endif
-#ifdef B150
-    case 150: baudrate = B150; break;
-#endif
-#ifdef B200
-    case 200: baudrate = B200; break;
-#endif
-#ifdef B300
-    case 300: baudrate = B300; break;
-#endif
-#ifdef B600
-    case 600: baudrate = B600; break;
-#endif
-#ifdef B1200
-    case 1200: baudrate = B1200; break;
-#endif
-#ifdef B1800
-    case 1800: baudrate = B1800; break;
-#endif
-#ifdef B2400
-    case 2400: baudrate = B2400; break;
-#endif
-#ifdef B4800
-    case 4800: baudrate = B4800; break;
-#endif
-#ifdef B9600
-    case 9600: baudrate = B9600; break;
-#endif
-#ifdef B19200
-    case 19200: baudrate = B19200; break;
-#endif
-#ifdef B38400
-    case 38400: baudrate = B38400; break;
-#endif
-#ifdef B57600
-    case 57600: baudrate = B57600; break;
-#endif
-#ifdef B115200
-    case 115200: baudrate = B115200; break;
-#endif
-#ifdef B230400
-    case 230400: baudrate = B230400; break;
-#endif
-#ifdef B460800
-    case 460800: baudrate = B460800; break;
-#endif
-#ifdef B500000
-    case 500000: baudrate = B500000; break;
-#endif
-#ifdef B576000
-    case 576000: baudrate = B576000; break;
-#endif
-#ifdef B921600
-    case 921600: baudrate = B921600; break;
-#endif
-#ifdef B1000000
-    case 1000000: baudrate = B1000000; break;
-#endif
-#ifdef B1152000
-    case 1152000: baudrate = B1152000; break;
-#endif
-#ifdef B1500000
-    case 1500000: baudrate = B1500000; break;
-#endif
-#ifdef B2000000
-    case 2000000: baudrate = B2000000; break;
-#endif
-#ifdef B2500000
-    case 2500000: baudrate = B2500000; break;
-#endif
-#ifdef B3000000
-    case 3000000: baudrate = B3000000; break;
-#endif
-#ifdef B3500000
-    case 3500000: baudrate = B3500000; break;
-#endif
-#ifdef B4000000
-    case 4000000: baudrate = B4000000; break;
-#endif
-    default:
-      baudrate = 0;
-    }
-  return baudrate;
-}
-
 static int _set_device(struct fx_serial *s, int baude, char bits, char parity, char stop)
 {
-	int fd = s->fd;
-
-	struct termios options;
-	if (tcgetattr(fd, &options) != 0) {
-		return -1;
-	}
-
-	bzero(&options, sizeof(struct termios));
-	tcflag_t baudflag = parse_baudrate(baude);
-	if (!baudflag)
-    return -1;
-
-	cfsetispeed(&options, baudflag);
-	cfsetospeed(&options, baudflag);
-
-	options.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);	/*Input */
-	options.c_oflag &= ~OPOST;	/*Output */
-
-	options.c_cflag |= CLOCAL;
-	options.c_cflag |= CREAD;
-
-	switch (parity) {
-	case 'N':
-	case 'n':
-	case 'S':
-	case 's':
-		options.c_cflag &= ~PARENB;
-		break;
-	case 'E':
-	case 'e':
-		options.c_cflag |= PARENB;
-		options.c_cflag &= ~PARODD;
-		break;
-	case 'O':
-	case 'o':
-		options.c_cflag |= PARENB;
-		options.c_cflag |= PARODD;
-		break;
-	default:
-		return -1;
-	}
-
-	if (options.c_cflag & PARENB) {
-		// Enable Parity
-		options.c_iflag |= (INPCK | ISTRIP);
-	}
-
-	switch (stop) {
-	case '1':
-		options.c_cflag &= ~CSTOPB;
-		break;
-	default:
-		return -1;
-	}
-
-
-	switch (bits) {
-	case '7':
-		options.c_cflag &= ~CSIZE;
-		options.c_cflag |= CS7;
-		break;
-	case '8':
-		options.c_cflag &= ~CSIZE;
-		options.c_cflag |= CS8;
-		break;
-	default:
-		return -1;
-	}
-
-	options.c_cc[VTIME] = 0;	/* 设置超时15 seconds */
-	options.c_cc[VMIN] = 1;	/* define the minimum bytes data to be readed */
-	tcflush(fd, TCIFLUSH);
-
-	// set Attr
-	if (tcsetattr(fd, TCSANOW, &options) != 0) {
-		return -1;
-	}
+	s->config.baude = baude;
+	s->config.bits = bits;
+	s->config.parity = parity;
+	s->config.stop = stop;
 
-	return 0;
+	return fx_transport_setup(s->tp, baude, bits, parity, stop);
 }
 
 static int _close_device(struct fx_serial *s)
 {
 	assert(s);
 	
-	if (s->fd > 0) close(s->fd);
-	if (s->req) cleanup(s->req);
+	fx_capture_stop(s);
+	pthread_mutex_destroy(&s->cap_lock);
+	fx_historian_stop(s);
+	pthread_mutex_destroy(&s->hist_lock);
+	if (s->tp) fx_transport_close(s->tp);
+
+	struct serialcommand *sc;
+	int i;
+	if (s->req) {
+		while ((sc = try_get_data(s->req, NULL)) != NULL)
+			if (sc != &stop_mark)
+				_complete(sc, NULL, -1);
+		cleanup(s->req);
+	}
+	for (i = 0; i <= FX_STATION_MAX; i++) {
+		while (s->st[i].head) {
+			struct serialcommand *sc = s->st[i].head;
+			s->st[i].head = sc->next;
+			_complete(sc, NULL, -1);
+		}
+	}
+	_complete_dropped(s);
+	pthread_mutex_destroy(&s->st_lock);
+	pthread_mutex_destroy(&s->q_lock);
+	pthread_cond_destroy(&s->q_cv);
+
+	if (s->pool) {
+		pthread_mutex_destroy(&s->pool->lock);
+		free(s->pool->mem);
+		free(s->pool);
+	}
+	free(s->jit_hist);
 
 	memset(s, 0, sizeof(struct fx_serial));
 	
@@ -712,496 +787,2461 @@ static int _check_command(char *buf, int sz)
 	
 	ret |= (buf[0] == 0x02);
 	ret |= (buf[1] == 0x30 || buf[1] == 0x31);
+	ret |= (buf[0] == 0x05 && sz >= 15);	/* station frame */
 
 	return ret;
 }
 
-static void *thread_serialcomm(void *parm)
+/*
+ * A read answer is STX, data, ETX and two hex digits holding the sum of
+ * everything after STX. Returns the received sum on mismatch so it ends
+ * up in the trace, 0 if the frame is good.
+ */
+static int _check_response(char *buf, int sz)
 {
-	struct fx_serial *s = (struct fx_serial*)parm;
-	
-RESTART:
-	while (1) {
-		usleep(1000);
-		struct serialcommand *sc = get_data(s->req, NULL);
-		int ret;
+	int i, sum = 0, got;
 
-		if (_check_command(sc->buf, sc->sz) == 0) {
-			DEBUG("cmd error\n");
-			free(sc);
-			goto RESTART;
-		}
+	if (sz < 4 || buf[0] != 0x02 || buf[sz-3] != 0x03)
+		return -1;
 
-		int num = 0;
-		if (sc->buf[1] == 0x30) {
-			// DATA size + STX(1 byte) + ETX(1 byte) + SUM(2 byte)
-			num = ((sc->buf[6]-'0')*10 + (sc->buf[7]-'0'))*2+4;
-		} else {
-			num = 1;
-		}
+	for (i = 1; i <= sz-3; i++)
+		sum += buf[i];
+	sum &= 0xFF;
+
+	got = 0;
+	for (i = sz-2; i < sz; i++) {
+		char c = buf[i];
+		got <<= 4;
+		if (c >= '0' && c <= '9') got |= c - '0';
+		else if (c >= 'A' && c <= 'F') got |= c - 'A' + 10;
+		else return -1;
+	}
 
-		if (num > 64*2+4) {
-			free(sc);
-			goto RESTART;
-		}
+	return got == sum ? 0 : got;
+}
 
-		// write command
-		ret = safe_write(s->fd, sc->buf, sc->sz);
-		if (ret < 0) {
-			free(sc);
-			goto RESTART;
-		}
+static void _capture(struct fx_serial *s, int dir, const void *buf, int sz)
+{
+	if (s->cap == NULL)
+		return;
+
+	pthread_mutex_lock(&s->cap_lock);
+	if (s->cap && fx_cap_append(s->cap, dir, fx_cap_now(), buf, sz) != 0) {
+		// disk full or similar: stop capturing, keep serving
+		fx_cap_close(s->cap);
+		s->cap = NULL;
+	}
+	pthread_mutex_unlock(&s->cap_lock);
+}
 
-		s->stats.n_send++;
-		
-		char resp[4096];
-		memset(resp, 0, sizeof(resp));
-		int sz = 0;
-		char *p_resp = resp;
-
-		for (;;) {
-			struct timeval tv;
-			memset(&tv, 0, sizeof(struct timeval));
-			tv.tv_sec = 5;
-			tv.tv_usec = 0;	
-
-			fd_set rfds;
-			FD_ZERO(&rfds);
-			FD_SET(s->fd, &rfds);
-	
-			ret = select(s->fd+1, &rfds, NULL, NULL, &tv);
-			if (ret == -1) {
-				DEBUG("select error\n");
-				free(sc);
-				goto RESTART;
-			} else if (ret == 0) {
-				DEBUG("time expired\n");
-				free(sc);
-				goto RESTART;
+static int _hex2(const char *p)
+{
+	return atoh(p[0]) << 4 | atoh(p[1]);
+}
+
+/*
+ * Hands the values of a good read answer to the historian: X and Y by
+ * byte, D by register, all stamped with the time the answer came in.
+ */
+static void _historian(struct fx_serial *s, struct serialcommand *sc, const char *resp, int sz)
+{
+	int64_t now;
+	int i, addr, n;
+
+	if (s->hist == NULL)
+		return;
+	now = fx_hist_now();
+
+	pthread_mutex_lock(&s->hist_lock);
+	if (s->hist == NULL)
+		goto out;
+
+	if (sc->station == FX_STATION_NONE) {
+		// STX '0' addr(4) bytes(2) ETX sum, answer STX data ETX sum
+		if (sc->buf[1] != '0')
+			goto out;
+		addr = _hex2(sc->buf + 2) << 8 | _hex2(sc->buf + 4);
+		n = _hex2(sc->buf + 6);
+		if (sz != n*2 + 4)
+			goto out;
+		for (i = 0; i < n; i++, addr++) {
+			int v = _hex2(resp + 1 + i*2);
+			if (addr >= 0x80 && addr < 0xC0) {
+				fx_hist_append(s->hist, FX_HIST_KEY(FX_STATION_NONE, addr >= 0xA0,
+							addr & 0x1F), now, v);
+			} else if (addr >= 0x0E00 && addr < 0x4E80 && !(addr & 1) && i + 1 < n) {
+				// D8000..D8255 at 0x0E00, D0..D7999 from 0x1000;
+				// raw, bulk and plan reads elsewhere are not devices
+				v |= _hex2(resp + 3 + i*2) << 8;
+				fx_hist_append(s->hist, FX_HIST_KEY(FX_STATION_NONE, 2, addr < 0x1000 ?
+							8000 + (addr - 0x0E00) / 2 : (addr - 0x1000) / 2), now, v);
+			}
+		}
+	} else {
+		// ENQ st pc "WR" '0' device(5) words(2), answer STX st pc data
+		int flag, id = 0;
+		if (memcmp(sc->buf + 5, "WR", 2) != 0 || sc->buf[8] == 'M')
+			goto out;
+		flag = sc->buf[8] == 'X' ? 0 : sc->buf[8] == 'Y' ? 1 : 2;
+		for (i = 9; i < 13; i++)
+			id = id * (flag == 2 ? 10 : 8) + sc->buf[i] - '0';
+		n = _hex2(sc->buf + 13);
+		if (sz != n*4 + 8)
+			goto out;
+		for (i = 0; i < n; i++) {
+			int x = _hex2(resp + 5 + i*4) << 8 | _hex2(resp + 7 + i*4);
+			if (flag == 2) {
+				fx_hist_append(s->hist, FX_HIST_KEY(sc->station, 2, id + i), now, x);
 			} else {
-				int cnt = read(s->fd, p_resp, num);
-				if (cnt == 0) {
-					DEBUG("serial error\n");
-					free(sc);
-					goto RESTART;
-				}
-
-				num -= cnt;
-				p_resp += cnt;
-				sz += cnt;
-				if (num == 0) {
-					// call cb
-					s->stats.n_recv++;
-					sc->cb(sc->fd, resp, sz);
-					break;
-				}
+				// X0..X7 in the low byte
+				fx_hist_append(s->hist, FX_HIST_KEY(sc->station, flag, id/8 + i*2), now, x & 0xFF);
+				fx_hist_append(s->hist, FX_HIST_KEY(sc->station, flag, id/8 + i*2 + 1), now, x >> 8);
 			}
 		}
-	
-		// free
-		free(sc);
 	}
-
-	return (void *)NULL;
+out:
+	pthread_mutex_unlock(&s->hist_lock);
 }
 
-struct fx_serial* fx_serial_start(char *device, int baude, char bits, char parity, char stop)
+/*
+ * Bytes the answer to sc will have, -1 if sc is not something we send.
+ */
+static int _response_size(struct serialcommand *sc)
 {
-	struct fx_serial *s = malloc(sizeof(struct fx_serial));
-	assert(s);
-	int ret;
-	ret = _open_device(s, device);
-	assert(ret == 0);
-	
-	ret = _set_device(s, baude, bits, parity, stop);
-	assert(ret == 0);
-	
-	pthread_t tid_serial;
-	ret = pthread_create(&tid_serial, NULL, thread_serialcomm, (void *)s);
-	assert(ret == 0);
+	if (sc->station == FX_STATION_NONE) {
+		// DATA size + STX(1 byte) + ETX(1 byte) + SUM(2 byte)
+		if (sc->buf[1] == 0x30)
+			return (atoh(sc->buf[6])*16 + atoh(sc->buf[7]))*2+4;
+		return 1;
+	}
 
-	s->tid_serial = tid_serial;
-	
-	return s;
+	// ENQ st(2) pc(2) cmd(2) wait(1) device(5) count(2) ...
+	if (sc->sz < 15)
+		return -1;
+	int n = atoh(sc->buf[13])*16 + atoh(sc->buf[14]);
+	if (n == 0)
+		n = 256;
+	// STX st(2) pc(2) data ETX sum(2), writes: ACK st(2) pc(2)
+	if (sc->buf[5] == 'W' && sc->buf[6] == 'R')
+		return n*4 + 8;
+	if (sc->buf[5] == 'B' && sc->buf[6] == 'R')
+		return n + 8;
+	return 5;
 }
 
-int fx_serial_stop(struct fx_serial *s)
+static int _char_us(struct fx_serial *s)
 {
-	pthread_cancel(s->tid_serial);
-	pthread_join(s->tid_serial, NULL);
-	_close_device(s);
+	int bits = 1 + (s->config.bits - '0') + (s->config.parity != 'N') + (s->config.stop - '0');
 
-	return 0;
+	if (s->config.baude <= 0)
+		return 0;
+	return bits * 1000000 / s->config.baude;
 }
 
-static int serial_command(struct fx_serial *s, struct serialcommand *sc)
+/*
+ * Writes return once the frame is in the kernel, so the time to the
+ * first answer byte also holds the frame and one character on the line.
+ */
+static void _turnaround(struct fx_serial *s, int frame_sz, int64_t us)
 {
-	assert(s);
-	assert(sc);
-
-	struct serialcommand *local_sc = malloc(sizeof(struct serialcommand));
-	assert(sc);	
-	
-	local_sc->fd = sc->fd;
-	local_sc->cb = sc->cb;
-	
-	local_sc->sz = sc->sz;
-	memcpy(local_sc->buf, sc->buf, sizeof(local_sc->buf));
+	int t = (int)us - (frame_sz + 1) * _char_us(s);
 
-	// TODO: let write command has high priority
-	put_data(s->req, (void *)local_sc, 1/*Priority*/);
-	return 0;
+	// 0 means not measured yet
+	if (t < 1)
+		t = 1;
+	s->turn_us = s->turn_us ? s->turn_us + (t - s->turn_us) / 8 : t;
 }
 
-
-static char _getAscii(int i) 
+/*
+ * Sends sc and collects its answer into resp. Returns the answer size,
+ * 0 on timeout, -1 on I/O error.
+ */
+static int _transact(struct fx_serial *s, struct serialcommand *sc, int timeout, char *resp, int num)
 {
-	if (i >=0 && i <= 9) return i+'0';
-	else if (i>=10 && i <=15) return (i-10)+'A';
-}
+	struct iovec iov = { sc->buf, sc->sz };
+	int ret, sz = 0;
 
-static char _getAddressAscii(int address, char buf[4],int flag)
-{
-	int x=0;
-	switch(flag)
-	{
-		case 0:
-		{
-			x=address+0x80;
-			break;
-		}
-		case 1:
-		{
-			x=address+0xA0;
+	if (fx_transport_expect(s->tp, num) != 0)
+		TRACE(FX_EV_IO_ERR, errno, NULL, 0);
+	if (fx_transport_writev(s->tp, &iov, 1) < 0) {
+		TRACE(FX_EV_IO_ERR, errno, sc->buf, sc->sz);
+		return -1;
+	}
+
+	s->stats.sent++;
+	TRACE(FX_EV_FRAME_SENT, sc->sz, sc->buf, sc->sz);
+	_capture(s, FX_CAP_TX, sc->buf, sc->sz);
+	int64_t t_sent = _now_us();
+
+	while (sz < num) {
+		ret = fx_transport_wait(s->tp, timeout);
+		if (ret == -1) {
+			TRACE(FX_EV_IO_ERR, errno, NULL, 0);
+			return -1;
+		} else if (ret == 0) {
+			TRACE(FX_EV_TIMEOUT, num, resp, sz);
+			s->stats.timeouts++;
+			_capture(s, FX_CAP_TIMEOUT, resp, sz);
+			return 0;
+		}
+
+		s->stats.wakeups++;
+		int cnt = fx_transport_read(s->tp, resp + sz, num - sz);
+		if (cnt < 0 && errno == EAGAIN)
+			continue;
+		if (cnt <= 0) {
+			TRACE(FX_EV_IO_ERR, cnt == 0 ? 0 : errno, NULL, 0);
+			return -1;
+		}
+		TRACE(FX_EV_BYTES_RECV, cnt, resp + sz, cnt);
+		if (sz == 0)
+			_turnaround(s, sc->sz, _now_us() - t_sent);
+		sz += cnt;
+
+		// a station refusing the request answers NAK st(2) pc(2) code(2),
+		// a Modbus exception is unit, function|0x80, code and CRC
+		if (sc->station != FX_STATION_NONE && resp[0] == 0x15)
+			num = 7;
+		if (s->mb_unit && sz >= 2 && (resp[1] & 0x80))
+			num = 5;
+	}
+
+	TRACE(FX_EV_RESPONSE, sz, resp, sz);
+	_capture(s, FX_CAP_RX, resp, sz);
+
+	return sz;
+}
+
+static struct fx_station *_station_of(struct fx_serial *s, struct serialcommand *sc)
+{
+	return &s->st[sc->station == FX_STATION_NONE ? FX_STATION_MAX : sc->station];
+}
+
+/*
+ * Puts sc into a station queue after prev (NULL: at the head). Called
+ * with q_lock held.
+ */
+static void _station_insert(struct fx_serial *s, struct fx_station *st,
+		struct serialcommand *prev, struct serialcommand *sc)
+{
+	sc->next = prev ? prev->next : st->head;
+	if (prev)
+		prev->next = sc;
+	else
+		st->head = sc;
+	if (st->tail == prev)
+		st->tail = sc;
+	if (sc->pri == 0 && st->urgent == prev)
+		st->urgent = sc;
+	s->st_pending++;
+}
+
+// writes go behind the other writes, reads at the end
+static void _station_queue(struct fx_serial *s, struct serialcommand *sc)
+{
+	struct fx_station *st;
+
+	if (sc == &stop_mark)
+		return;
+	st = _station_of(s, sc);
+	_station_insert(s, st, sc->pri == 0 ? st->urgent : st->tail, sc);
+}
+
+/*
+ * Takes sc, which follows prev (NULL: sc is the head), out of a station
+ * queue. Called with q_lock held.
+ */
+static void _station_unlink(struct fx_serial *s, struct fx_station *st,
+		struct serialcommand *prev, struct serialcommand *sc)
+{
+	if (prev)
+		prev->next = sc->next;
+	else
+		st->head = sc->next;
+	if (st->tail == sc)
+		st->tail = prev;
+	if (st->urgent == sc)
+		st->urgent = prev;
+	s->st_pending--;
+	s->queued--;
+	pthread_cond_signal(&s->q_cv);
+}
+
+static struct serialcommand *_station_pop(struct fx_serial *s, struct fx_station *st)
+{
+	struct serialcommand *sc = st->head;
+
+	_station_unlink(s, st, NULL, sc);
+	return sc;
+}
+
+/*
+ * Callbacks may submit again, so commands taken off the queue while
+ * q_lock is held are completed only after it is released.
+ */
+static void _drop(struct fx_serial *s, struct serialcommand *sc, int sz)
+{
+	sc->result = sz;
+	sc->next = s->dropped;
+	s->dropped = sc;
+}
+
+static void _complete_dropped(struct fx_serial *s)
+{
+	struct serialcommand *sc;
+
+	pthread_mutex_lock(&s->q_lock);
+	sc = s->dropped;
+	s->dropped = NULL;
+	pthread_mutex_unlock(&s->q_lock);
+
+	while (sc) {
+		struct serialcommand *next = sc->next;
+		_complete(sc, NULL, sc->result);
+		sc = next;
+	}
+}
+
+/*
+ * Off the worker: answers the waiting callers of dropped commands and
+ * leaves fx_async ones to the worker, done() runs on its thread. The
+ * worker takes them on its next round; the caller that caused the drop
+ * is about to queue a command, which wakes it.
+ */
+static void _complete_dropped_calls(struct fx_serial *s)
+{
+	struct serialcommand *sc, *next, *calls = NULL, *ops = NULL;
+
+	pthread_mutex_lock(&s->q_lock);
+	for (sc = s->dropped; sc; sc = next) {
+		next = sc->next;
+		if (sc->external) {
+			sc->next = ops;
+			ops = sc;
+		} else {
+			sc->next = calls;
+			calls = sc;
+		}
+	}
+	s->dropped = ops;
+	pthread_mutex_unlock(&s->q_lock);
+
+	while (calls) {
+		next = calls->next;
+		_complete(calls, NULL, calls->result);
+		calls = next;
+	}
+}
+
+// programming port read or write frame
+static int _frame_size(const char *f)
+{
+	return f[1] == 0x30 ? 11 : 11 + _hex2(f + 6)*2;
+}
+
+static int _is_read(struct serialcommand *sc)
+{
+	int i, at;
+
+	for (i = 0, at = 0; i < sc->txn; i++, at += _frame_size(sc->buf + at))
+		if (sc->buf[at + 1] != 0x30)
+			return 0;
+	if (sc->station == FX_STATION_NONE)
+		return sc->buf[1] == 0x30;
+	return sc->buf[6] == 'R';
+}
+
+/*
+ * Makes room for a command of priority pri by dropping the least
+ * important queued read that is less important than it. Its caller is
+ * told right away. Returns 0 if something was dropped. Called with
+ * q_lock held.
+ */
+static int _shed(struct fx_serial *s, int pri)
+{
+	struct serialcommand *sc, *prev, *victim = NULL, *victim_prev = NULL;
+	struct fx_station *victim_st = NULL;
+	int i;
+
+	// what came in while a frame is out is still in req. The worker
+	// looks at the station queues before it waits on req again, so
+	// only then can it be moved from here
+	if (s->busy)
+		while ((sc = try_get_data(s->req, NULL)) != NULL)
+			_station_queue(s, sc);
+
+	for (i = 0; i <= FX_STATION_MAX; i++) {
+		struct fx_station *st = &s->st[i];
+
+		for (prev = NULL, sc = st->head; sc; prev = sc, sc = sc->next) {
+			if (!_is_read(sc) || sc->pri <= pri)
+				continue;
+			if (victim == NULL || sc->pri > victim->pri) {
+				victim = sc;
+				victim_prev = prev;
+				victim_st = st;
+			}
+		}
+	}
+
+	if (victim == NULL)
+		return -1;
+
+	_station_unlink(s, victim_st, victim_prev, victim);
+	s->stats.shed++;
+	_drop(s, victim, FX_EQUEUE);
+
+	return 0;
+}
+
+/*
+ * A command nobody waits for any more: its caller gave up or its
+ * deadline passed. Counted and dropped without touching the wire.
+ */
+static int _stale(struct fx_serial *s, struct serialcommand *sc, int64_t now)
+{
+	if (sc->call && __atomic_load_n(&sc->call->cancelled, __ATOMIC_ACQUIRE)) {
+		s->stats.cancelled++;
+		return 1;
+	}
+	if (sc->deadline && now >= sc->deadline) {
+		s->stats.expired++;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Next command in round robin order. Requests for a station that is off
+ * the bus are answered with NAK here unless it is time to probe it.
+ */
+static struct serialcommand *_station_next(struct fx_serial *s)
+{
+	int64_t now = _now_ms();
+	int i;
+
+	for (i = 0; i <= FX_STATION_MAX && s->st_pending; i++) {
+		int slot = (s->st_next + i) % (FX_STATION_MAX + 1);
+		struct fx_station *st = &s->st[slot];
+
+		while (st->head && _stale(s, st->head, now))
+			_drop(s, _station_pop(s, st), 0);
+		if (st->head == NULL)
+			continue;
+
+		pthread_mutex_lock(&s->st_lock);
+		int down = st->backoff && now < st->retry_at;
+		pthread_mutex_unlock(&s->st_lock);
+
+		if (down) {
+			while (st->head) {
+				_drop(s, _station_pop(s, st), 0);
+			}
+			continue;
+		}
+
+		s->st_next = (slot + 1) % (FX_STATION_MAX + 1);
+		return _station_pop(s, st);
+	}
+
+	return NULL;
+}
+
+#define FX_RECONNECT_MIN 20	/* ms between attempts, doubling */
+#define FX_RECONNECT_MAX 500
+
+/*
+ * Drops whatever has been cancelled or has expired anywhere in the
+ * queues; normally only the head is looked at when it is its turn.
+ */
+static void _sweep_stale(struct fx_serial *s)
+{
+	struct serialcommand *sc, *prev, *next;
+	int64_t now = _now_ms();
+	int i;
+
+	pthread_mutex_lock(&s->q_lock);
+	while ((sc = try_get_data(s->req, NULL)) != NULL)
+		_station_queue(s, sc);
+	for (i = 0; i <= FX_STATION_MAX; i++) {
+		struct fx_station *st = &s->st[i];
+		for (prev = NULL, sc = st->head; sc; sc = next) {
+			next = sc->next;
+			if (_stale(s, sc, now)) {
+				_station_unlink(s, st, prev, sc);
+				_drop(s, sc, 0);
+			} else {
+				prev = sc;
+			}
+		}
+	}
+	pthread_mutex_unlock(&s->q_lock);
+	_complete_dropped(s);
+}
+
+/*
+ * The device went away (USB adapter unplugged, server closed the
+ * connection): open it again with the same settings, trying every
+ * FX_RECONNECT_MIN ms at first and at least every FX_RECONNECT_MAX ms,
+ * so the link is back within that much of the device returning.
+ * Requests stay queued meanwhile and are dropped as their deadlines
+ * pass. Only fx_serial_stop() ends the wait, leaving the link down.
+ */
+static void _reconnect(struct fx_serial *s)
+{
+	int64_t t0 = _now_ms();
+	int wait = FX_RECONNECT_MIN, ms;
+
+	TRACE(FX_EV_LINK_DOWN, errno, s->device, strlen(s->device));
+	for (;;) {
+		if (fx_transport_reopen(s->tp) == 0 &&
+				fx_transport_setup(s->tp, s->config.baude, s->config.bits,
+					s->config.parity, s->config.stop) == 0)
 			break;
+		_sweep_stale(s);
+		if (s->stopping)
+			return;
+		usleep(wait * 1000);
+		if (wait < FX_RECONNECT_MAX)
+			wait = wait*2 < FX_RECONNECT_MAX ? wait*2 : FX_RECONNECT_MAX;
+	}
+
+	ms = _now_ms() - t0;
+	s->stats.reconnects++;
+	s->stats.reconnect_ms = ms;
+	if ((unsigned long)ms > s->stats.reconnect_max_ms)
+		s->stats.reconnect_max_ms = ms;
+	TRACE(FX_EV_LINK_UP, ms, s->device, strlen(s->device));
+}
+
+/*
+ * sc was on the wire when the link failed (first) or has more chunks
+ * to go. It goes back to the front of its queue, behind the writes
+ * unless it is a write on the wire, so it is sent again once the link
+ * is back, unless its caller has gone or its deadline passed.
+ */
+static void _requeue(struct fx_serial *s, struct serialcommand *sc, int first)
+{
+	struct fx_station *st = _station_of(s, sc);
+
+	pthread_mutex_lock(&s->q_lock);
+	if (_stale(s, sc, _now_ms())) {
+		_drop(s, sc, 0);
+	} else {
+		_station_insert(s, st, first && sc->pri == 0 ? NULL : st->urgent, sc);
+		s->queued++;
+	}
+	pthread_mutex_unlock(&s->q_lock);
+	_complete_dropped(s);
+}
+
+static void _station_result(struct fx_serial *s, int station, int answered)
+{
+	struct fx_station *st = &s->st[station];
+
+	pthread_mutex_lock(&s->st_lock);
+	if (answered) {
+		st->fails = 0;
+		st->backoff = 0;
+	} else if (++st->fails >= FX_STATION_FAILS) {
+		st->backoff = st->backoff ? st->backoff*2 : FX_STATION_BACKOFF_MIN;
+		if (st->backoff > FX_STATION_BACKOFF_MAX)
+			st->backoff = FX_STATION_BACKOFF_MAX;
+		st->retry_at = _now_ms() + st->backoff;
+	}
+	pthread_mutex_unlock(&s->st_lock);
+}
+
+#define FX_JITTER_MAX 10000	/* us, later wakeups share the last bucket */
+
+/*
+ * Gap between transactions. In real-time mode cycles start on an
+ * absolute period grid, so lateness does not accumulate; the time
+ * a cycle starts after its grid point is recorded as jitter. A cycle
+ * whose grid point passed while the previous one was still running
+ * is recorded as late by that much and starts a new grid. One that
+ * comes after the worker sat waiting for work starts a new grid
+ * without being recorded.
+ */
+static void _worker_pace(struct fx_serial *s)
+{
+	int64_t period = (int64_t)s->rt.period_us * 1000, target, late, now;
+	struct timespec ts;
+	int idle = s->rt_idle;
+
+	s->rt_idle = 0;
+	if (period <= 0) {
+		usleep(1000);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+	target = s->rt_next + period;
+	if (target <= now) {
+		s->rt_next = now;
+		if (idle)
+			return;
+	} else {
+		ts.tv_sec = target / 1000000000;
+		ts.tv_nsec = target % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		now = (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+		s->rt_next = target;
+	}
+
+	late = (now - target) / 1000;
+	if (late > FX_JITTER_MAX)
+		late = FX_JITTER_MAX;
+	if (s->jit_hist)
+		s->jit_hist[late]++;
+	if (late > s->jit_max)
+		s->jit_max = late;
+	s->jit_cycles++;
+}
+
+/*
+ * Answer size of sc, -1 if it is not a frame we send.
+ */
+static int _command_size(struct serialcommand *sc)
+{
+	if (_check_command(sc->buf, sc->sz) == 0) {
+		TRACE(FX_EV_CMD_ERR, sc->sz, sc->buf, sc->sz);
+		return -1;
+	}
+
+	int num = _response_size(sc);
+	if (num < 0 || num > 64*2+8)
+		return -1;
+	return num;
+}
+
+#define FX_RTU_ERR -3
+
+/*
+ * _transact() over Modbus RTU: sc goes out translated and the answer
+ * comes back as the programming port would have given it. FX_RTU_ERR
+ * for a frame with no Modbus counterpart or an answer with a bad CRC.
+ */
+static int _transact_rtu(struct fx_serial *s, struct serialcommand *sc, int timeout, char *resp)
+{
+	struct serialcommand m;
+	uint8_t rtu[FX_MODBUS_MAX];
+	int num, n, sz;
+
+	m.station = FX_STATION_NONE;
+	m.sz = -1;
+	if (sc->station == FX_STATION_NONE)
+		m.sz = fx_modbus_request(&s->mb_map, s->mb_unit, sc->buf, sc->sz, (uint8_t *)m.buf, &num);
+	if (m.sz < 0) {
+		TRACE(FX_EV_CMD_ERR, sc->sz, sc->buf, sc->sz);
+		return FX_RTU_ERR;
+	}
+
+	// a frame starts after 3.5 characters of silence
+	int gap = s->config.baude > 19200 ? 1750 : _char_us(s) * 7 / 2;
+	int64_t wait = s->mb_idle + gap - _now_us();
+	if (wait > 0)
+		usleep(wait);
+
+	n = _transact(s, &m, timeout, (char *)rtu, num);
+	s->mb_idle = _now_us();
+	if (n <= 0)
+		return n;
+
+	// the raw answer is what is worth tracing when it does not check out
+	if ((sz = fx_modbus_answer((uint8_t *)m.buf, rtu, n, resp)) < 0) {
+		TRACE(FX_EV_CHECKSUM_ERR, -1, rtu, n);
+		return FX_RTU_ERR;
+	}
+	return sz;
+}
+
+/*
+ * One transaction, with io_lock held: sends sc, waits at most limit ms
+ * (0: the transport or station timeout) for num answer bytes and checks
+ * them. Returns the answer size with a NAK in resp for a bad answer, 0
+ * without one, -1 if the device failed.
+ */
+static int _execute(struct fx_serial *s, struct serialcommand *sc, int num, int limit, char *resp)
+{
+	int timeout = s->tp->timeout, ret;
+
+	if (sc->station != FX_STATION_NONE) {
+		pthread_mutex_lock(&s->st_lock);
+		if (s->st[sc->station].timeout)
+			timeout = s->st[sc->station].timeout;
+		pthread_mutex_unlock(&s->st_lock);
+	}
+	if (limit > 0 && limit < timeout)
+		timeout = limit;
+
+	memset(resp, 0, num + 1);
+	int64_t t0 = _now_us();
+	int sz = s->mb_unit ? _transact_rtu(s, sc, timeout, resp) : _transact(s, sc, timeout, resp, num);
+	s->avg_us += ((int)(_now_us() - t0) - s->avg_us) / 8;
+
+	if (sz == FX_RTU_ERR) {
+		s->stats.errors++;
+		resp[0] = 0x15;
+		return 1;
+	}
+	if (sz < 0)
+		return -1;
+	if (sc->station != FX_STATION_NONE)
+		_station_result(s, sc->station, sz > 0);
+	if (sz == 0)
+		return 0;
+
+	if (resp[0] == 0x02 && (ret = _check_response(resp, sz)) != 0) {
+		// hand the caller a NAK instead of garbage
+		TRACE(FX_EV_CHECKSUM_ERR, ret, resp, sz);
+		s->stats.errors++;
+		resp[0] = 0x15;
+		sz = 1;
+	} else if (sc->station != FX_STATION_NONE && memcmp(resp+1, sc->buf+1, 4) != 0) {
+		// answer from another station or PC number
+		TRACE(FX_EV_CMD_ERR, sz, resp, sz);
+		s->stats.errors++;
+		resp[0] = 0x15;
+		sz = 1;
+	} else {
+		s->stats.received++;
+		_historian(s, sc, resp, sz);
+	}
+	return sz;
+}
+
+static void _put_hex(char *p, int v, int digits)
+{
+	while (digits-- > 0) {
+		p[digits] = "0123456789ABCDEF"[v & 0xF];
+		v >>= 4;
+	}
+}
+
+// D and D8000 registers, two bytes each that a chunk must not part
+static int _chunk_words(const struct serialcommand *sc)
+{
+	return (_hex2(&sc->buf[2]) << 8 | _hex2(&sc->buf[4])) >= 0x0E00;
+}
+
+/*
+ * Bytes per frame so that a transaction of sc holds the line at most
+ * max_block_us, going by baud rate and turnaround; 0 if sc fits or
+ * is not cut. Only programming port reads and writes are.
+ */
+static int _chunk_bytes(struct fx_serial *s, struct serialcommand *sc)
+{
+	int cu = _char_us(s), turn = s->turn_us ? s->turn_us : FX_TURNAROUND_DEFAULT;
+	int n, k;
+
+	if (s->max_block_us <= 0 || cu <= 0 || sc->station != FX_STATION_NONE || sc->txn)
+		return 0;
+	if (sc->buf[1] != 0x30 && sc->buf[1] != 0x31)
+		return 0;
+
+	// a read is 11 characters out and 2k+4 back, a write 2k+11 and ACK
+	n = _hex2(&sc->buf[6]);
+	k = (s->max_block_us - turn - 16*cu) / (2*cu);
+	if (_chunk_words(sc)) {
+		k &= ~1;	/* whole D registers */
+		if (k < 2)
+			k = 2;
+	} else if (k < 1) {
+		k = 1;
+	}
+	return n > k ? k : 0;
+}
+
+#define FX_CHUNK_MORE 0x7FFFFFFF
+
+/*
+ * Sends the next chunk of at most k bytes of sc, with io_lock held.
+ * Returns FX_CHUNK_MORE while there is more to go, otherwise as
+ * _execute() with the answer to the whole of sc in resp.
+ */
+static int _execute_chunk(struct fx_serial *s, struct serialcommand *sc, int k, char *resp)
+{
+	struct serialcommand c;
+	int n = _hex2(&sc->buf[6]), write = sc->buf[1] == 0x31;
+	int i, sz, sum;
+
+	if (k > n - sc->done)
+		k = n - sc->done;
+	else if ((k & 1) && _chunk_words(sc))
+		k = k > 1 ? k - 1 : 2;
+
+	// STX cmd addr(4) count(2) [data(2k)] ETX sum(2)
+	c.station = sc->station;
+	c.buf[0] = 0x02;
+	c.buf[1] = sc->buf[1];
+	_put_hex(&c.buf[2], (_hex2(&sc->buf[2]) << 8 | _hex2(&sc->buf[4])) + sc->done, 4);
+	_put_hex(&c.buf[6], k, 2);
+	c.sz = 8;
+	if (write) {
+		memcpy(&c.buf[8], &sc->buf[8 + sc->done*2], k*2);
+		c.sz += k*2;
+	}
+	c.buf[c.sz++] = 0x03;
+	for (i = 1, sum = 0; i < c.sz; i++)
+		sum += c.buf[i];
+	_put_hex(&c.buf[c.sz], sum, 2);
+	c.sz += 2;
+
+	sz = _execute(s, &c, write ? 1 : k*2 + 4, 0, resp);
+	if (sz <= 0 || resp[0] == 0x15)
+		return sz;
+
+	if (!write)
+		memcpy(&sc->buf[FX_CHUNK_DATA + sc->done*2], &resp[1], k*2);
+	sc->done += k;
+	if (sc->done < n)
+		return FX_CHUNK_MORE;
+	if (write)
+		return sz;
+
+	// the answer as one frame would have had it
+	resp[0] = 0x02;
+	memcpy(&resp[1], &sc->buf[FX_CHUNK_DATA], n*2);
+	resp[n*2 + 1] = 0x03;
+	for (i = 1, sum = 0; i <= n*2 + 1; i++)
+		sum += resp[i];
+	_put_hex(&resp[n*2 + 2], sum, 2);
+	return n*2 + 4;
+}
+
+/*
+ * The frames of a transaction back to back, with io_lock held. resp gets
+ * a size byte and the answer for each frame sent; the first without a
+ * good answer ends it. *down is set if the device failed on the way.
+ */
+static int _execute_txn(struct fx_serial *s, struct serialcommand *sc, int limit, char *resp, int *down)
+{
+	struct serialcommand c;
+	char ans[4096];
+	int i, at, num, sz, k = 0;
+
+	*down = 0;
+	c.station = FX_STATION_NONE;
+	for (i = 0, at = 0; i < sc->txn; i++, at += c.sz) {
+		c.sz = _frame_size(sc->buf + at);
+		memcpy(c.buf, sc->buf + at, c.sz);
+
+		num = _command_size(&c);
+		sz = num < 0 ? 0 : _execute(s, &c, num, limit, ans);
+		if (sz < 0) {
+			*down = 1;
+			sz = 0;
 		}
-		case 2:
-		{
-			x=address*2+0x1000;
+		resp[k++] = sz;
+		memcpy(resp + k, ans, sz);
+		k += sz;
+		if (sz == 0 || ans[0] == 0x15)
 			break;
+	}
+	return k;
+}
+
+static void *thread_serialcomm(void *parm)
+{
+	struct fx_serial *s = (struct fx_serial*)parm;
+	
+	while (!s->stopping) {
+		_worker_pace(s);
+		struct serialcommand *sc;
+
+		// move everything queued to the station queues, block only
+		// when there is nothing to do. The line is ours from taking
+		// a command to its answer, callers find it busy meanwhile
+		// (see _serial_call()).
+		pthread_mutex_lock(&s->q_lock);
+		s->busy = 0;
+		int idle = s->st_pending == 0;
+		pthread_mutex_unlock(&s->q_lock);
+		if (idle) {
+			sc = try_get_data(s->req, NULL);
+			if (sc == NULL) {
+				sc = get_data(s->req, NULL);
+				s->rt_idle = 1;
+			}
+			pthread_mutex_lock(&s->io_lock);
+			pthread_mutex_lock(&s->q_lock);
+			_station_queue(s, sc);
+		} else {
+			pthread_mutex_lock(&s->io_lock);
+			pthread_mutex_lock(&s->q_lock);
+		}
+		while ((sc = try_get_data(s->req, NULL)) != NULL)
+			_station_queue(s, sc);
+
+		sc = _station_next(s);
+		s->busy = sc != NULL;
+		pthread_mutex_unlock(&s->q_lock);
+		if (s->dropped)
+			_complete_dropped(s);
+		if (sc == NULL) {
+			pthread_mutex_unlock(&s->io_lock);
+			continue;
+		}
+
+		char resp[4096];
+		if (sc->txn) {
+			// not sent again after a link failure: writes before
+			// it have been done
+			int down, sz = _execute_txn(s, sc, 0, resp, &down);
+			if (down)
+				_reconnect(s);
+			pthread_mutex_unlock(&s->io_lock);
+			_complete(sc, resp, sz);
+			continue;
+		}
+
+		int num = _command_size(sc);
+		if (num < 0) {
+			pthread_mutex_unlock(&s->io_lock);
+			_complete(sc, NULL, -1);
+			continue;
 		}
 
+		// a large transfer goes in chunks, writes queued meanwhile
+		// are sent between them
+		int k = _chunk_bytes(s, sc);
+		int sz = k ? _execute_chunk(s, sc, k, resp) : _execute(s, sc, num, 0, resp);
+		if (sz < 0 || sz == FX_CHUNK_MORE) {
+			// back in the queue before a caller can find the line free
+			if (sz < 0)
+				_reconnect(s);
+			_requeue(s, sc, sz < 0);
+			pthread_mutex_unlock(&s->io_lock);
+			continue;
+		}
+		pthread_mutex_unlock(&s->io_lock);
+
+		// call cb
+		_complete(sc, resp, sz);
 	}
-	//int x = address * 2 + 0x1000; //edit by sunkui
-	//int x = address + 0x80;
 
-	int i, j, m, n;  
-	i = x / (16 * 16 * 16); 
-	j = (x / (16 * 16)) % 16; 
-	m = x - i*(16*16*16) - j*(16*16); 
-	m = m / 16; 
-	n = x % 16; 
+	return (void *)NULL;
+}
 
-	buf[0] = _getAscii(i);
-	buf[1] = _getAscii(j);
-	buf[2] = _getAscii(m);
-	buf[3] = _getAscii(n);
+struct fx_serial* fx_serial_start(char *device, int baude, char bits, char parity, char stop)
+{
+	struct fx_serial *s = malloc(sizeof(struct fx_serial));
+	int ret;
+
+	if (s == NULL)
+		return NULL;
+	ret = _open_device(s, device);
+	if (ret != 0) {
+		pthread_mutex_destroy(&s->cap_lock);
+		pthread_mutex_destroy(&s->hist_lock);
+		pthread_mutex_destroy(&s->st_lock);
+		free(s);
+		return NULL;
+	}
+
+	ret = _set_device(s, baude, bits, parity, stop);
+	if (ret != 0) {
+		_close_device(s);
+		free(s);
+		return NULL;
+	}
+	
+	// a small stack keeps mlockall() in real-time mode cheap
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, FX_WORKER_STACK);
+
+	pthread_t tid_serial;
+	ret = pthread_create(&tid_serial, &attr, thread_serialcomm, (void *)s);
+	pthread_attr_destroy(&attr);
+	if (ret != 0) {
+		_close_device(s);
+		free(s);
+		return NULL;
+	}
+
+	s->tid_serial = tid_serial;
+	
+	return s;
+}
+
+int fx_capture_start(struct fx_serial *s, const char *path)
+{
+	struct fx_cap_header h;
+	struct fx_cap_writer *w;
+
+	memset(&h, 0, sizeof(h));
+	h.baude = s->config.baude;
+	h.bits = s->config.bits;
+	h.parity = s->config.parity;
+	h.stop = s->config.stop;
+	h.t0 = fx_cap_now();
+	h.wall = time(NULL);
+	strncpy(h.device, s->device, sizeof(h.device)-1);
+
+	w = fx_cap_create(path, &h);
+	if (w == NULL)
+		return -1;
+
+	pthread_mutex_lock(&s->cap_lock);
+	if (s->cap)
+		fx_cap_close(s->cap);
+	s->cap = w;
+	pthread_mutex_unlock(&s->cap_lock);
+
+	return 0;
+}
+
+int fx_capture_stop(struct fx_serial *s)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&s->cap_lock);
+	if (s->cap)
+		ret = fx_cap_close(s->cap);
+	s->cap = NULL;
+	pthread_mutex_unlock(&s->cap_lock);
+
+	return ret;
+}
+
+int fx_historian_start(struct fx_serial *s, const char *path)
+{
+	struct fx_hist_writer *w = fx_hist_create(path);
+
+	if (w == NULL)
+		return -1;
+
+	pthread_mutex_lock(&s->hist_lock);
+	if (s->hist)
+		fx_hist_close(s->hist);
+	s->hist = w;
+	pthread_mutex_unlock(&s->hist_lock);
+
+	return 0;
+}
+
+int fx_historian_flush(struct fx_serial *s)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&s->hist_lock);
+	if (s->hist)
+		ret = fx_hist_flush(s->hist);
+	pthread_mutex_unlock(&s->hist_lock);
+
+	return ret;
+}
+
+int fx_historian_stop(struct fx_serial *s)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&s->hist_lock);
+	if (s->hist)
+		ret = fx_hist_close(s->hist);
+	s->hist = NULL;
+	pthread_mutex_unlock(&s->hist_lock);
+
+	return ret;
+}
+
+int fx_serial_set_call_timeout(struct fx_serial *s, int ms)
+{
+	if (ms <= 0)
+		return -1;
+
+	s->call_timeout = ms;
+	return 0;
+}
+
+int fx_serial_set_modbus(struct fx_serial *s, int unit, const struct fx_modbus_map *map)
+{
+	static const struct fx_modbus_map def = FX_MODBUS_MAP_DEFAULT;
+
+	if (unit < 0 || unit > 247)
+		return -1;
+
+	pthread_mutex_lock(&s->io_lock);
+	s->mb_map = map ? *map : def;
+	s->mb_unit = unit;
+	pthread_mutex_unlock(&s->io_lock);
+	return 0;
+}
+
+int fx_serial_set_max_block(struct fx_serial *s, int ms)
+{
+	if (ms < 0)
+		return -1;
+
+	s->max_block_us = ms * 1000;
+	return 0;
+}
+
+int fx_serial_set_realtime(struct fx_serial *s, const struct fx_rt_config *rt)
+{
+	int ret;
+
+	if (rt->cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(rt->cpu, &set);
+		ret = pthread_setaffinity_np(s->tid_serial, sizeof(set), &set);
+		if (ret != 0) {
+			errno = ret;
+			return -1;
+		}
+	}
+
+	if (rt->priority > 0) {
+		struct sched_param sp = { .sched_priority = rt->priority };
+		ret = pthread_setschedparam(s->tid_serial, SCHED_FIFO, &sp);
+		if (ret != 0) {
+			errno = ret;
+			return -1;
+		}
+	}
+
+	if (rt->lock_memory) {
+		if (s->pool == NULL)
+			s->pool = _pool_create(FX_RT_POOL);
+		if (s->jit_hist == NULL)
+			s->jit_hist = calloc(FX_JITTER_MAX + 1, sizeof(*s->jit_hist));
+		if (s->pool == NULL || s->jit_hist == NULL)
+			return -1;
+		// everything mapped now and later, worker stack included
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+			return -1;
+	} else if (s->jit_hist == NULL) {
+		s->jit_hist = calloc(FX_JITTER_MAX + 1, sizeof(*s->jit_hist));
+	}
+
+	s->rt = *rt;
+	return 0;
+}
+
+int fx_serial_get_jitter(struct fx_serial *s, struct fx_jitter *j)
+{
+	unsigned long n = 0, p50, p99, p999;
+	int i;
+
+	memset(j, 0, sizeof(*j));
+	if (s->jit_hist == NULL || s->jit_cycles == 0)
+		return -1;
+
+	j->cycles = s->jit_cycles;
+	j->max_us = s->jit_max;
+	p50 = (j->cycles * 50 + 99) / 100;
+	p99 = (j->cycles * 99 + 99) / 100;
+	p999 = (j->cycles * 999 + 999) / 1000;
+	j->p50_us = j->p99_us = j->p999_us = -1;
+
+	for (i = 0; i <= FX_JITTER_MAX; i++) {
+		n += s->jit_hist[i];
+		if (j->p50_us < 0 && n >= p50) j->p50_us = i;
+		if (j->p99_us < 0 && n >= p99) j->p99_us = i;
+		if (j->p999_us < 0 && n >= p999) {
+			j->p999_us = i;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+int fx_serial_set_queue_limit(struct fx_serial *s, int n)
+{
+	if (n <= 0 || n > BUF_POOL_SIZE)
+		return -1;
+
+	pthread_mutex_lock(&s->q_lock);
+	s->q_limit = n;
+	pthread_cond_broadcast(&s->q_cv);
+	pthread_mutex_unlock(&s->q_lock);
+	return 0;
+}
+
+int fx_serial_set_submit_timeout(struct fx_serial *s, int ms)
+{
+	pthread_mutex_lock(&s->q_lock);
+	s->submit_timeout = ms < 0 ? -1 : ms;
+	pthread_mutex_unlock(&s->q_lock);
+	return 0;
+}
+
+int fx_serial_queue_depth(struct fx_serial *s, int *wait_ms)
+{
+	int n = __atomic_load_n(&s->queued, __ATOMIC_RELAXED);
+
+	if (wait_ms)
+		*wait_ms = (int)((int64_t)n * __atomic_load_n(&s->avg_us, __ATOMIC_RELAXED) / 1000);
+	return n;
+}
+
+int fx_serial_get_timing(struct fx_serial *s, struct fx_timing *t)
+{
+	t->baude = s->config.baude;
+	t->char_us = _char_us(s);
+	t->turnaround_us = s->turn_us ? s->turn_us : FX_TURNAROUND_DEFAULT;
+	return 0;
+}
+
+int fx_serial_get_stats(struct fx_serial *s, struct fx_stats *st)
+{
+	// plain counters owned by the worker, a torn read only skews one
+	*st = s->stats;
+	return 0;
+}
+
+int fx_serial_set_framing(struct fx_serial *s, int on)
+{
+	return fx_transport_framing(s->tp, on);
+}
+
+int fx_serial_set_timeout(struct fx_serial *s, int ms)
+{
+	if (ms <= 0)
+		return -1;
+
+	s->tp->timeout = ms;
+	return 0;
+}
+
+static void _wb_stop(struct fx_serial *s);
+
+int fx_serial_stop(struct fx_serial *s)
+{
+	_wb_stop(s);
+	// the worker finishes the command it has on the wire, what is still
+	// queued is failed by _close_device()
+	s->stopping = 1;
+	put_data(s->req, &stop_mark, 0);
+	pthread_join(s->tid_serial, NULL);
+	_close_device(s);
+
+	return 0;
+}
+
+/*
+ * Waits for room in the queue, as long as submit_timeout allows, and
+ * sheds a less important read if there is none. Returns FX_EQUEUE if
+ * the command was not queued.
+ */
+static int _admit(struct fx_serial *s, int pri, int timeout)
+{
+	struct timespec ts;
+	int ret = 0;
+
+	pthread_mutex_lock(&s->q_lock);
+	if (timeout > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += timeout / 1000;
+		ts.tv_nsec += (timeout % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+	}
+
+	while (s->queued >= s->q_limit && _shed(s, pri) != 0) {
+		if (timeout == 0 ||
+				(timeout > 0 && pthread_cond_timedwait(&s->q_cv, &s->q_lock, &ts) == ETIMEDOUT)) {
+			s->stats.rejected++;
+			ret = FX_EQUEUE;
+			break;
+		}
+		if (timeout < 0)
+			pthread_cond_wait(&s->q_cv, &s->q_lock);
+	}
+	if (ret == 0)
+		s->queued++;
+	pthread_mutex_unlock(&s->q_lock);
+
+	if (s->dropped)
+		_complete_dropped_calls(s);
+
+	return ret;
+}
+
+static int _enqueue(struct fx_serial *s, struct serialcommand *sc, int timeout)
+{
+	// writes go first, reads are what gets shed under overload
+	sc->pri = _is_read(sc) ? 1 : 0;
+	if (_admit(s, sc->pri, timeout) != 0)
+		return FX_EQUEUE;
+
+	put_data(s->req, (void *)sc, sc->pri);
+	return 0;
+}
+
+static int serial_command(struct fx_serial *s, struct serialcommand *sc)
+{
+	assert(s);
+	assert(sc);
+
+	struct serialcommand *local_sc = _command_alloc(s->pool);
+	assert(local_sc);	
+	
+	local_sc->fd = sc->fd;
+	local_sc->cb = sc->cb;
+	local_sc->station = sc->station;
+	local_sc->deadline = sc->deadline;
+	local_sc->call = sc->call;
+	local_sc->external = 0;
+	local_sc->done = 0;
+	local_sc->txn = sc->txn;
+	
+	local_sc->sz = sc->sz;
+	memcpy(local_sc->buf, sc->buf, sc->sz);
+
+	if (_enqueue(s, local_sc, s->submit_timeout) != 0) {
+		local_sc->call = NULL;	/* still the caller's */
+		_command_free(local_sc);
+		return FX_EQUEUE;
+	}
+	return 0;
+}
+
+
+static char _getAscii(int i) 
+{
+	if (i >=0 && i <= 9) return i+'0';
+	else if (i>=10 && i <=15) return (i-10)+'A';
+}
+
+static int _getAddress(int address, int flag)
+{
+	int x=-1;
+	switch(flag)
+	{
+		case 0:
+		{
+			x=address+0x80;
+			break;
+		}
+		case 1:
+		{
+			x=address+0xA0;
+			break;
+		}
+		case 2:
+		{
+			// special registers D8000..D8255 sit below D0
+			if (address >= 8000 && address < 8256)
+				x=(address-8000)*2+0x0E00;
+			else
+				x=address*2+0x1000;
+			break;
+		}
+		case 3:
+		{
+			// M0..M1023, 8 to a byte
+			x=address < 0x80 ? address+0x100 : -1;
+			break;
+		}
+
+	}
+	//int x = address * 2 + 0x1000; //edit by sunkui
+	//int x = address + 0x80;
+	return x;
+}
+
+static void _getAddressAscii(int address, char buf[4],int flag)
+{
+	int x = _getAddress(address, flag);
+
+	int i, j, m, n;  
+	i = x / (16 * 16 * 16); 
+	j = (x / (16 * 16)) % 16; 
+	m = x - i*(16*16*16) - j*(16*16); 
+	m = m / 16; 
+	n = x % 16; 
+
+	buf[0] = _getAscii(i);
+	buf[1] = _getAscii(j);
+	buf[2] = _getAscii(m);
+	buf[3] = _getAscii(n);
+}
+
+/*
+ * num is in words; a frame carries at most FX_BLOCK_MAX of them and the
+ * byte address must stay within the 4 hex digits of the protocol.
+ */
+static int _checkRange(int address, int num, int flag)
+{
+	int x = _getAddress(address, flag);
+
+	if (address < 0 || x < 0 || num <= 0 || num > FX_BLOCK_MAX)
+		return -1;
+	if (x + num*2 > 0x10000)
+		return -1;
+	if (flag == 2 && address < 8000 && address + num > 8000)
+		return -1;
+	return 0;
+}
+
+static int getReadCommandFrame (char *buf, int *sz, int address, int num,int flag)
+{
+	if (buf == NULL || sz == NULL ||  
+			_checkRange(address, num, flag) != 0 || flag<0 || flag>3)  
+		return -1; 
+
+	buf[0] = 0x02;
+	buf[1] = '0';
+
+	_getAddressAscii(address, &buf[2],flag);
+
+	num = num *2;
+
+	// byte count, two hex digits
+	buf[6] = _getAscii(num/16);
+	buf[7] = _getAscii(num%16);
+
+	buf[8] = 0x03;
+
+
+	int i, sum = 0;
+	for (i = 1; i <= 8; i++)
+		sum += buf[i];
+
+	i = sum&0xFF;
+	buf[9]  = _getAscii(i/16);
+	buf[10] = _getAscii(i%16);
+
+	*sz = 11;
+
+	//for (i = 0; i < *sz; i++) {
+	//	printf("%02x ", buf[i]);
+	//}
+	//printf("\n");
+
+	return 0;
+}
+
+static int getWriteCommandFrame(char *buf, int *sz, int address, int num, char *data,int flag)
+{
+	if (buf == NULL || sz == NULL ||  
+			_checkRange(address, num, flag) != 0 || flag<0 || flag>3)  
+		return -1; 
+
+	buf[0] = 0x02;
+	buf[1] = '1';
+
+	_getAddressAscii(address, &buf[2],flag);
+
+	num = num*2;
+
+	buf[6] = _getAscii(num/16);
+	buf[7] = _getAscii(num%16);
+
+	int i;
+	for (i = 0; i < num*2; i+=4) {
+		buf[8+i]   = data[i+2];
+		buf[8+i+1] = data[i+3];
+		buf[8+i+2] = data[i];
+		buf[8+i+3] = data[i+1];
+	}
+
+	buf[8+num*2] = 0x03;
+
+	int sum = 0;
+	for (i = 1; i <= 8+num*2; i++)
+		sum += buf[i];
+
+	i = sum&0xFF;
+	buf[8+num*2+1]  = _getAscii(i/16);
+	buf[8+num*2+2]  = _getAscii(i%16);
+
+	*sz = 8+num*2+3;
+
+	//for (i = 0; i < *sz; i++) {
+	//	printf("%02x ", buf[i]);
+	//}
+	//	printf("\n");
+
+	return 0;
+}
+
+/*
+ * Dedicated protocol format 1 with sum check, as spoken by FX-485
+ * adapters: ENQ station(2) PC(2) cmd(2) wait(1) device(5) count(2)
+ * [data] sum(2). Word units only; num is in words.
+ *
+ * X/Y/M words keep the programming port layout (the byte at address is
+ * the high half), the station protocol sends X0..X7 as the low half.
+ */
+static int getStationCommandFrame(char *buf, int *sz, int station, int address, int num, const int *data, int flag)
+{
+	int i, len, sum = 0;
+	char dev[8];
+
+	if (buf == NULL || sz == NULL || station < 0 || station >= FX_STATION_MAX ||
+			address < 0 || num <= 0 || num > FX_BLOCK_MAX)
+		return -1;
+
+	switch (flag) {
+	case 0:
+	case 1:
+		if (address * 8 > 07777)
+			return -1;
+		snprintf(dev, sizeof(dev), "%c%04o", flag == 0 ? 'X' : 'Y', address * 8);
+		break;
+	case 3:
+		if (address * 8 > 9999)
+			return -1;
+		snprintf(dev, sizeof(dev), "M%04d", address * 8);
+		break;
+	case 2:
+		if (address > 9999)
+			return -1;
+		snprintf(dev, sizeof(dev), "D%04d", address);
+		break;
+	default:
+		return -1;
+	}
+
+	buf[0] = 0x05;
+	len = 1 + sprintf(buf + 1, "%02XFF%s0%s%02X", station, data ? "WW" : "WR", dev, num);
+
+	for (i = 0; data && i < num; i++) {
+		int x = data[i] & 0xFFFF;
+		if (flag != 2)
+			x = ((x & 0xFF) << 8) | (x >> 8);
+		len += sprintf(buf + len, "%04X", x);
+	}
+
+	for (i = 1; i < len; i++)
+		sum += buf[i];
+	len += sprintf(buf + len, "%02X", sum & 0xFF);
+
+	*sz = len;
+
+	return 0;
+}
+//////////////////////////////////////////////////////////////////
+
+static int _cb_async(struct serialcommand *sc, char *buf, int sz)
+{	
+	char c = sz == FX_EQUEUE ? 0x18 : 0x15;
+
+	// no answer: wake the caller with NAK (CAN if shed) at once
+	if (sz <= 0)
+		write(sc->fd, &c, 1);
+	else
+		write(sc->fd, buf, sz);
+	return 0;
+}
+
+static int atoh(char x)
+{
+	int y;
+	switch(x)
+	{
+		case '0': y = 0; break;//add by sunkui
+		case '1': y = 1; break;
+		case '2': y = 2; break;
+		case '3': y = 3; break;
+		case '4': y = 4; break;
+		case '5': y = 5; break;
+		case '6': y = 6; break;
+		case '7': y = 7; break;
+		case '8': y = 8; break;
+		case '9': y = 9; break;
+		case 'A': y = 10; break;
+		case 'B': y = 11; break;
+		case 'C': y = 12; break;
+		case 'D': y = 13; break;
+		case 'E': y = 14; break;
+		case 'F': y = 15; break;
+	}
+
+	return  y;
+}
+
+static void buf4_to_integer(char *buf, int *integer,int flag)
+{
+	
+	int x1=0, x2=0, x3=0, x4=0;
+	
+	if(flag==0 || flag ==1 || flag==3)
+	{
+		x1 = atoh(buf[0]);//2 3 0 1 
+		x2 = atoh(buf[1]);
+		x3 = atoh(buf[2]);
+		x4 = atoh(buf[3]);
+	}
+	else if(flag ==2)
+	{
+		x1 = atoh(buf[2]);//2 3 0 1 
+		x2 = atoh(buf[3]);
+		x3 = atoh(buf[0]);
+		x4 = atoh(buf[1]);
+	}
+	
+	// x1 = atoh(*buf);
+	// x2 = atoh(*(buf+sizeof(char)));
+	// x3 = atoh(*(buf+2*sizeof(char)));
+	// x4 = atoh(*(buf+3*sizeof(char)));
+	*integer = x1*16*16*16+x2*16*16+x3*16+x4;
+}
+
+// static void buf2_to_integer(char *buf, int *x)
+// {
+// 	int x1, x2;
+// 	x1 = atoh(buf[0]);
+// 	x2 = atoh(buf[1]);
+
+// 	*x = x1*16+x2;
+// }
+
+static void integer_to_buf4(int x, char *buf)
+{
+	int x1, x2, x3, x4;
+	// x4 = x%10;
+	// x3 = (x%100)/10;
+	// x2 = (x/100)%10;
+	// x1 = x/1000;
+	 
+	x1 = x / (16 * 16 * 16); 
+	x2 = (x / (16 * 16)) % 16; 
+	x3 = x - x1*(16*16*16) - x2*(16*16); 
+	x3 = x3 / 16; 
+	x4= x % 16;
+
+	if(x1>=0 && x1<=9)//edit by sunkui
+	{
+		buf[0] = x1 + '0';
+	}
+	else if(x1>=10 && x1<=15)
+	{
+		buf[0] = x1 - 10 + 'A';
+	}
+	
+
+	if(x2>=0 && x2<=9)
+	{
+		buf[1] = x2 + '0';
+	}
+	else if(x2>=10 && x2<=15)
+	{
+		buf[1] = x2 - 10 + 'A';
+	}
+
+	if(x3>=0 && x3<=9)
+	{
+		buf[2] = x3 + '0';
+	}
+	else if(x3>=10 && x3<=15)
+	{
+		buf[2] = x3 - 10 + 'A';
+	}
+
+	if(x4>=0 && x4<=9)
+	{
+		buf[3] = x4 + '0';
+	}
+	else if(x4>=10 && x4<=15)
+	{
+		buf[3] = x4 - 10 + 'A';
+	}
+	// buf[1] = x2 + '0';
+	// buf[2] = x3 + '0';
+	// buf[3] = x4 + '0';
+}
+
+/*
+ * Fast path of _serial_call(): with the line free and nothing queued the
+ * caller sends the frame itself, no queue, pipe or thread switch. Not in
+ * real-time mode, where the worker's priority and period grid rule the
+ * line, nor for a station that is off the bus. Returns 0 to go through
+ * the worker instead, also when the device failed so it reconnects.
+ */
+static int _call_direct(struct fx_serial *s, struct serialcommand *sc, char *resp, int resp_sz, int *out)
+{
+	char buf[4096];
+	int idle, num, sz, down;
+
+	if (s->rt.priority > 0 || s->rt.period_us > 0)
+		return 0;
+	if (sc->station != FX_STATION_NONE && fx_station_is_down(s, sc->station))
+		return 0;
+	if (_chunk_bytes(s, sc))
+		return 0;
+	if (pthread_mutex_trylock(&s->io_lock) != 0)
+		return 0;
+
+	// queued counts what the worker has not taken yet, so this does
+	// not overtake an earlier request
+	pthread_mutex_lock(&s->q_lock);
+	idle = s->queued == 0;
+	pthread_mutex_unlock(&s->q_lock);
+	if (!idle) {
+		pthread_mutex_unlock(&s->io_lock);
+		return 0;
+	}
+
+	if (sc->txn) {
+		// a failed device shows up on the worker's next request
+		sz = _execute_txn(s, sc, s->call_timeout, buf, &down);
+	} else {
+		num = _command_size(sc);
+		sz = num < 0 ? 0 : _execute(s, sc, num, s->call_timeout, buf);
+	}
+	pthread_mutex_unlock(&s->io_lock);
+	if (sz < 0)
+		return 0;
+
+	// as _cb_async() would have answered
+	if (sz == 0) {
+		buf[0] = 0x15;
+		sz = 1;
+	}
+	if (sz > resp_sz)
+		sz = resp_sz;
+	memcpy(resp, buf, sz);
+	*out = sz;
+	return 1;
+}
+
+/*
+ * Queues a frame (sc->txn of them for a transaction) for the worker and
+ * waits up to call_timeout ms for the response. Returns the number of
+ * response bytes copied to resp.
+ *
+ * The request carries the same deadline, so if we give up the worker
+ * drops it instead of spending wire time on an answer nobody reads.
+ */
+static int _serial_call_txn(struct fx_serial *s, struct serialcommand *sc, char *resp, int resp_sz)
+{
+	int sz;
+
+	if (_call_direct(s, sc, resp, resp_sz, &sz))
+		return sz;
+
+	struct serialcall *call = malloc(sizeof(*call));
+
+	if (call == NULL || pipe(call->fd) != 0) {
+		free(call);
+		return -1;
+	}
+	call->refs = 2;		/* us and the queued command */
+	call->cancelled = 0;
+
+	sc->fd = call->fd[1];
+	sc->cb = _cb_async;
+	sc->call = call;
+	sc->deadline = _now_ms() + s->call_timeout;
+	if (serial_command(s, sc) != 0) {
+		_call_put(call);
+		_call_put(call);
+		return FX_EQUEUE;
+	}
+	
+	int ret; /*select return value*/
+	struct timeval tv;
+	fd_set readset;
+
+	FD_ZERO(&readset);
+	FD_SET(call->fd[0],&readset);
+	tv.tv_sec = s->call_timeout / 1000;
+	tv.tv_usec = (s->call_timeout % 1000) * 1000;
+	
+	do {
+		ret = select((call->fd[0]+1),&readset,NULL,NULL,&tv);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		TRACE(FX_EV_IO_ERR, errno, NULL, 0);
+		sz = -1;
+	} else if (ret == 0) {
+		TRACE(FX_EV_CALLER_TIMEOUT, sc->sz, sc->buf, sc->sz);
+		sz = -1;
+	} else {
+		sz = read(call->fd[0], resp, resp_sz);
+		// CAN: shed from the queue to make room, see _shed()
+		if (sz == 1 && resp[0] == 0x18)
+			sz = FX_EQUEUE;
+	}
+
+	__atomic_store_n(&call->cancelled, 1, __ATOMIC_RELEASE);
+	_call_put(call);
+
+	return sz;
+}
+
+static int _serial_call(struct fx_serial *s, struct serialcommand *sc, char *resp, int resp_sz)
+{
+	sc->txn = 0;
+	return _serial_call_txn(s, sc, resp, resp_sz);
+}
+
+/*
+ * Checks the answer to a read of n words and converts it into data.
+ * Station answers carry station and PC number after STX and send X/Y
+ * with X0..X7 in the low half, see getStationCommandFrame().
+ */
+static int _parse_read(int station, const char *buf, int sz, int n, int *data, int flag)
+{
+	int i;
+
+	if (station == FX_STATION_NONE) {
+		if (sz != n*4+4 || buf[0] != 0x02)
+			return -1;
+		for (i = 0; i < n; i++) {
+			unsigned int x=0;
+			buf4_to_integer((char *)&(buf[1+i*4]), &x,flag);
+			data[i] = x;
+		}
+		return 0;
+	}
+
+	// STX st(2) pc(2) data ETX sum(2)
+	if (sz != n*4+8 || buf[0] != 0x02)
+		return -1;
+	for (i = 0; i < n; i++) {
+		const char *p = &buf[5+i*4];
+		int x = (atoh(p[0])<<12) | (atoh(p[1])<<8) | (atoh(p[2])<<4) | atoh(p[3]);
+		if (flag != 2)
+			x = ((x & 0xFF) << 8) | (x >> 8);
+		data[i] = x;
+	}
+	return 0;
+}
+
+static int _parse_write(int station, const char *buf, int sz)
+{
+	if (sz < 1 || buf[0] != 0x06)
+		return -1;
+	if (station != FX_STATION_NONE && sz != 5)
+		return -1;
+	return 0;
+}
+
+// write-behind
+// Writes to D registers wait in a table, the latest value per register,
+// until the window that the first of them opened closes. Then a thread
+// of its own sends the table as runs of adjacent registers, as few
+// transactions as they fit, and wakes the callers of that batch. Writes
+// coming in meanwhile fill the next batch.
+//////////////////////////////////////////////////////////////////
+static int _wb_cmp(const void *a, const void *b)
+{
+	return ((const struct wb_entry *)a)->id - ((const struct wb_entry *)b)->id;
+}
+
+/*
+ * Sends a batch sorted by register. Runs of adjacent registers become
+ * one write each; run[i] gets the status of the write entry i went in.
+ */
+static void _wb_send(struct fx_serial *s, struct wb_entry *e, int n, int *status)
+{
+	struct fx_txn_op ops[FX_TXN_MAX];
+	int words[FX_TXN_MAX][FX_BLOCK_MAX], first[FX_TXN_MAX];
+	int i = 0, k, nops, bytes, ret;
+
+	while (i < n) {
+		// as many runs as one transaction takes
+		for (nops = 0, bytes = 0; i < n && nops < FX_TXN_MAX; nops++) {
+			struct fx_txn_op *op = &ops[nops];
+
+			for (k = 1; i + k < n && k < FX_BLOCK_MAX && e[i+k].id == e[i].id + k; k++)
+				;
+			if (e[i].id < 8000 && e[i].id + k > 8000)
+				k = 8000 - e[i].id;
+			if (bytes + 11 + k*4 > FX_TXN_BYTES)
+				break;
+			bytes += 11 + k*4;
+
+			op->op = FX_OP_WRITE;
+			op->flag = 2;
+			op->id = e[i].id;
+			op->n = k;
+			op->data = words[nops];
+			for (k = 0; k < op->n; k++)
+				words[nops][k] = e[i+k].value;
+			first[nops] = i;
+			i += op->n;
+		}
+
+		ret = fx_transaction(s, ops, nops);
+		for (k = 0; k < nops; k++) {
+			int j, st = ret == FX_EQUEUE ? FX_EQUEUE : ops[k].status;
+			for (j = 0; j < ops[k].n; j++)
+				status[first[k] + j] = st;
+		}
+	}
+}
+
+static void *_wb_thread(void *arg)
+{
+	struct fx_serial *s = arg;
+	struct wb_entry *e;
+	struct wb_wait *w;
+	struct timespec ts;
+	unsigned long seq;
+	int n, i, *status;
+
+	pthread_mutex_lock(&s->wb_lock);
+	for (;;) {
+		while (!s->wb_stop && s->wb_n == 0)
+			pthread_cond_wait(&s->wb_cv, &s->wb_lock);
+		if (s->wb_n == 0)
+			break;
+		// stopping flushes at once
+		while (!s->wb_stop && _now_ms() < s->wb_due) {
+			ts.tv_sec = s->wb_due / 1000;
+			ts.tv_nsec = s->wb_due % 1000 * 1000000;
+			pthread_cond_timedwait(&s->wb_cv, &s->wb_lock, &ts);
+		}
+
+		e = s->wb;
+		n = s->wb_n;
+		seq = s->wb_seq++;
+		s->wb = NULL;
+		s->wb_n = s->wb_cap = 0;
+		pthread_mutex_unlock(&s->wb_lock);
+
+		qsort(e, n, sizeof(*e), _wb_cmp);
+		status = malloc(n * sizeof(int));
+		if (status)
+			_wb_send(s, e, n, status);
+
+		pthread_mutex_lock(&s->wb_lock);
+		for (w = s->wb_waiters; w; w = w->next) {
+			if (w->seq != seq)
+				continue;
+			w->status = status ? 0 : -1;
+			for (i = 0; status && i < n; i++)
+				if (e[i].id >= w->id && e[i].id < w->id + w->n && status[i] != 0)
+					w->status = status[i];
+			w->done = 1;
+		}
+		pthread_cond_broadcast(&s->wb_cv);
+		free(status);
+		free(e);
+	}
+	pthread_mutex_unlock(&s->wb_lock);
+
+	return NULL;
+}
+
+static int _wb_write(struct fx_serial *s, int id, int n, const int *data)
+{
+	struct wb_wait w, **pw;
+	struct timespec ts;
+	int64_t deadline;
+	int i, j;
+
+	pthread_mutex_lock(&s->wb_lock);
+	if (s->wb_n + n > s->wb_cap) {
+		int cap = s->wb_cap ? s->wb_cap * 2 : 64;
+		struct wb_entry *e;
+		while (cap < s->wb_n + n)
+			cap *= 2;
+		e = realloc(s->wb, cap * sizeof(*e));
+		if (e == NULL) {
+			pthread_mutex_unlock(&s->wb_lock);
+			return -1;
+		}
+		s->wb = e;
+		s->wb_cap = cap;
+	}
+	if (s->wb_n == 0) {
+		s->wb_due = _now_ms() + s->wb_window;
+		pthread_cond_broadcast(&s->wb_cv);
+	}
+
+	// the table is kept unsorted; a batch is a window's worth of
+	// setpoints, so a scan is cheap next to a frame
+	for (i = 0; i < n; i++) {
+		int v = data[i] & 0xFFFF;
+		for (j = 0; j < s->wb_n && s->wb[j].id != id + i; j++)
+			;
+		if (j < s->wb_n) {
+			s->wb[j].value = v;
+			s->stats.coalesced++;
+		} else {
+			s->wb[s->wb_n].id = id + i;
+			s->wb[s->wb_n].value = v;
+			s->wb_n++;
+		}
+	}
+
+	w.id = id;
+	w.n = n;
+	w.seq = s->wb_seq;
+	w.done = 0;
+	w.status = -1;
+	w.next = s->wb_waiters;
+	s->wb_waiters = &w;
+
+	deadline = _now_ms() + s->wb_window + s->call_timeout;
+	ts.tv_sec = deadline / 1000;
+	ts.tv_nsec = deadline % 1000 * 1000000;
+	while (!w.done)
+		if (pthread_cond_timedwait(&s->wb_cv, &s->wb_lock, &ts) == ETIMEDOUT)
+			break;
+
+	for (pw = &s->wb_waiters; *pw != &w; pw = &(*pw)->next)
+		;
+	*pw = w.next;
+	pthread_mutex_unlock(&s->wb_lock);
+
+	return w.status;
+}
+
+int fx_serial_set_write_behind(struct fx_serial *s, int window_ms)
+{
+	int ret = 0;
+
+	if (window_ms < 0)
+		return -1;
+
+	pthread_mutex_lock(&s->wb_lock);
+	if (window_ms > 0 && !s->wb_running) {
+		ret = pthread_create(&s->wb_tid, NULL, _wb_thread, s) == 0 ? 0 : -1;
+		s->wb_running = ret == 0;
+	}
+	if (ret == 0)
+		s->wb_window = window_ms;
+	pthread_mutex_unlock(&s->wb_lock);
+	return ret;
+}
+
+// writes still pending go out before the worker stops
+static void _wb_stop(struct fx_serial *s)
+{
+	pthread_mutex_lock(&s->wb_lock);
+	s->wb_window = 0;
+	s->wb_stop = 1;
+	pthread_cond_broadcast(&s->wb_cv);
+	pthread_mutex_unlock(&s->wb_lock);
+
+	if (s->wb_running)
+		pthread_join(s->wb_tid, NULL);
+	s->wb_running = 0;
+	free(s->wb);
+	s->wb = NULL;
+}
+
+int fx_register_set_block(struct fx_serial *s, int id, int n, const int *data, int flag)
+{
+	struct serialcommand sc;
+	char buf[FX_BLOCK_MAX*4];
+	int i;
+
+	if (_checkRange(id, n, flag) != 0)
+		return -1;
+	if (flag == 2 && s->wb_window > 0)
+		return _wb_write(s, id, n, data);
+
+	for (i = 0; i < n; i++)
+		integer_to_buf4(data[i] & 0xFFFF, &buf[i*4]);
+	if (getWriteCommandFrame(sc.buf, &sc.sz, id, n, buf, flag) != 0)
+		return -1;
+	sc.station = FX_STATION_NONE;
+
+	char buf2[255];
+	int sz = _serial_call(s, &sc, buf2, sizeof(buf2));
+	if (sz == FX_EQUEUE)
+		return FX_EQUEUE;
+
+	return _parse_write(FX_STATION_NONE, buf2, sz);
+}
+
+int fx_register_get_block(struct fx_serial *s, int id, int n, int *data, int flag)
+{
+	struct serialcommand sc;
+
+	if (getReadCommandFrame(sc.buf, &sc.sz, id, n, flag) != 0)
+		return -1;
+	sc.station = FX_STATION_NONE;
+
+	char buf[FX_BLOCK_MAX*4+4];
+	int sz = _serial_call(s, &sc, buf, sizeof(buf));
+	if (sz == FX_EQUEUE)
+		return FX_EQUEUE;
+
+	return _parse_read(FX_STATION_NONE, buf, sz, n, data, flag);
+}
+
+int fx_transaction(struct fx_serial *s, struct fx_txn_op *ops, int n)
+{
+	struct serialcommand sc;
+	char buf[FX_BLOCK_MAX*4], resp[4096];
+	int i, k, sz, at = 0, ret = 0;
+
+	if (n < 1 || n > FX_TXN_MAX)
+		return -1;
+	for (i = 0; i < n; i++) {
+		struct fx_txn_op *op = &ops[i];
+
+		if (_checkRange(op->id, op->n, op->flag) != 0 || op->data == NULL)
+			return -1;
+		if (at + 11 + (op->op == FX_OP_WRITE ? op->n*4 : 0) > FX_TXN_BYTES)
+			return -1;
+		if (op->op == FX_OP_READ) {
+			getReadCommandFrame(sc.buf + at, &sz, op->id, op->n, op->flag);
+		} else if (op->op == FX_OP_WRITE) {
+			for (k = 0; k < op->n; k++)
+				integer_to_buf4(op->data[k] & 0xFFFF, &buf[k*4]);
+			getWriteCommandFrame(sc.buf + at, &sz, op->id, op->n, buf, op->flag);
+		} else {
+			return -1;
+		}
+		at += sz;
+	}
+	sc.sz = at;
+	sc.station = FX_STATION_NONE;
+	sc.txn = n;
+
+	sz = _serial_call_txn(s, &sc, resp, sizeof(resp));
+	if (sz == FX_EQUEUE)
+		return FX_EQUEUE;
+
+	// a size byte and the answer per frame sent; anything else (NAK
+	// when dropped, nothing on caller timeout) fails what is left
+	for (i = 0, at = 0; i < n; i++) {
+		struct fx_txn_op *op = &ops[i];
+		int len = at < sz ? (unsigned char)resp[at] : -1;
+
+		if (len < 0 || at + 1 + len > sz) {
+			op->status = -1;
+		} else if (op->op == FX_OP_READ) {
+			op->status = _parse_read(FX_STATION_NONE, resp + at + 1, len, op->n, op->data, op->flag);
+		} else {
+			op->status = _parse_write(FX_STATION_NONE, resp + at + 1, len);
+		}
+		if (len >= 0)
+			at += 1 + len;
+		if (op->status != 0) {
+			ret = -1;
+			at = sz;
+		}
+	}
+	return ret;
+}
+
+int fx_register_set(struct fx_serial *s, int id, int data,int flag)
+{
+	return fx_register_set_block(s, id, 1, &data, flag);
 }
 
-
-
-static int getReadCommandFrame (char *buf, int *sz, int address, int num,int flag)
+int fx_register_get(struct fx_serial *s, int id, int *data,int flag)
 {
-	if (buf == NULL || sz == NULL ||  
-			(address < 0 || address > 255) || num < 0 || flag<0 || flag>2)  
-		return -1; 
+	return fx_register_get_block(s, id, 1, data, flag);
+}
 
-	buf[0] = 0x02;
-	buf[1] = '0';
+int fx_station_set_block(struct fx_serial *s, int station, int id, int n, const int *data, int flag)
+{
+	struct serialcommand sc;
 
-	_getAddressAscii(address, &buf[2],flag);
+	if (getStationCommandFrame(sc.buf, &sc.sz, station, id, n, data, flag) != 0)
+		return -1;
+	sc.station = station;
 
-	num = num *2;
+	char buf[16];
+	int sz = _serial_call(s, &sc, buf, sizeof(buf));
+	if (sz == FX_EQUEUE)
+		return FX_EQUEUE;
 
-	buf[6] = _getAscii(num/10);
-	buf[7] = _getAscii(num%10);
+	return _parse_write(station, buf, sz);
+}
 
-	buf[8] = 0x03;
+int fx_station_get_block(struct fx_serial *s, int station, int id, int n, int *data, int flag)
+{
+	struct serialcommand sc;
 
+	if (getStationCommandFrame(sc.buf, &sc.sz, station, id, n, NULL, flag) != 0)
+		return -1;
+	sc.station = station;
 
-	int i, sum = 0;
-	for (i = 1; i <= 8; i++)
-		sum += buf[i];
+	char buf[FX_BLOCK_MAX*4+8];
+	int sz = _serial_call(s, &sc, buf, sizeof(buf));
+	if (sz == FX_EQUEUE)
+		return FX_EQUEUE;
 
-	i = sum&0xFF;
-	buf[9]  = _getAscii(i/16);
-	buf[10] = _getAscii(i%16);
+	return _parse_read(station, buf, sz, n, data, flag);
+}
 
-	*sz = 11;
+int fx_station_set_timeout(struct fx_serial *s, int station, int ms)
+{
+	if (station < 0 || station >= FX_STATION_MAX || ms < 0)
+		return -1;
 
-	//for (i = 0; i < *sz; i++) {
-	//	printf("%02x ", buf[i]);
-	//}
-	//printf("\n");
+	pthread_mutex_lock(&s->st_lock);
+	s->st[station].timeout = ms;
+	pthread_mutex_unlock(&s->st_lock);
 
 	return 0;
 }
 
-static int getWriteCommandFrame(char *buf, int *sz, int address, int num, char *data,int flag)
+int fx_station_is_down(struct fx_serial *s, int station)
 {
-	if (buf == NULL || sz == NULL ||  
-			(address < 0 || address > 255) || num < 0)  
-		return -1; 
-
-	buf[0] = 0x02;
-	buf[1] = '1';
-
-	_getAddressAscii(address, &buf[2],flag);
+	int down;
 
-	num = num*2;
+	if (station < 0 || station >= FX_STATION_MAX)
+		return -1;
 
-	buf[6] = _getAscii(num/10);
-	buf[7] = _getAscii(num%10);
+	pthread_mutex_lock(&s->st_lock);
+	down = s->st[station].backoff != 0;
+	pthread_mutex_unlock(&s->st_lock);
 
-	int i;
-	for (i = 0; i < num*2; i+=4) {
-		buf[8+i]   = data[i+2];
-		buf[8+i+1] = data[i+3];
-		buf[8+i+2] = data[i];
-		buf[8+i+3] = data[i+1];
-	}
+	return down;
+}
 
-	buf[8+num*2] = 0x03;
+// asynchronous access
+// The command lives inside the caller's fx_async, so nothing is
+// allocated per operation; op comes back through done().
+//////////////////////////////////////////////////////////////////
+static struct fx_async *_async_of(struct serialcommand *sc)
+{
+	return (struct fx_async *)((char *)sc - offsetof(struct fx_async, priv));
+}
 
-	int sum = 0;
-	for (i = 1; i <= 8+num*2; i++)
-		sum += buf[i];
+static int _cb_op(struct serialcommand *sc, char *buf, int sz)
+{
+	struct fx_async *op = _async_of(sc);
+	int station = sc->station;
+
+	if (sz == FX_EQUEUE)
+		op->status = FX_EQUEUE;
+	else if (sz <= 0)
+		op->status = -1;
+	else if (op->op == FX_OP_READ || op->op == FX_OP_STATION_READ)
+		op->status = _parse_read(station, buf, sz, op->n, op->data, op->flag);
+	else
+		op->status = _parse_write(station, buf, sz);
+
+	op->done(op);
+	return 0;
+}
 
-	i = sum&0xFF;
-	buf[8+num*2+1]  = _getAscii(i/16);
-	buf[8+num*2+2]  = _getAscii(i%16);
+int fx_async_submit(struct fx_serial *s, struct fx_async *op)
+{
+	struct serialcommand *sc = (struct serialcommand *)op->priv.c;
+	char buf[FX_BLOCK_MAX*4];
+	int i, ret = -1;
 
-	*sz = 8+num*2+3;
+	if (op->done == NULL)
+		return -1;
 
-	//for (i = 0; i < *sz; i++) {
-	//	printf("%02x ", buf[i]);
-	//}
-	//	printf("\n");
+	switch (op->op) {
+	case FX_OP_READ:
+		ret = getReadCommandFrame(sc->buf, &sc->sz, op->id, op->n, op->flag);
+		sc->station = FX_STATION_NONE;
+		break;
+	case FX_OP_WRITE:
+		if (_checkRange(op->id, op->n, op->flag) != 0)
+			return -1;
+		for (i = 0; i < op->n; i++)
+			integer_to_buf4(op->data[i] & 0xFFFF, &buf[i*4]);
+		ret = getWriteCommandFrame(sc->buf, &sc->sz, op->id, op->n, buf, op->flag);
+		sc->station = FX_STATION_NONE;
+		break;
+	case FX_OP_STATION_READ:
+	case FX_OP_STATION_WRITE:
+		ret = getStationCommandFrame(sc->buf, &sc->sz, op->station, op->id, op->n,
+				op->op == FX_OP_STATION_WRITE ? op->data : NULL, op->flag);
+		sc->station = op->station;
+		break;
+	}
+	if (ret != 0)
+		return -1;
 
-	return 0;
+	sc->fd = -1;
+	sc->cb = _cb_op;
+	sc->call = NULL;
+	sc->pool = NULL;
+	sc->external = 1;
+	sc->done = 0;
+	sc->txn = 0;
+	sc->deadline = op->timeout > 0 ? _now_ms() + op->timeout : 0;
+	op->status = 0;
+
+	// never block an event loop: no room is FX_EQUEUE right away
+	return _enqueue(s, sc, 0);
 }
+
+// typed D access
+// 32 bit values and floats keep their low word in the lower register,
+// strings their first character in the low byte, as the PLC does.
 //////////////////////////////////////////////////////////////////
+enum { _T_INT16, _T_INT32, _T_FLOAT, _T_STRING };
 
-static int _cb_async(int fd, char *buf, int sz)
-{	
-	write(fd, buf, sz);
-	return 0;
+static int _t_words(int type)
+{
+	return type == _T_INT32 || type == _T_FLOAT ? 2 : 1;
 }
 
-static int atoh(char x)
+/*
+ * Converts nw words read at word offset `at` into values of out. nw is
+ * a multiple of the value size since frames are cut on value edges.
+ */
+static void _t_decode(int type, const int *w, int nw, void *out, int at)
 {
-	int y;
-	switch(x)
-	{
-		case '0': y = 0; break;//add by sunkui
-		case '1': y = 1; break;
-		case '2': y = 2; break;
-		case '3': y = 3; break;
-		case '4': y = 4; break;
-		case '5': y = 5; break;
-		case '6': y = 6; break;
-		case '7': y = 7; break;
-		case '8': y = 8; break;
-		case '9': y = 9; break;
-		case 'A': y = 10; break;
-		case 'B': y = 11; break;
-		case 'C': y = 12; break;
-		case 'D': y = 13; break;
-		case 'E': y = 14; break;
-		case 'F': y = 15; break;
-	}
+	int i;
 
-	return  y;
-}
+	for (i = 0; i < nw; i += _t_words(type)) {
+		unsigned int x = (w[i] & 0xFFFF);
+		if (_t_words(type) == 2)
+			x |= (unsigned int)(w[i+1] & 0xFFFF) << 16;
 
-static void buf4_to_integer(char *buf, int *integer,int flag)
-{
-	
-	int x1=0, x2=0, x3=0, x4=0;
-	
-	if(flag==0 || flag ==1)
-	{
-		x1 = atoh(buf[0]);//2 3 0 1 
-		x2 = atoh(buf[1]);
-		x3 = atoh(buf[2]);
-		x4 = atoh(buf[3]);
-	}
-	else if(flag ==2)
-	{
-		x1 = atoh(buf[2]);//2 3 0 1 
-		x2 = atoh(buf[3]);
-		x3 = atoh(buf[0]);
-		x4 = atoh(buf[1]);
+		switch (type) {
+		case _T_INT16:
+			((int16_t *)out)[at+i] = x;
+			break;
+		case _T_INT32:
+			((int32_t *)out)[(at+i)/2] = x;
+			break;
+		case _T_FLOAT:
+			memcpy(&((float *)out)[(at+i)/2], &x, sizeof(float));
+			break;
+		case _T_STRING:
+			((char *)out)[(at+i)*2] = x & 0xFF;
+			((char *)out)[(at+i)*2+1] = x >> 8;
+			break;
+		}
 	}
-	
-	// x1 = atoh(*buf);
-	// x2 = atoh(*(buf+sizeof(char)));
-	// x3 = atoh(*(buf+2*sizeof(char)));
-	// x4 = atoh(*(buf+3*sizeof(char)));
-	*integer = x1*16*16*16+x2*16*16+x3*16+x4;
 }
 
-// static void buf2_to_integer(char *buf, int *x)
-// {
-// 	int x1, x2;
-// 	x1 = atoh(buf[0]);
-// 	x2 = atoh(buf[1]);
+static void _t_encode(int type, int *w, int nw, const void *in, int at)
+{
+	int i;
 
-// 	*x = x1*16+x2;
-// }
+	for (i = 0; i < nw; i += _t_words(type)) {
+		unsigned int x = 0;
 
-static void integer_to_buf4(int x, char *buf)
-{
-	int x1, x2, x3, x4;
-	// x4 = x%10;
-	// x3 = (x%100)/10;
-	// x2 = (x/100)%10;
-	// x1 = x/1000;
-	 
-	x1 = x / (16 * 16 * 16); 
-	x2 = (x / (16 * 16)) % 16; 
-	x3 = x - x1*(16*16*16) - x2*(16*16); 
-	x3 = x3 / 16; 
-	x4= x % 16;
+		switch (type) {
+		case _T_INT16:
+			x = ((const int16_t *)in)[at+i] & 0xFFFF;
+			break;
+		case _T_INT32:
+			x = ((const int32_t *)in)[(at+i)/2];
+			break;
+		case _T_FLOAT:
+			memcpy(&x, &((const float *)in)[(at+i)/2], sizeof(float));
+			break;
+		case _T_STRING:
+			x = ((const unsigned char *)in)[(at+i)*2] |
+				((const unsigned char *)in)[(at+i)*2+1] << 8;
+			break;
+		}
 
-	if(x1>=0 && x1<=9)//edit by sunkui
-	{
-		buf[0] = x1 + '0';
-	}
-	else if(x1>=10 && x1<=15)
-	{
-		buf[0] = x1 - 10 + 'A';
+		w[i] = x & 0xFFFF;
+		if (_t_words(type) == 2)
+			w[i+1] = x >> 16;
 	}
-	
+}
 
-	if(x2>=0 && x2<=9)
-	{
-		buf[1] = x2 + '0';
-	}
-	else if(x2>=10 && x2<=15)
-	{
-		buf[1] = x2 - 10 + 'A';
-	}
+/*
+ * Moves nw consecutive D words in as few frames as FX_BLOCK_MAX allows,
+ * converting each frame's worth as it arrives. FX_BLOCK_MAX is even so
+ * a two word value never straddles two frames.
+ */
+static int _t_transfer(struct fx_serial *s, int id, int nw, int type, void *vals, int write)
+{
+	int w[FX_BLOCK_MAX], at, k, ret;
 
-	if(x3>=0 && x3<=9)
-	{
-		buf[2] = x3 + '0';
-	}
-	else if(x3>=10 && x3<=15)
-	{
-		buf[2] = x3 - 10 + 'A';
-	}
+	if (nw <= 0)
+		return -1;
 
-	if(x4>=0 && x4<=9)
-	{
-		buf[3] = x4 + '0';
-	}
-	else if(x4>=10 && x4<=15)
-	{
-		buf[3] = x4 - 10 + 'A';
+	for (at = 0; at < nw; at += k) {
+		k = nw - at < FX_BLOCK_MAX ? nw - at : FX_BLOCK_MAX;
+		if (write) {
+			_t_encode(type, w, k, vals, at);
+			ret = fx_register_set_block(s, id + at, k, w, 2);
+		} else {
+			ret = fx_register_get_block(s, id + at, k, w, 2);
+			if (ret == 0)
+				_t_decode(type, w, k, vals, at);
+		}
+		if (ret != 0)
+			return ret;
 	}
-	// buf[1] = x2 + '0';
-	// buf[2] = x3 + '0';
-	// buf[3] = x4 + '0';
+
+	return 0;
 }
 
-int fx_register_set(struct fx_serial *s, int id, int data,int flag)
+int fx_register_get_int16(struct fx_serial *s, int id, int n, int16_t *v)
 {
-	struct serialcommand sc;
-	char buf[4]={0};
-	integer_to_buf4(data, buf);
-	getWriteCommandFrame(sc.buf, &sc.sz, id, 1, buf,flag);
+	return _t_transfer(s, id, n, _T_INT16, v, 0);
+}
 
-	int fd[2];
-	pipe(fd);
+int fx_register_set_int16(struct fx_serial *s, int id, int n, const int16_t *v)
+{
+	return _t_transfer(s, id, n, _T_INT16, (void *)v, 1);
+}
 
-	sc.fd = fd[1];	
-	sc.cb = _cb_async;
-	serial_command(s, &sc);
-	
-	char buf2[255];
-	int sz;
-	int ret; /*select return value*/
-	struct timeval tv;
-	fd_set readset;
+int fx_register_get_int32(struct fx_serial *s, int id, int n, int32_t *v)
+{
+	return _t_transfer(s, id, n*2, _T_INT32, v, 0);
+}
 
-	FD_ZERO(&readset);
-	FD_SET(fd[0],&readset);
-	tv.tv_sec = 2;
-	tv.tv_usec = 0;
-	
-	if((ret = select((fd[0]+1),&readset,NULL,NULL,&tv)) < 0){
-		fprintf(stderr, "select error\n");
-		return -1;
-	}else if(ret == 0){
-		fprintf(stderr, "file does not ready\n");
-		return -1;
-	} 
-	sz = read(fd[0], buf2, 255);
-//	int i;
-//	for (i = 0; i < sz; i++) {
-//		printf("%02x ", buf2[i]);
-//	}
+int fx_register_set_int32(struct fx_serial *s, int id, int n, const int32_t *v)
+{
+	return _t_transfer(s, id, n*2, _T_INT32, (void *)v, 1);
+}
 
-//	printf("\n");
-	close(fd[0]);
-	close(fd[1]);
+int fx_register_get_float(struct fx_serial *s, int id, int n, float *v)
+{
+	return _t_transfer(s, id, n*2, _T_FLOAT, v, 0);
+}
 
-	return 0;
+int fx_register_set_float(struct fx_serial *s, int id, int n, const float *v)
+{
+	return _t_transfer(s, id, n*2, _T_FLOAT, (void *)v, 1);
 }
 
-int fx_register_get(struct fx_serial *s, int id, int *data,int flag)
+int fx_register_get_string(struct fx_serial *s, int id, char *str, int len)
 {
-	struct serialcommand sc;
-	getReadCommandFrame(sc.buf, &sc.sz, id, 1,flag);
+	char buf[FX_STRING_MAX + 2];
+	int ret;
 
-	int fd[2];
-	pipe(fd);
+	if (len <= 0 || len > FX_STRING_MAX)
+		return -1;
 
-	sc.fd = fd[1];	
-	sc.cb = _cb_async;
-	serial_command(s, &sc);
-	
-	char buf[255];
-	int sz;
-	int ret; /*select return value*/
-	struct timeval tv;
-	fd_set readset;
+	ret = _t_transfer(s, id, (len+1)/2, _T_STRING, buf, 0);
+	if (ret != 0)
+		return ret;
 
-	FD_ZERO(&readset);
-	FD_SET(fd[0],&readset);
-	tv.tv_sec = 2;
-	tv.tv_usec = 0;
-	
-	if((ret = select((fd[0]+1),&readset,NULL,NULL,&tv)) < 0){
-		printf("select error\n");
-		return -1;
-	}else if(ret == 0){
-		printf("file does not ready\n");
-		return -1;
-	} 
+	memcpy(str, buf, len);
+	str[len] = '\0';
+	return 0;
+}
+
+int fx_register_set_string(struct fx_serial *s, int id, const char *str, int len)
+{
+	char buf[FX_STRING_MAX + 2];
 
-	sz = read(fd[0], buf, 255);
+	if (len <= 0 || len > FX_STRING_MAX)
+		return -1;
 
+	// NUL padded to whole registers
+	memset(buf, 0, len + 2);
+	strncpy(buf, str, len);
 
-	// int i;
-	// for (i = 0; i < sz; i++) {
-	// 	printf("%02x ", buf[i]);
-	// }
+	return _t_transfer(s, id, (len+1)/2, _T_STRING, buf, 1);
+}
 
-	printf("\n");
-	
+int fx_raw_command(struct fx_serial *s, const char *frame, int sz, char *resp, int resp_sz)
+{
+	struct serialcommand sc;
 
-	close(fd[0]);
-	close(fd[1]);
+	if (sz <= 0 || sz > (int)sizeof(sc.buf))
+		return -1;
 
-	unsigned int x=0;
-	buf4_to_integer(&(buf[1]), &x,flag);
-	*data = x;
-	
+	memcpy(sc.buf, frame, sz);
+	sc.sz = sz;
+	sc.station = FX_STATION_NONE;
 
-	return 0;	
+	return _serial_call(s, &sc, resp, resp_sz);
 }
+
 int read_x0(struct fx_serial *s, int *data)
 {
 	return fx_register_get(s,0,data,0);
@@ -22,16 +22,177 @@
 #ifndef FX_SERIAL_H_
 #define FX_SERIAL_H_
 
-// uncomment for print useful info
-//#define DEBUG_PRINT
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// protocol events (frames sent, bytes received, timeouts, checksum
+// errors) are recorded to a per-thread binary trace ring, dump it with
+// fx-trace-dump. Build with -DFX_NO_TRACE to compile tracing out.
 
 // for example: 
 // struct fx_serial *ss = fx_serial_start("/dev/ttyUSB0", 9600, '7', 'N', '1');
+// device may also be "tcp:host:port" (raw serial device server),
+// "rfc2217:host:port" (line set up over telnet) or "unix:/path".
+// NULL if the device cannot be opened or set up. When the device fails
+// later (read end of file or EIO: USB adapter unplugged, connection
+// closed) the worker opens it again with the same settings, retrying at
+// least every 0.5 s; queued requests wait within their deadlines and
+// the one on the wire is sent again. A /dev/serial/by-id/ path finds an
+// adapter that comes back under another ttyUSB number.
 struct fx_serial* fx_serial_start(char *device, int baude, char bits, char parity, char stop);
 int fx_serial_stop(struct fx_serial *ss);
 
+// how long the worker waits for a PLC response, in ms (default 5000)
+int fx_serial_set_timeout(struct fx_serial *ss, int ms);
+
+// tty only: have the kernel collect each answer (VMIN set to its size,
+// 0.1 s inter-byte VTIME, low latency driver mode where supported) so
+// the worker wakes about twice per transaction instead of once per
+// few bytes. Set it before the first request; -1 if the transport
+// cannot.
+int fx_serial_set_framing(struct fx_serial *ss, int on);
+
+// Modbus RTU instead of the programming port protocol, to slave unit
+// 1..247 (0: back to the programming port), for FX3U PLCs behind a
+// 485 adapter in Modbus mode. The calls stay the same; devices map as
+// in map (NULL: the adapter's default assignment, see fx-modbus.h) and
+// RS-485 station calls fail. Open the port with 8 data bits.
+struct fx_modbus_map;
+int fx_serial_set_modbus(struct fx_serial *ss, int unit, const struct fx_modbus_map *map);
+
+// how long fx_register_get() and friends wait for their answer, in ms
+// (default 2000). A request still queued when its caller gives up is
+// dropped by the worker, never sent. When nothing is queued and the
+// line is free the calling thread does the transaction itself, without
+// a handoff to the worker (not in real-time mode).
+int fx_serial_set_call_timeout(struct fx_serial *ss, int ms);
+
+// admission control. At most limit requests wait in the queue (default
+// FX_QUEUE_LIMIT). When it is full a write or read pushes out a queued
+// read of lower priority (writes rank above reads), whose caller gets
+// FX_EQUEUE; otherwise the new request waits up to submit_timeout ms
+// for room (-1 forever, the default; 0 fail at once) and then fails
+// with FX_EQUEUE without being sent.
+#define FX_EQUEUE      -2
+#define FX_QUEUE_LIMIT 65536
+int fx_serial_set_queue_limit(struct fx_serial *ss, int limit);
+int fx_serial_set_submit_timeout(struct fx_serial *ss, int ms);
+
+// the longest one transaction may hold the line, in ms (0: no limit,
+// the default). Larger programming port reads and writes are cut into
+// frames that fit, going by the baud rate and the measured turnaround,
+// and writes queued meanwhile are sent between them: queued writes go
+// ahead of queued reads, so a write waits at most about this long plus
+// the writes ahead of it. RS-485 station frames are sent whole.
+int fx_serial_set_max_block(struct fx_serial *ss, int ms);
+
+// write-behind for setpoints. With a window > 0 ms, writes to D
+// registers (fx_register_set() and friends) are held back: the first
+// opens a window, later ones in it replace a pending value of the same
+// register, and when it closes the latest values go out with adjacent
+// registers merged into multi-word frames, back to back as
+// transactions. Each caller returns once the frame carrying its
+// registers is acknowledged (status of that write, -1 after the window
+// plus the call timeout). Reads do not see values still pending. 0
+// turns it off; what is pending still goes out.
+int fx_serial_set_write_behind(struct fx_serial *ss, int window_ms);
+
+// requests queued now; wait_ms, if not NULL, gets a guess at how long a
+// new one would wait: depth times the recent time per transaction
+int fx_serial_queue_depth(struct fx_serial *ss, int *wait_ms);
+
+// real-time mode for the worker thread. cpu pins it (-1: any), priority
+// > 0 runs it SCHED_FIFO, lock_memory preallocates request buffers and
+// mlockall()s the process, period_us starts transactions on an absolute
+// clock_nanosleep grid instead of sleeping 1 ms between them. Priority
+// and mlock need CAP_SYS_NICE / CAP_IPC_LOCK (or rlimits).
+struct fx_rt_config {
+	int cpu;
+	int priority;
+	int lock_memory;
+	int period_us;
+};
+int fx_serial_set_realtime(struct fx_serial *ss, const struct fx_rt_config *rt);
+
+// how late the worker woke up against its period grid (period_us set)
+struct fx_jitter {
+	unsigned long cycles;
+	int p50_us;
+	int p99_us;
+	int p999_us;
+	int max_us;
+};
+int fx_serial_get_jitter(struct fx_serial *ss, struct fx_jitter *j);
+
+// line timing, for cost estimates: time of one character at the
+// configured baud rate and the PLC's answer delay as measured so far
+// (FX_TURNAROUND_DEFAULT before the first answer)
+#define FX_TURNAROUND_DEFAULT 10000
+struct fx_timing {
+	int baude;
+	int char_us;
+	int turnaround_us;
+};
+int fx_serial_get_timing(struct fx_serial *ss, struct fx_timing *t);
+
+struct fx_stats {
+	unsigned long sent;		/* frames written */
+	unsigned long received;		/* good answers */
+	unsigned long errors;		/* bad sum or CRC, wrong station */
+	unsigned long expired;		/* dropped: deadline passed in the queue */
+	unsigned long cancelled;	/* dropped: caller stopped waiting */
+	unsigned long shed;		/* dropped: room made for a more important one */
+	unsigned long rejected;		/* not queued: no room within submit_timeout */
+	unsigned long wakeups;		/* times the worker woke up to read an answer */
+	unsigned long reconnects;	/* device lost and opened again */
+	unsigned long reconnect_ms;	/* last outage, error to line set up again */
+	unsigned long reconnect_max_ms;
+	unsigned long timeouts;		/* no complete answer in time */
+	unsigned long coalesced;	/* writes replaced by a later one, see write-behind */
+};
+int fx_serial_get_stats(struct fx_serial *ss, struct fx_stats *st);
+
 int fx_register_set(struct fx_serial *ss, int id, int data,int flag);
 int fx_register_get(struct fx_serial *ss, int id, int *data,int flag);
+
+// n consecutive words in one frame, n <= FX_BLOCK_MAX. flag as above:
+// 0 X, 1 Y, 3 M (id is the byte address, M0..M1023), 2 D (id is the
+// register number, D8000..D8255 are the special registers; a block
+// stays on one side)
+#define FX_BLOCK_MAX 32
+int fx_register_set_block(struct fx_serial *ss, int id, int n, const int *data, int flag);
+int fx_register_get_block(struct fx_serial *ss, int id, int n, int *data, int flag);
+
+// n typed values from D registers starting at id, moved in as few frames
+// as possible. 32 bit values and floats take two registers, low word
+// first; strings two characters per register, first in the low byte
+// (str gets len characters and a NUL, the write pads with NUL),
+// len <= FX_STRING_MAX.
+#define FX_STRING_MAX (FX_BLOCK_MAX*2*4)
+int fx_register_get_int16(struct fx_serial *ss, int id, int n, int16_t *v);
+int fx_register_set_int16(struct fx_serial *ss, int id, int n, const int16_t *v);
+int fx_register_get_int32(struct fx_serial *ss, int id, int n, int32_t *v);
+int fx_register_set_int32(struct fx_serial *ss, int id, int n, const int32_t *v);
+int fx_register_get_float(struct fx_serial *ss, int id, int n, float *v);
+int fx_register_set_float(struct fx_serial *ss, int id, int n, const float *v);
+int fx_register_get_string(struct fx_serial *ss, int id, char *str, int len);
+int fx_register_set_string(struct fx_serial *ss, int id, const char *str, int len);
+
+// RS-485 multidrop through FX-485 adapters (dedicated protocol format 1,
+// sum check on, station numbers 0..15). Stations share the line round
+// robin; one that stops answering is taken off the bus after a few
+// timeouts, its calls fail at once and it is probed with backoff.
+// timeout 0 means the transport default.
+#define FX_STATION_MAX  16
+#define FX_STATION_NONE -1
+int fx_station_set_block(struct fx_serial *ss, int station, int id, int n, const int *data, int flag);
+int fx_station_get_block(struct fx_serial *ss, int station, int id, int n, int *data, int flag);
+int fx_station_set_timeout(struct fx_serial *ss, int station, int ms);
+int fx_station_is_down(struct fx_serial *ss, int station);
+
 int read_x0(struct fx_serial *s, int *data);
 int read_x1(struct fx_serial *s, int *data);
 int read_x2(struct fx_serial *s, int *data);
@@ -42,4 +203,80 @@ int read_y2(struct fx_serial *s, int *data);
 int read_y3(struct fx_serial *s, int *data);
 int read_registerD(struct fx_serial *s,int id, int *data);
 
+// asynchronous access, for event loops and coroutines (see fx-serial.hpp).
+// Fill in op and submit it; done(op) is called exactly once, on the
+// worker thread, with op->status 0, -1 (error, no answer, dropped after
+// op->timeout ms in the queue) or FX_EQUEUE (shed); ops still queued
+// when fx_serial_stop() runs complete on its thread. Until then op and
+// op->data belong to the library. Nothing is allocated per operation.
+// Submit returns FX_EQUEUE instead of waiting when the queue is full,
+// and -1 for a bad op; done is not called in either case.
+#define FX_OP_READ          0
+#define FX_OP_WRITE         1
+#define FX_OP_STATION_READ  2
+#define FX_OP_STATION_WRITE 3
+#define FX_ASYNC_PRIV       640
+
+struct fx_async {
+	int op;			/* FX_OP_* */
+	int station;		/* FX_OP_STATION_*: RS-485 station number */
+	int flag;		/* as fx_register_get_block() */
+	int id;
+	int n;			/* words, 1..FX_BLOCK_MAX */
+	int *data;
+	int timeout;		/* ms, 0: none */
+	void (*done)(struct fx_async *op);
+	void *user;
+	int status;
+
+	union {
+		char c[FX_ASYNC_PRIV];
+		long long align;
+	} priv;
+};
+int fx_async_submit(struct fx_serial *ss, struct fx_async *op);
+
+// transactions, e.g. a handshake: write D100, write D101, read D200.
+// The ops are queued as one request and sent back to back in order,
+// with nothing else on the line in between; one wakeup completes all of
+// them. Each op gets its status, and after the first that fails the
+// rest are not sent (status -1). Not sent again after a link failure.
+// At most FX_TXN_MAX ops, whose frames take 11 bytes each plus 4 per
+// word written and must fit FX_TXN_BYTES. 0 if all succeeded, -1
+// otherwise, FX_EQUEUE if the queue had no room.
+#define FX_TXN_MAX   16
+#define FX_TXN_BYTES 512
+
+struct fx_txn_op {
+	int op;			/* FX_OP_READ or FX_OP_WRITE */
+	int flag;		/* as fx_register_get_block() */
+	int id;
+	int n;			/* words, 1..FX_BLOCK_MAX */
+	int *data;
+	int status;		/* 0 or -1 */
+};
+int fx_transaction(struct fx_serial *ss, struct fx_txn_op *ops, int n);
+
+// send a complete, already framed command and return the raw response
+// size (resp holds the bytes as received), -1 on error or timeout
+int fx_raw_command(struct fx_serial *s, const char *frame, int sz, char *resp, int resp_sz);
+
+// record every frame sent and every response, with monotonic
+// timestamps, to a binary capture file (see fx-capture.h, fx-replay)
+int fx_capture_start(struct fx_serial *s, const char *path);
+int fx_capture_stop(struct fx_serial *s);
+
+// keep every value read from the PLC, timestamped, in an append-only
+// historian file (see fx-hist.h for the format and the query reader).
+// Samples are packed in memory per device and written a whole segment
+// at a time; flush writes out the partly filled ones and syncs the file
+// to disk, stop flushes too.
+int fx_historian_start(struct fx_serial *s, const char *path);
+int fx_historian_flush(struct fx_serial *s);
+int fx_historian_stop(struct fx_serial *s);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
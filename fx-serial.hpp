@@ -0,0 +1,401 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FX_SERIAL_HPP_
+#define FX_SERIAL_HPP_
+
+// C++20 coroutine front end, header only, over fx_async_submit().
+//
+// for example:
+// fx::context ctx;
+// fx::port plc("/dev/ttyUSB0", 9600, '7', 'E', '1', &ctx);
+//
+// fx::task<> poll(fx::port &plc) {
+//     auto d = co_await plc.read(fx::D{100}, 8);
+//     if (d)
+//         co_await plc.write(fx::D{200}, d.values());
+// }
+//
+// fx::spawn(poll(plc));
+// ctx.run();
+//
+// An awaitable holds its fx_async, so an operation costs no allocation
+// beyond the coroutine frame it is awaited in. Operations complete on
+// the library worker thread; with a context they are handed to the
+// thread(s) running it, without one the coroutine resumes right on the
+// worker thread and the link stays busy until it suspends again.
+//////////////////////////////////////////////////////////////////
+
+#include <array>
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <utility>
+#include "fx-serial.h"
+
+namespace fx {
+
+// devices, as flag and id of fx_register_get_block()
+struct X { int id; static constexpr int flag = 0; };	// id: byte address
+struct Y { int id; static constexpr int flag = 1; };	// id: byte address
+struct D { int id; static constexpr int flag = 2; };
+
+class context;
+
+namespace detail {
+
+struct op_base {
+	fx_async a{};
+	std::coroutine_handle<> h;
+	context *ctx = nullptr;
+	op_base *next = nullptr;
+
+	static void done(fx_async *a);
+
+	template <class Dev>
+	void prepare(int op, Dev d, int *data, int n, context *c)
+	{
+		a.op = op;
+		a.flag = Dev::flag;
+		a.id = d.id;
+		a.n = n;
+		a.data = data;
+		a.done = &op_base::done;
+		a.user = this;
+		ctx = c;
+	}
+
+	// submits; false means it failed at once and the caller goes on
+	bool submit(fx_serial *s, std::coroutine_handle<> caller)
+	{
+		h = caller;
+		// after a successful submit *this may already be resumed and gone
+		int ret = fx_async_submit(s, &a);
+		if (ret != 0) {
+			a.status = ret;
+			return false;
+		}
+		return true;
+	}
+};
+
+} // namespace detail
+
+// Runs completed operations on the threads that call run().
+class context {
+public:
+	context() = default;
+	context(const context &) = delete;
+	context &operator=(const context &) = delete;
+
+	void post(detail::op_base *op)
+	{
+		std::lock_guard<std::mutex> lk(m_);
+		op->next = nullptr;
+		if (tail_)
+			tail_->next = op;
+		else
+			head_ = op;
+		tail_ = op;
+		cv_.notify_one();
+	}
+
+	// until stop()
+	void run()
+	{
+		while (detail::op_base *op = pop(true))
+			op->h.resume();
+	}
+
+	// what is ready now; returns the number resumed
+	int poll()
+	{
+		int n = 0;
+		while (detail::op_base *op = pop(false)) {
+			op->h.resume();
+			n++;
+		}
+		return n;
+	}
+
+	void stop()
+	{
+		std::lock_guard<std::mutex> lk(m_);
+		stopped_ = true;
+		cv_.notify_all();
+	}
+
+private:
+	detail::op_base *pop(bool wait)
+	{
+		std::unique_lock<std::mutex> lk(m_);
+		if (wait)
+			cv_.wait(lk, [this] { return head_ || stopped_; });
+		detail::op_base *op = head_;
+		if (op) {
+			head_ = op->next;
+			if (head_ == nullptr)
+				tail_ = nullptr;
+		}
+		return op;
+	}
+
+	std::mutex m_;
+	std::condition_variable cv_;
+	detail::op_base *head_ = nullptr, *tail_ = nullptr;
+	bool stopped_ = false;
+};
+
+inline void detail::op_base::done(fx_async *a)
+{
+	op_base *op = static_cast<op_base *>(a->user);
+
+	if (op->ctx)
+		op->ctx->post(op);
+	else
+		op->h.resume();
+}
+
+// up to FX_BLOCK_MAX words read by port::read(dev, n)
+struct block {
+	int status = -1;	// 0, -1 or FX_EQUEUE
+	int n = 0;
+	std::array<int, FX_BLOCK_MAX> v{};
+
+	explicit operator bool() const { return status == 0; }
+	int operator[](int i) const { return v[i]; }
+	std::span<const int> values() const { return {v.data(), (size_t)n}; }
+};
+
+class read_op : detail::op_base {
+public:
+	template <class Dev>
+	read_op(fx_serial *s, context *c, Dev d, int n) : s_(s)
+	{
+		b_.n = n;
+		prepare(FX_OP_READ, d, b_.v.data(), n, c);
+	}
+
+	bool await_ready() const noexcept { return false; }
+	bool await_suspend(std::coroutine_handle<> h) { return submit(s_, h); }
+	block await_resume()
+	{
+		b_.status = a.status;
+		return b_;
+	}
+
+private:
+	fx_serial *s_;
+	block b_;
+};
+
+// read into or write from caller memory; co_await gives the status
+class span_op : detail::op_base {
+public:
+	template <class Dev>
+	span_op(fx_serial *s, context *c, int op, Dev d, int *data, int n) : s_(s)
+	{
+		prepare(op, d, data, n, c);
+	}
+
+	bool await_ready() const noexcept { return false; }
+	bool await_suspend(std::coroutine_handle<> h) { return submit(s_, h); }
+	int await_resume() const noexcept { return a.status; }
+
+private:
+	fx_serial *s_;
+};
+
+// Owns a struct fx_serial for its lifetime.
+class port {
+public:
+	port(const char *device, int baude, char bits, char parity, char stop, context *ctx = nullptr)
+		: s_(fx_serial_start(const_cast<char *>(device), baude, bits, parity, stop)), ctx_(ctx) {}
+	explicit port(fx_serial *s, context *ctx = nullptr) : s_(s), ctx_(ctx) {}
+	~port() { reset(); }
+
+	port(const port &) = delete;
+	port &operator=(const port &) = delete;
+	port(port &&o) noexcept : s_(std::exchange(o.s_, nullptr)), ctx_(o.ctx_) {}
+	port &operator=(port &&o) noexcept
+	{
+		if (this != &o) {
+			reset();
+			s_ = std::exchange(o.s_, nullptr);
+			ctx_ = o.ctx_;
+		}
+		return *this;
+	}
+
+	fx_serial *get() const { return s_; }
+	explicit operator bool() const { return s_ != nullptr; }
+
+	template <class Dev>
+	read_op read(Dev d, int n) { return read_op(s_, ctx_, d, n); }
+
+	template <class Dev>
+	span_op read(Dev d, std::span<int> out)
+	{
+		return span_op(s_, ctx_, FX_OP_READ, d, out.data(), (int)out.size());
+	}
+
+	template <class Dev>
+	span_op write(Dev d, std::span<const int> in)
+	{
+		// the library only reads a write's data
+		return span_op(s_, ctx_, FX_OP_WRITE, d, const_cast<int *>(in.data()), (int)in.size());
+	}
+
+private:
+	void reset()
+	{
+		if (s_)
+			fx_serial_stop(s_);
+		s_ = nullptr;
+	}
+
+	fx_serial *s_;
+	context *ctx_;
+};
+
+// lazy coroutine; awaiting it starts it, spawn() runs it detached
+template <class T = void>
+class task;
+
+namespace detail {
+
+struct promise_base {
+	std::coroutine_handle<> cont = std::noop_coroutine();
+	std::exception_ptr err;
+	bool detached = false;
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+
+	struct final_awaiter {
+		bool await_ready() noexcept { return false; }
+		template <class P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+		{
+			promise_base &p = h.promise();
+			if (p.detached) {
+				h.destroy();
+				return std::noop_coroutine();
+			}
+			return p.cont;
+		}
+		void await_resume() noexcept {}
+	};
+	final_awaiter final_suspend() noexcept { return {}; }
+
+	void unhandled_exception()
+	{
+		if (detached)
+			std::terminate();
+		err = std::current_exception();
+	}
+};
+
+} // namespace detail
+
+template <class T>
+class task {
+public:
+	struct promise_type : detail::promise_base {
+		std::optional<T> value;
+
+		task get_return_object()
+		{
+			return task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		template <class U>
+		void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+	};
+
+	task(task &&o) noexcept : h_(std::exchange(o.h_, nullptr)) {}
+	~task() { if (h_) h_.destroy(); }
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller)
+	{
+		h_.promise().cont = caller;
+		return h_;
+	}
+	T await_resume()
+	{
+		if (h_.promise().err)
+			std::rethrow_exception(h_.promise().err);
+		return std::move(*h_.promise().value);
+	}
+
+	std::coroutine_handle<promise_type> release() { return std::exchange(h_, nullptr); }
+
+private:
+	explicit task(std::coroutine_handle<promise_type> h) : h_(h) {}
+	std::coroutine_handle<promise_type> h_;
+};
+
+template <>
+class task<void> {
+public:
+	struct promise_type : detail::promise_base {
+		task get_return_object()
+		{
+			return task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		void return_void() {}
+	};
+
+	task(task &&o) noexcept : h_(std::exchange(o.h_, nullptr)) {}
+	~task() { if (h_) h_.destroy(); }
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller)
+	{
+		h_.promise().cont = caller;
+		return h_;
+	}
+	void await_resume()
+	{
+		if (h_.promise().err)
+			std::rethrow_exception(h_.promise().err);
+	}
+
+	std::coroutine_handle<promise_type> release() { return std::exchange(h_, nullptr); }
+
+private:
+	explicit task(std::coroutine_handle<promise_type> h) : h_(h) {}
+	std::coroutine_handle<promise_type> h_;
+};
+
+// starts t on this thread; it frees itself when it finishes
+inline void spawn(task<> t)
+{
+	auto h = t.release();
+	h.promise().detached = true;
+	h.resume();
+}
+
+} // namespace fx
+
+#endif
@@ -0,0 +1,615 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "fx-tag.h"
+#include "fx-plan.h"
+
+#define TAG_LINE_MAX 512
+#define TAG_BUCKET   4		/* names per first level bucket, on average */
+#define TAG_SEED_MAX (1 << 20)	/* displacements tried per bucket */
+
+enum {
+	TAG_BOOL,
+	TAG_INT16,
+	TAG_UINT16,
+	TAG_INT32,
+	TAG_FLOAT,
+};
+
+struct tag {
+	int name;		/* offset in the name pool */
+	int flag;
+	int id;			/* X/Y byte address, D register */
+	int bit;		/* TAG_BOOL */
+	int type;
+	int group;
+	int at;			/* first value in its group's plan */
+	int line;		/* in the definition file */
+	double scale;
+	double offset;
+};
+
+struct tag_group {
+	int ntags;
+	int *tags;
+	int n;			/* addresses */
+	struct fx_addr *addrs;
+	int *raw;
+	struct fx_plan *plan;
+};
+
+struct fx_tagdb {
+	int n;
+	struct tag *tags;
+	char *names;
+	double *value;
+	char *valid;
+
+	// perfect hash: bucket h(name, 0) % nb picks seed disp[b], the
+	// tag is at slot[h(name, disp[b]) % m]
+	int nb, m;
+	uint32_t *disp;
+	int *slot;
+
+	struct tag_group groups[FX_TAG_GROUPS];
+};
+
+static uint32_t _hash(const char *s, uint32_t seed)
+{
+	uint32_t h = 2166136261u ^ (seed * 0x9E3779B1u);
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	// FNV alone spreads short names badly over a small table
+	h ^= h >> 16;
+	h *= 0x85EBCA6Bu;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35u;
+	h ^= h >> 16;
+	return h;
+}
+
+static int _words(int type)
+{
+	return type == TAG_INT32 || type == TAG_FLOAT ? 2 : 1;
+}
+
+static int _parse_type(const char *s)
+{
+	static const char *names[] = { "bool", "int16", "uint16", "int32", "float" };
+	int i;
+
+	for (i = 0; i < (int)(sizeof(names)/sizeof(names[0])); i++)
+		if (strcmp(s, names[i]) == 0)
+			return i;
+	return -1;
+}
+
+static char *_trim(char *s)
+{
+	char *e;
+
+	while (*s == ' ' || *s == '\t')
+		s++;
+	e = s + strlen(s);
+	while (e > s && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\r' || e[-1] == '\n'))
+		*--e = 0;
+	return s;
+}
+
+/*
+ * name,device,type[,scale[,offset[,group]]] into t; the name is left
+ * in f[0] for the caller to store.
+ */
+static int _parse_line(char *line, struct tag *t, char **name)
+{
+	char *f[6], *end;
+	int nf = 0, i;
+	long n;
+
+	f[nf++] = line;
+	for (; *line && nf < 6; line++) {
+		if (*line == ',') {
+			*line = 0;
+			f[nf++] = line + 1;
+		}
+	}
+	if (nf < 3)
+		return -1;
+	for (i = 0; i < nf; i++)
+		f[i] = _trim(f[i]);
+
+	*name = f[0];
+	if (**name == 0)
+		return -1;
+
+	switch (f[1][0]) {
+	case 'X': t->flag = 0; break;
+	case 'Y': t->flag = 1; break;
+	case 'D': t->flag = 2; break;
+	default: return -1;
+	}
+	n = strtol(f[1] + 1, &end, t->flag == 2 ? 10 : 8);
+	if (end == f[1] + 1 || *end || n < 0)
+		return -1;
+
+	t->type = _parse_type(f[2]);
+	if (t->type < 0 || (t->type == TAG_BOOL) != (t->flag != 2))
+		return -1;
+	if (t->flag == 2) {
+		if (0x1000 + (n + _words(t->type))*2 > 0x10000)
+			return -1;
+		t->id = n;
+		t->bit = 0;
+	} else {
+		if (n >= 0x20*8)
+			return -1;
+		t->id = n / 8;
+		t->bit = n % 8;
+	}
+
+	t->scale = nf > 3 && *f[3] ? strtod(f[3], &end) : 1;
+	if (nf > 3 && *f[3] && (*end || t->scale == 0))
+		return -1;
+	t->offset = nf > 4 && *f[4] ? strtod(f[4], &end) : 0;
+	if (nf > 4 && *f[4] && *end)
+		return -1;
+	t->group = nf > 5 && *f[5] ? strtol(f[5], &end, 10) : 0;
+	if (nf > 5 && *f[5] && (*end || t->group < 0 || t->group >= FX_TAG_GROUPS))
+		return -1;
+	return 0;
+}
+
+/*
+ * Hash and displace: buckets are placed largest first, each trying
+ * seeds until all its names land on free slots. With four names per
+ * bucket and a table of n slots this settles within a few hundred
+ * tries for the last, smallest buckets.
+ */
+static int _build_hash(struct fx_tagdb *db, int *dup)
+{
+	int *count, *order, *first, *next, *taken;
+	int i, j, b, nfull = 0, ret = -1;
+
+	db->nb = db->n / TAG_BUCKET + 1;
+	db->m = db->n;
+	db->disp = calloc(db->nb, sizeof(uint32_t));
+	db->slot = malloc(db->m * sizeof(int));
+	count = calloc(db->nb, sizeof(int));
+	order = malloc(db->nb * sizeof(int));
+	first = malloc(db->nb * sizeof(int));
+	next = malloc(db->n * sizeof(int));
+	taken = malloc(TAG_BUCKET * 8 * sizeof(int));
+	if (db->disp == NULL || db->slot == NULL || count == NULL || order == NULL ||
+			first == NULL || next == NULL || taken == NULL)
+		goto out;
+
+	for (b = 0; b < db->nb; b++)
+		first[b] = -1;
+	for (i = 0; i < db->n; i++) {
+		const char *name = db->names + db->tags[i].name;
+		b = _hash(name, 0) % db->nb;
+		// twins would never place, catch them here
+		for (j = first[b]; j >= 0; j = next[j]) {
+			if (strcmp(db->names + db->tags[j].name, name) == 0) {
+				*dup = i;
+				goto out;
+			}
+		}
+		next[i] = first[b];
+		first[b] = i;
+		count[b]++;
+	}
+	for (i = 0; i < db->m; i++)
+		db->slot[i] = -1;
+
+	// counting sort of the buckets, largest first
+	{
+		int max = 0, c;
+		for (b = 0; b < db->nb; b++)
+			if (count[b] > max)
+				max = count[b];
+		if (max > TAG_BUCKET * 8)
+			goto out;
+		for (c = max; c > 0; c--)
+			for (b = 0; b < db->nb; b++)
+				if (count[b] == c)
+					order[nfull++] = b;
+	}
+
+	for (j = 0; j < nfull; j++) {
+		uint32_t seed;
+		b = order[j];
+		for (seed = 1; seed < TAG_SEED_MAX; seed++) {
+			int k = 0, t, s, ok = 1;
+			for (t = first[b]; t >= 0 && ok; t = next[t]) {
+				s = _hash(db->names + db->tags[t].name, seed) % db->m;
+				if (db->slot[s] >= 0)
+					ok = 0;
+				for (i = 0; i < k && ok; i++)
+					if (taken[i] == s)
+						ok = 0;
+				taken[k++] = s;
+			}
+			if (!ok)
+				continue;
+			k = 0;
+			for (t = first[b]; t >= 0; t = next[t])
+				db->slot[taken[k++]] = t;
+			db->disp[b] = seed;
+			break;
+		}
+		if (seed == TAG_SEED_MAX)
+			goto out;
+	}
+	ret = 0;
+
+out:
+	free(count);
+	free(order);
+	free(first);
+	free(next);
+	free(taken);
+	return ret;
+}
+
+static int _build_groups(struct fx_serial *s, struct fx_tagdb *db)
+{
+	int i, g;
+
+	for (i = 0; i < db->n; i++) {
+		db->groups[db->tags[i].group].n += _words(db->tags[i].type);
+		db->groups[db->tags[i].group].ntags++;
+	}
+
+	for (g = 0; g < FX_TAG_GROUPS; g++) {
+		struct tag_group *grp = &db->groups[g];
+		if (grp->n == 0)
+			continue;
+		grp->addrs = malloc(grp->n * sizeof(struct fx_addr));
+		grp->raw = malloc(grp->n * sizeof(int));
+		grp->tags = malloc(grp->ntags * sizeof(int));
+		if (grp->addrs == NULL || grp->raw == NULL || grp->tags == NULL)
+			return -1;
+		grp->n = 0;
+		grp->ntags = 0;
+	}
+
+	for (i = 0; i < db->n; i++) {
+		struct tag *t = &db->tags[i];
+		struct tag_group *grp = &db->groups[t->group];
+		int w;
+		grp->tags[grp->ntags++] = i;
+		t->at = grp->n;
+		for (w = 0; w < _words(t->type); w++) {
+			grp->addrs[grp->n].flag = t->flag;
+			grp->addrs[grp->n].id = t->id + w;
+			grp->n++;
+		}
+	}
+
+	for (g = 0; g < FX_TAG_GROUPS; g++) {
+		struct tag_group *grp = &db->groups[g];
+		if (grp->n == 0)
+			continue;
+		grp->plan = fx_plan_create(s, grp->addrs, grp->n);
+		if (grp->plan == NULL)
+			return -1;
+	}
+	return 0;
+}
+
+struct fx_tagdb *fx_tagdb_load(struct fx_serial *s, const char *path, int *line)
+{
+	char buf[TAG_LINE_MAX];
+	struct fx_tagdb *db;
+	size_t pool = 0, pool_cap = 4096;
+	int cap = 256, ln = 0, i;
+	FILE *f;
+
+	if (line)
+		*line = 0;
+	f = fopen(path, "r");
+	if (f == NULL)
+		return NULL;
+	db = calloc(1, sizeof(*db));
+	if (db == NULL) {
+		fclose(f);
+		return NULL;
+	}
+	db->tags = malloc(cap * sizeof(struct tag));
+	db->names = malloc(pool_cap);
+	if (db->tags == NULL || db->names == NULL)
+		goto err;
+
+	while (fgets(buf, sizeof(buf), f)) {
+		struct tag t;
+		char *p = _trim(buf), *name;
+		size_t len;
+
+		ln++;
+		if (*p == 0 || *p == '#')
+			continue;
+		if (_parse_line(p, &t, &name) != 0)
+			goto bad;
+
+		if (db->n == cap) {
+			struct tag *nt = realloc(db->tags, cap * 2 * sizeof(struct tag));
+			if (nt == NULL)
+				goto err;
+			db->tags = nt;
+			cap *= 2;
+		}
+		len = strlen(name) + 1;
+		if (pool + len > pool_cap) {
+			char *np;
+			while (pool + len > pool_cap)
+				pool_cap *= 2;
+			np = realloc(db->names, pool_cap);
+			if (np == NULL)
+				goto err;
+			db->names = np;
+		}
+		memcpy(db->names + pool, name, len);
+		t.name = pool;
+		t.line = ln;
+		pool += len;
+		db->tags[db->n++] = t;
+	}
+	fclose(f);
+	f = NULL;
+	if (db->n == 0)
+		goto err;
+
+	db->value = calloc(db->n, sizeof(double));
+	db->valid = calloc(db->n, 1);
+	if (db->value == NULL || db->valid == NULL)
+		goto err;
+	i = -1;
+	if (_build_hash(db, &i) != 0) {
+		if (i >= 0 && line)
+			*line = db->tags[i].line;
+		goto err;
+	}
+	if (_build_groups(s, db) != 0)
+		goto err;
+	return db;
+
+bad:
+	if (line)
+		*line = ln;
+err:
+	if (f)
+		fclose(f);
+	fx_tagdb_free(db);
+	return NULL;
+}
+
+void fx_tagdb_free(struct fx_tagdb *db)
+{
+	int g;
+
+	if (db == NULL)
+		return;
+	for (g = 0; g < FX_TAG_GROUPS; g++) {
+		free(db->groups[g].tags);
+		free(db->groups[g].addrs);
+		free(db->groups[g].raw);
+		fx_plan_free(db->groups[g].plan);
+	}
+	free(db->tags);
+	free(db->names);
+	free(db->value);
+	free(db->valid);
+	free(db->disp);
+	free(db->slot);
+	free(db);
+}
+
+int fx_tagdb_count(const struct fx_tagdb *db)
+{
+	return db->n;
+}
+
+int fx_tag_find(const struct fx_tagdb *db, const char *name)
+{
+	uint32_t b;
+	int t;
+
+	if (db == NULL || name == NULL || db->slot == NULL)
+		return -1;
+	b = _hash(name, 0) % db->nb;
+	t = db->slot[_hash(name, db->disp[b]) % db->m];
+	if (t < 0 || strcmp(db->names + db->tags[t].name, name) != 0)
+		return -1;
+	return t;
+}
+
+const char *fx_tag_name(const struct fx_tagdb *db, int tag)
+{
+	if (tag < 0 || tag >= db->n)
+		return NULL;
+	return db->names + db->tags[tag].name;
+}
+
+int fx_tag_group(const struct fx_tagdb *db, int tag)
+{
+	if (tag < 0 || tag >= db->n)
+		return -1;
+	return db->tags[tag].group;
+}
+
+/*
+ * raw holds what fx_plan_execute() returns for the tag's addresses: the
+ * byte for X and Y, the register for D.
+ */
+static double _decode(const struct tag *t, const int *raw)
+{
+	double v = 0;
+	uint32_t u;
+	float f;
+
+	switch (t->type) {
+	case TAG_BOOL:
+		v = (raw[0] >> t->bit) & 1;
+		break;
+	case TAG_INT16:
+		v = (int16_t)raw[0];
+		break;
+	case TAG_UINT16:
+		v = raw[0] & 0xFFFF;
+		break;
+	case TAG_INT32:
+		v = (int32_t)((raw[0] & 0xFFFF) | (uint32_t)raw[1] << 16);
+		break;
+	case TAG_FLOAT:
+		u = (raw[0] & 0xFFFF) | (uint32_t)raw[1] << 16;
+		memcpy(&f, &u, sizeof(f));
+		v = f;
+		break;
+	}
+	return v * t->scale + t->offset;
+}
+
+int fx_tag_read(struct fx_serial *s, const struct fx_tagdb *db, int tag, double *v)
+{
+	const struct tag *t;
+	int raw[2], ret;
+
+	if (tag < 0 || tag >= db->n)
+		return -1;
+	t = &db->tags[tag];
+	ret = fx_register_get_block(s, t->id, _words(t->type), raw, t->flag);
+	if (ret != 0)
+		return ret;
+	// X/Y words carry the byte at id in the high half
+	if (t->flag != 2)
+		raw[0] = (raw[0] >> 8) & 0xFF;
+	*v = _decode(t, raw);
+	return 0;
+}
+
+int fx_tag_read_name(struct fx_serial *s, const struct fx_tagdb *db, const char *name, double *v)
+{
+	return fx_tag_read(s, db, fx_tag_find(db, name), v);
+}
+
+static long _round(double x)
+{
+	return x < 0 ? (long)(x - 0.5) : (long)(x + 0.5);
+}
+
+/*
+ * Bits are forced on or off by bit address (programming port commands
+ * '7' and '8'), so the other bits of the byte are left alone.
+ */
+static int _force(struct fx_serial *s, const struct tag *t, int on)
+{
+	char frame[16], resp[8];
+	int addr = ((t->flag == 0 ? 0x80 : 0xA0) + t->id) * 8 + t->bit;
+	int i, sum = 0;
+
+	// the bit address goes low byte first
+	snprintf(frame, sizeof(frame), "\x02%c%02X%02X\x03", on ? '7' : '8', addr & 0xFF, addr >> 8);
+	for (i = 1; i < 7; i++)
+		sum += frame[i];
+	snprintf(frame + 7, sizeof(frame) - 7, "%02X", sum & 0xFF);
+
+	i = fx_raw_command(s, frame, 9, resp, sizeof(resp));
+	if (i == FX_EQUEUE)
+		return FX_EQUEUE;
+	return i >= 1 && resp[0] == 0x06 ? 0 : -1;
+}
+
+int fx_tag_write(struct fx_serial *s, const struct fx_tagdb *db, int tag, double v)
+{
+	const struct tag *t;
+	double x;
+	int raw[2];
+	float f;
+	uint32_t u;
+
+	if (tag < 0 || tag >= db->n)
+		return -1;
+	t = &db->tags[tag];
+	x = (v - t->offset) / t->scale;
+
+	switch (t->type) {
+	case TAG_BOOL:
+		return _force(s, t, x != 0);
+	case TAG_INT16:
+		if (x < -32768.5 || x >= 32767.5)
+			return -1;
+		raw[0] = _round(x) & 0xFFFF;
+		break;
+	case TAG_UINT16:
+		if (x < -0.5 || x >= 65535.5)
+			return -1;
+		raw[0] = _round(x);
+		break;
+	case TAG_INT32:
+		if (x < -2147483648.5 || x >= 2147483647.5)
+			return -1;
+		u = (uint32_t)_round(x);
+		raw[0] = u & 0xFFFF;
+		raw[1] = u >> 16;
+		break;
+	case TAG_FLOAT:
+		f = x;
+		memcpy(&u, &f, sizeof(u));
+		raw[0] = u & 0xFFFF;
+		raw[1] = u >> 16;
+		break;
+	}
+	return fx_register_set_block(s, t->id, _words(t->type), raw, t->flag);
+}
+
+int fx_tag_scan(struct fx_serial *s, struct fx_tagdb *db, int group)
+{
+	struct tag_group *grp;
+	int i, ret;
+
+	if (group < 0 || group >= FX_TAG_GROUPS || db->groups[group].plan == NULL)
+		return -1;
+	grp = &db->groups[group];
+	ret = fx_plan_execute(s, grp->plan, grp->raw);
+	if (ret != 0)
+		return ret;
+
+	for (i = 0; i < grp->ntags; i++) {
+		int k = grp->tags[i];
+		db->value[k] = _decode(&db->tags[k], &grp->raw[db->tags[k].at]);
+		db->valid[k] = 1;
+	}
+	return 0;
+}
+
+int fx_tag_value(const struct fx_tagdb *db, int tag, double *v)
+{
+	if (tag < 0 || tag >= db->n || !db->valid[tag])
+		return -1;
+	*v = db->value[tag];
+	return 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FX_TAG_H_
+#define FX_TAG_H_
+
+#include "fx-serial.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Tag database
+//
+// A CSV file with one tag per line:
+//   name,device,type[,scale[,offset[,group]]]
+// device is D<decimal>, X<octal> or Y<octal> as on the PLC; type is
+// bool (X and Y only), int16, uint16, int32 or float (D only, 32 bit
+// types take two registers, low word first). Values are returned as
+// raw * scale + offset (default 1 and 0) and written back the other way.
+// group, 0..FX_TAG_GROUPS-1 (default 0), puts the tag in a scan group.
+// Empty lines and lines starting with '#' are skipped.
+//
+// Loading builds a minimal perfect hash over the names and one read
+// plan (fx-plan.h) per scan group. fx_tag_find() then costs one hash
+// and one compare; keep the handle it returns and the hot path is
+// array indexing only.
+//////////////////////////////////////////////////////////////////
+
+#define FX_TAG_GROUPS 64
+
+struct fx_tagdb;
+
+// line, if not NULL, gets the number of the first bad line (0 when the
+// file could not be read or the hash could not be built)
+struct fx_tagdb *fx_tagdb_load(struct fx_serial *ss, const char *path, int *line);
+void fx_tagdb_free(struct fx_tagdb *db);
+int fx_tagdb_count(const struct fx_tagdb *db);
+
+// handle of name, -1 if there is no such tag
+int fx_tag_find(const struct fx_tagdb *db, const char *name);
+const char *fx_tag_name(const struct fx_tagdb *db, int tag);
+int fx_tag_group(const struct fx_tagdb *db, int tag);
+
+// one tag, straight from the PLC
+int fx_tag_read(struct fx_serial *ss, const struct fx_tagdb *db, int tag, double *v);
+int fx_tag_write(struct fx_serial *ss, const struct fx_tagdb *db, int tag, double v);
+int fx_tag_read_name(struct fx_serial *ss, const struct fx_tagdb *db, const char *name, double *v);
+
+// reads every tag of group with its plan; fx_tag_value() then gives the
+// value of that scan (-1 before the first good one)
+int fx_tag_scan(struct fx_serial *ss, struct fx_tagdb *db, int group);
+int fx_tag_value(const struct fx_tagdb *db, int tag, double *v);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
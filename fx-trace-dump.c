@@ -0,0 +1,215 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// fx-trace-dump: decode the trace rings of running or dead processes
+//
+// usage: fx-trace-dump [-d dir] [-p pid] [-n last] [-c]
+//   -d  ring directory (default $FX_TRACE_DIR or /dev/shm)
+//   -p  only rings of this process
+//   -n  only print the last N records (after merging all threads)
+//   -c  remove rings left behind by processes that no longer exist
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fx-trace.h"
+
+struct dump_rec {
+	int tid;
+	const char *name;
+	struct fx_trace_rec rec;
+};
+
+static struct dump_rec *recs;
+static size_t n_recs, cap_recs;
+
+static void push(int tid, const char *name, const struct fx_trace_rec *rec)
+{
+	if (n_recs == cap_recs) {
+		cap_recs = cap_recs ? cap_recs * 2 : 4096;
+		recs = realloc(recs, cap_recs * sizeof(*recs));
+		if (recs == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	recs[n_recs].tid = tid;
+	recs[n_recs].name = name;
+	recs[n_recs].rec = *rec;
+	n_recs++;
+}
+
+/*
+ * Copies out every record that is complete and was not overwritten
+ * while we looked at it. The writer never waits for us.
+ */
+static void snapshot(const struct fx_trace_ring *r)
+{
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	uint64_t i = head > FX_TRACE_SLOTS ? head - FX_TRACE_SLOTS : 0;
+	char *name = strndup(r->name, sizeof(r->name));
+
+	for (; i < head; i++) {
+		const struct fx_trace_rec *src = &r->rec[i & (FX_TRACE_SLOTS - 1)];
+		struct fx_trace_rec copy;
+
+		if (__atomic_load_n(&src->seq, __ATOMIC_ACQUIRE) != (uint32_t)(i + 1))
+			continue;
+		memcpy(&copy, src, sizeof(copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&src->seq, __ATOMIC_RELAXED) != (uint32_t)(i + 1))
+			continue;
+		push(r->tid, name, &copy);
+	}
+}
+
+static int load_ring(const char *path)
+{
+	struct fx_trace_ring *r;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(*r)) {
+		close(fd);
+		return -1;
+	}
+
+	r = mmap(NULL, sizeof(*r), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r == MAP_FAILED)
+		return -1;
+
+	if (__atomic_load_n(&r->magic, __ATOMIC_ACQUIRE) != FX_TRACE_MAGIC ||
+			r->version != FX_TRACE_VERSION ||
+			r->slots != FX_TRACE_SLOTS ||
+			r->rec_size != sizeof(struct fx_trace_rec)) {
+		fprintf(stderr, "%s: not a compatible trace ring\n", path);
+		munmap(r, sizeof(*r));
+		return -1;
+	}
+
+	snapshot(r);
+	munmap(r, sizeof(*r));
+	return 0;
+}
+
+static int cmp_rec(const void *a, const void *b)
+{
+	const struct dump_rec *x = a, *y = b;
+
+	if (x->rec.ts < y->rec.ts) return -1;
+	if (x->rec.ts > y->rec.ts) return 1;
+	return 0;
+}
+
+static void print_rec(const struct dump_rec *d, uint64_t t0)
+{
+	uint64_t dt = d->rec.ts - t0;
+	int i;
+
+	printf("[%6llu.%06llu] %6d %-15s %-14s %6d ",
+			(unsigned long long)(dt / 1000000000ull),
+			(unsigned long long)(dt % 1000000000ull) / 1000,
+			d->tid, d->name, fx_trace_event_name(d->rec.event), d->rec.arg);
+
+	for (i = 0; i < d->rec.len && i < FX_TRACE_DATA; i++)
+		printf(" %02x", d->rec.data[i]);
+	printf("  |");
+	for (i = 0; i < d->rec.len && i < FX_TRACE_DATA; i++) {
+		unsigned char c = d->rec.data[i];
+		putchar(c >= 0x20 && c < 0x7f ? c : '.');
+	}
+	printf("|\n");
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d dir] [-p pid] [-n last] [-c]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *dir = getenv("FX_TRACE_DIR");
+	int pid = 0, clean = 0, opt;
+	size_t last = 0, i;
+	DIR *d;
+	struct dirent *de;
+
+	if (dir == NULL || dir[0] == '\0')
+		dir = "/dev/shm";
+
+	while ((opt = getopt(argc, argv, "d:p:n:c")) != -1) {
+		switch (opt) {
+		case 'd': dir = optarg; break;
+		case 'p': pid = atoi(optarg); break;
+		case 'n': last = strtoul(optarg, NULL, 10); break;
+		case 'c': clean = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+
+	d = opendir(dir);
+	if (d == NULL) {
+		fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+		return 1;
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		char path[512];
+		int fpid, ftid;
+
+		if (sscanf(de->d_name, "fx-trace.%d.%d", &fpid, &ftid) != 2)
+			continue;
+		if (pid && fpid != pid)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if (clean) {
+			if (kill(fpid, 0) != 0 && errno == ESRCH)
+				unlink(path);
+			continue;
+		}
+		load_ring(path);
+	}
+	closedir(d);
+
+	if (clean || n_recs == 0)
+		return 0;
+
+	qsort(recs, n_recs, sizeof(*recs), cmp_rec);
+
+	i = (last && last < n_recs) ? n_recs - last : 0;
+	for (; i < n_recs; i++)
+		print_rec(&recs[i], recs[0].rec.ts);
+
+	return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "fx-trace.h"
+
+static const char *event_names[FX_EV_MAX] = {
+	[FX_EV_NONE]           = "NONE",
+	[FX_EV_OPEN_FAIL]      = "OPEN_FAIL",
+	[FX_EV_FRAME_SENT]     = "FRAME_SENT",
+	[FX_EV_BYTES_RECV]     = "BYTES_RECV",
+	[FX_EV_RESPONSE]       = "RESPONSE",
+	[FX_EV_TIMEOUT]        = "TIMEOUT",
+	[FX_EV_CHECKSUM_ERR]   = "CHECKSUM_ERR",
+	[FX_EV_IO_ERR]         = "IO_ERR",
+	[FX_EV_CMD_ERR]        = "CMD_ERR",
+	[FX_EV_CALLER_TIMEOUT] = "CALLER_TIMEOUT",
+	[FX_EV_LINK_DOWN]      = "LINK_DOWN",
+	[FX_EV_LINK_UP]        = "LINK_UP",
+};
+
+const char *fx_trace_event_name(int event)
+{
+	if (event < 0 || event >= FX_EV_MAX || event_names[event] == NULL)
+		return "UNKNOWN";
+	return event_names[event];
+}
+
+// Ring ownership
+//////////////////////////////////////////////////////////////////
+static __thread struct fx_trace_ring *tls_ring;
+static __thread int tls_ring_failed;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+struct ring_owner {
+	struct fx_trace_ring *ring;
+	int mapped;
+	char path[128];
+};
+
+/*
+ * Runs at thread exit. A crashed process never gets here, so its rings
+ * stay behind for post-mortem dumps.
+ */
+static void ring_release(void *arg)
+{
+	struct ring_owner *o = arg;
+
+	if (o->mapped) {
+		munmap(o->ring, sizeof(struct fx_trace_ring));
+		unlink(o->path);
+	} else {
+		free(o->ring);
+	}
+	free(o);
+}
+
+static void ring_key_init(void)
+{
+	pthread_key_create(&ring_key, ring_release);
+}
+
+static struct fx_trace_ring *ring_map(struct ring_owner *o, pid_t pid, pid_t tid)
+{
+	const char *dir = getenv("FX_TRACE_DIR");
+	struct fx_trace_ring *r;
+	int fd;
+
+	if (dir == NULL)
+		dir = "/dev/shm";
+	if (dir[0] == '\0')
+		return NULL;
+
+	snprintf(o->path, sizeof(o->path), "%s/fx-trace.%d.%d", dir, (int)pid, (int)tid);
+	fd = open(o->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return NULL;
+	if (ftruncate(fd, sizeof(struct fx_trace_ring)) != 0) {
+		close(fd);
+		unlink(o->path);
+		return NULL;
+	}
+
+	r = mmap(NULL, sizeof(struct fx_trace_ring), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	close(fd);
+	if (r == MAP_FAILED) {
+		unlink(o->path);
+		return NULL;
+	}
+
+	return r;
+}
+
+static struct fx_trace_ring *ring_create(void)
+{
+	struct ring_owner *o;
+	struct fx_trace_ring *r;
+	pid_t pid = getpid();
+	pid_t tid = (pid_t)syscall(SYS_gettid);
+
+	pthread_once(&ring_once, ring_key_init);
+
+	o = calloc(1, sizeof(*o));
+	if (o == NULL)
+		return NULL;
+
+	r = ring_map(o, pid, tid);
+	if (r != NULL) {
+		o->mapped = 1;
+	} else {
+		r = calloc(1, sizeof(*r));
+		if (r == NULL) {
+			free(o);
+			return NULL;
+		}
+	}
+
+	r->version = FX_TRACE_VERSION;
+	r->pid = pid;
+	r->tid = tid;
+	r->slots = FX_TRACE_SLOTS;
+	r->rec_size = sizeof(struct fx_trace_rec);
+	r->head = 0;
+	pthread_getname_np(pthread_self(), r->name, sizeof(r->name));
+	// magic last: a reader ignores the file until the header is complete
+	__atomic_store_n(&r->magic, FX_TRACE_MAGIC, __ATOMIC_RELEASE);
+
+	o->ring = r;
+	pthread_setspecific(ring_key, o);
+
+	return r;
+}
+
+// Recording
+//////////////////////////////////////////////////////////////////
+void fx_trace(int event, int arg, const void *data, int len)
+{
+	struct fx_trace_ring *r = tls_ring;
+	struct fx_trace_rec *rec;
+	struct timespec ts;
+	uint64_t i;
+
+	if (r == NULL) {
+		if (tls_ring_failed)
+			return;
+		r = tls_ring = ring_create();
+		if (r == NULL) {
+			tls_ring_failed = 1;
+			return;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	i = r->head;
+	rec = &r->rec[i & (FX_TRACE_SLOTS - 1)];
+
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	rec->ts = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	rec->event = event;
+	rec->arg = arg;
+	if (len < 0 || data == NULL)
+		len = 0;
+	if (len > FX_TRACE_DATA)
+		len = FX_TRACE_DATA;
+	rec->len = len;
+	if (len > 0)
+		memcpy(rec->data, data, len);
+
+	__atomic_store_n(&rec->seq, (uint32_t)(i + 1), __ATOMIC_RELEASE);
+	__atomic_store_n(&r->head, i + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,91 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FX_TRACE_H_
+#define FX_TRACE_H_
+
+#include <stdint.h>
+
+// Binary trace ring
+//
+// Every thread that records an event gets its own ring of fixed size
+// records. The owning thread is the only writer, so recording is a
+// clock read, a memcpy and two stores: no lock, no syscall, no stdio.
+//
+// Rings are mmap()ed from $FX_TRACE_DIR (default /dev/shm) as
+// fx-trace.<pid>.<tid>, so fx-trace-dump can decode them from outside
+// while the process is running, or after it crashed. When the directory
+// is not writable (or FX_TRACE_DIR is empty) the ring stays in process
+// memory. Build with -DFX_NO_TRACE to compile tracing out entirely.
+//////////////////////////////////////////////////////////////////
+
+#define FX_TRACE_MAGIC   0x52545846	/* "FXTR" */
+#define FX_TRACE_VERSION 1
+#define FX_TRACE_SLOTS   4096		/* records per thread, power of two */
+#define FX_TRACE_DATA    12		/* bytes of payload kept per record */
+
+enum fx_trace_event {
+	FX_EV_NONE = 0,
+	FX_EV_OPEN_FAIL,	/* arg = errno */
+	FX_EV_FRAME_SENT,	/* arg = frame size, data = frame head */
+	FX_EV_BYTES_RECV,	/* arg = bytes returned by one read() */
+	FX_EV_RESPONSE,		/* arg = response size, data = response head */
+	FX_EV_TIMEOUT,		/* arg = bytes still expected */
+	FX_EV_CHECKSUM_ERR,	/* arg = received sum, data = response head */
+	FX_EV_IO_ERR,		/* arg = errno */
+	FX_EV_CMD_ERR,		/* arg = frame size, data = frame head */
+	FX_EV_CALLER_TIMEOUT,	/* arg = frame size, data = frame head */
+	FX_EV_LINK_DOWN,	/* arg = errno, data = device */
+	FX_EV_LINK_UP,		/* arg = ms the link was down, data = device */
+	FX_EV_MAX
+};
+
+struct fx_trace_rec {
+	uint64_t ts;		/* CLOCK_MONOTONIC, ns */
+	uint32_t seq;		/* index + 1, stored last; 0 while being written */
+	uint16_t event;
+	uint16_t len;		/* valid bytes in data */
+	int32_t arg;
+	uint8_t data[FX_TRACE_DATA];
+};
+
+struct fx_trace_ring {
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;
+	int32_t tid;
+	uint32_t slots;
+	uint32_t rec_size;
+	uint64_t head;		/* index of the next record to write */
+	char name[16];		/* thread name at ring creation */
+	struct fx_trace_rec rec[FX_TRACE_SLOTS];
+};
+
+#if defined(FX_NO_TRACE)
+#define TRACE(ev, arg, data, len) do { } while (0)
+#else
+#define TRACE(ev, arg, data, len) fx_trace((ev), (arg), (data), (len))
+#endif
+
+void fx_trace(int event, int arg, const void *data, int len);
+const char *fx_trace_event_name(int event);
+
+#endif
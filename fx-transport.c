@@ -0,0 +1,834 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/serial.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include "fx-transport.h"
+
+#define CONNECT_TIMEOUT 3000	/* ms */
+
+// tty
+//////////////////////////////////////////////////////////////////
+static int tty_open(struct fx_transport *t, const char *addr)
+{
+	t->fd = open(addr, O_RDWR | O_NOCTTY | O_NDELAY);
+	return t->fd < 0 ? -1 : 0;
+}
+
+static tcflag_t parse_baudrate(int requested)
+{
+  int baudrate;
+
+  switch (requested)
+    {
+#ifdef B50
+    case 50: baudrate = B50; break;
+#endif
+#ifdef B75
+    case 75: baudrate = B75; break;
+#endif
+#ifdef B110
+    case 110: baudrate = B110; break;
+#endif
+#ifdef B134
+    case 134: baudrate = B134; break;
+#endif
+#ifdef B150
+    case 150: baudrate = B150; break;
+#endif
+#ifdef B200
+    case 200: baudrate = B200; break;
+#endif
+#ifdef B300
+    case 300: baudrate = B300; break;
+#endif
+#ifdef B600
+    case 600: baudrate = B600; break;
+#endif
+#ifdef B1200
+    case 1200: baudrate = B1200; break;
+#endif
+#ifdef B1800
+    case 1800: baudrate = B1800; break;
+#endif
+#ifdef B2400
+    case 2400: baudrate = B2400; break;
+#endif
+#ifdef B4800
+    case 4800: baudrate = B4800; break;
+#endif
+#ifdef B9600
+    case 9600: baudrate = B9600; break;
+#endif
+#ifdef B19200
+    case 19200: baudrate = B19200; break;
+#endif
+#ifdef B38400
+    case 38400: baudrate = B38400; break;
+#endif
+#ifdef B57600
+    case 57600: baudrate = B57600; break;
+#endif
+#ifdef B115200
+    case 115200: baudrate = B115200; break;
+#endif
+#ifdef B230400
+    case 230400: baudrate = B230400; break;
+#endif
+#ifdef B460800
+    case 460800: baudrate = B460800; break;
+#endif
+#ifdef B500000
+    case 500000: baudrate = B500000; break;
+#endif
+#ifdef B576000
+    case 576000: baudrate = B576000; break;
+#endif
+#ifdef B921600
+    case 921600: baudrate = B921600; break;
+#endif
+#ifdef B1000000
+    case 1000000: baudrate = B1000000; break;
+#endif
+#ifdef B1152000
+    case 1152000: baudrate = B1152000; break;
+#endif
+#ifdef B1500000
+    case 1500000: baudrate = B1500000; break;
+#endif
+#ifdef B2000000
+    case 2000000: baudrate = B2000000; break;
+#endif
+#ifdef B2500000
+    case 2500000: baudrate = B2500000; break;
+#endif
+#ifdef B3000000
+    case 3000000: baudrate = B3000000; break;
+#endif
+#ifdef B3500000
+    case 3500000: baudrate = B3500000; break;
+#endif
+#ifdef B4000000
+    case 4000000: baudrate = B4000000; break;
+#endif
+    default:
+      baudrate = 0;
+    }
+  return baudrate;
+}
+
+static int tty_setup(struct fx_transport *t, int baude, char bits, char parity, char stop)
+{
+	int fd = t->fd;
+
+	struct termios options;
+	if (tcgetattr(fd, &options) != 0) {
+		return -1;
+	}
+
+	bzero(&options, sizeof(struct termios));
+	tcflag_t baudflag = parse_baudrate(baude);
+	if (!baudflag)
+    return -1;
+
+	cfsetispeed(&options, baudflag);
+	cfsetospeed(&options, baudflag);
+
+	options.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);	/*Input */
+	options.c_oflag &= ~OPOST;	/*Output */
+
+	options.c_cflag |= CLOCAL;
+	options.c_cflag |= CREAD;
+
+	switch (parity) {
+	case 'N':
+	case 'n':
+	case 'S':
+	case 's':
+		options.c_cflag &= ~PARENB;
+		break;
+	case 'E':
+	case 'e':
+		options.c_cflag |= PARENB;
+		options.c_cflag &= ~PARODD;
+		break;
+	case 'O':
+	case 'o':
+		options.c_cflag |= PARENB;
+		options.c_cflag |= PARODD;
+		break;
+	default:
+		return -1;
+	}
+
+	if (options.c_cflag & PARENB) {
+		// Enable Parity
+		options.c_iflag |= (INPCK | ISTRIP);
+	}
+
+	switch (stop) {
+	case '1':
+		options.c_cflag &= ~CSTOPB;
+		break;
+	default:
+		return -1;
+	}
+
+
+	switch (bits) {
+	case '7':
+		options.c_cflag &= ~CSIZE;
+		options.c_cflag |= CS7;
+		break;
+	case '8':
+		options.c_cflag &= ~CSIZE;
+		options.c_cflag |= CS8;
+		break;
+	default:
+		return -1;
+	}
+
+	options.c_cc[VTIME] = 0;	/* 设置超时15 seconds */
+	options.c_cc[VMIN] = 1;	/* define the minimum bytes data to be readed */
+	tcflush(fd, TCIFLUSH);
+
+	// set Attr
+	if (tcsetattr(fd, TCSANOW, &options) != 0) {
+		return -1;
+	}
+	// keep what the driver made of it, the request may not set again
+	if (tcgetattr(fd, &t->tio) != 0)
+		return -1;
+	t->vmin = 1;
+	if (t->framing)
+		return t->ops->framing(t, 1);
+
+	return 0;
+}
+
+/*
+ * Framing mode: the fd blocks and VMIN is the size of the answer, so
+ * after poll() reports the first byte one read() returns the whole
+ * answer. VTIME ends the read early when the line goes quiet for a
+ * tenth of a second, which is how a short NAK still gets through.
+ * The driver is asked for low latency (FTDI and 8250 flush their
+ * receive buffer at once instead of on a timer); not all support it.
+ */
+static int tty_framing(struct fx_transport *t, int on)
+{
+	struct serial_struct ser;
+	int fl = fcntl(t->fd, F_GETFL);
+
+	if (fl < 0 || fcntl(t->fd, F_SETFL, on ? fl & ~O_NONBLOCK : fl | O_NONBLOCK) < 0)
+		return -1;
+
+	t->tio.c_cc[VTIME] = on ? 1 : 0;
+	t->tio.c_cc[VMIN] = 1;
+	if (tcsetattr(t->fd, TCSANOW, &t->tio) != 0)
+		return -1;
+	t->vmin = 1;
+	t->framing = on;
+
+	if (ioctl(t->fd, TIOCGSERIAL, &ser) == 0) {
+		if (on)
+			ser.flags |= ASYNC_LOW_LATENCY;
+		else
+			ser.flags &= ~ASYNC_LOW_LATENCY;
+		ioctl(t->fd, TIOCSSERIAL, &ser);
+	}
+
+	return 0;
+}
+
+static int tty_expect(struct fx_transport *t, int n)
+{
+	if (n < 1)
+		n = 1;
+	if (n > 255)
+		n = 255;
+	// polling repeats the same requests, most calls change nothing
+	if (n == t->vmin)
+		return 0;
+
+	t->tio.c_cc[VMIN] = n;
+	if (tcsetattr(t->fd, TCSANOW, &t->tio) != 0)
+		return -1;
+	t->vmin = n;
+
+	return 0;
+}
+
+
+static ssize_t fd_read(struct fx_transport *t, void *buf, size_t n)
+{
+	return read(t->fd, buf, n);
+}
+
+static ssize_t fd_writev(struct fx_transport *t, const struct iovec *iov, int cnt)
+{
+	return writev(t->fd, iov, cnt);
+}
+
+static void fd_close(struct fx_transport *t)
+{
+	if (t->fd >= 0)
+		close(t->fd);
+	t->fd = -1;
+}
+
+static const struct fx_transport_ops tty_ops = {
+	.name = "tty",
+	.default_timeout = 5000,
+	.open = tty_open,
+	.setup = tty_setup,
+	.read = fd_read,
+	.writev = fd_writev,
+	.close = fd_close,
+	.framing = tty_framing,
+	.expect = tty_expect,
+};
+
+// sockets
+//////////////////////////////////////////////////////////////////
+static int _connect(int fd, const struct sockaddr *sa, socklen_t len)
+{
+	struct pollfd pfd;
+	int err = 0;
+	socklen_t elen = sizeof(err);
+
+	if (connect(fd, sa, len) == 0)
+		return 0;
+	if (errno != EINPROGRESS)
+		return -1;
+
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	if (poll(&pfd, 1, CONNECT_TIMEOUT) != 1) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &elen) != 0 || err != 0) {
+		errno = err ? err : errno;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int tcp_open(struct fx_transport *t, const char *addr)
+{
+	struct addrinfo hints, *res, *ai;
+	char host[256];
+	const char *port = strrchr(addr, ':');
+	int one = 1;
+
+	if (port == NULL || port == addr || (size_t)(port - addr) >= sizeof(host)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(host, addr, port - addr);
+	host[port - addr] = '\0';
+	port++;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res) != 0) {
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+
+	t->fd = -1;
+	for (ai = res; ai; ai = ai->ai_next) {
+		t->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+				ai->ai_protocol);
+		if (t->fd < 0)
+			continue;
+		if (_connect(t->fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(t->fd);
+		t->fd = -1;
+	}
+	freeaddrinfo(res);
+	if (t->fd < 0)
+		return -1;
+
+	// frames are small and latency bound
+	setsockopt(t->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(t->fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+
+	return 0;
+}
+
+static int unix_open(struct fx_transport *t, const char *addr)
+{
+	struct sockaddr_un sun;
+
+	if (strlen(addr) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, addr);
+
+	t->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (t->fd < 0)
+		return -1;
+	if (_connect(t->fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+		close(t->fd);
+		t->fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+// the line parameters belong to whoever owns the far end
+static int sock_setup(struct fx_transport *t, int baude, char bits, char parity, char stop)
+{
+	(void)t;
+	(void)baude;
+	(void)bits;
+	(void)parity;
+	(void)stop;
+	return 0;
+}
+
+// a peer that went away is an error to the caller, not SIGPIPE to the
+// process (requests are written on the callers' threads too)
+static ssize_t sock_writev(struct fx_transport *t, const struct iovec *iov, int cnt)
+{
+	struct msghdr m;
+
+	memset(&m, 0, sizeof(m));
+	m.msg_iov = (struct iovec *)iov;
+	m.msg_iovlen = cnt;
+	return sendmsg(t->fd, &m, MSG_NOSIGNAL);
+}
+
+static const struct fx_transport_ops tcp_ops = {
+	.name = "tcp",
+	.default_timeout = 5000,
+	.open = tcp_open,
+	.setup = sock_setup,
+	.read = fd_read,
+	.writev = sock_writev,
+	.close = fd_close,
+};
+
+static const struct fx_transport_ops unix_ops = {
+	.name = "unix",
+	.default_timeout = 5000,
+	.open = unix_open,
+	.setup = sock_setup,
+	.read = fd_read,
+	.writev = sock_writev,
+	.close = fd_close,
+};
+
+// rfc2217: telnet with COM-PORT-OPTION
+//////////////////////////////////////////////////////////////////
+#define TN_IAC  255
+#define TN_DONT 254
+#define TN_DO   253
+#define TN_WONT 252
+#define TN_WILL 251
+#define TN_SB   250
+#define TN_SE   240
+#define TN_BINARY 0
+#define TN_SGA    3
+#define TN_COMPORT 44
+
+#define CPO_SET_BAUDRATE 1
+#define CPO_SET_DATASIZE 2
+#define CPO_SET_PARITY   3
+#define CPO_SET_STOPSIZE 4
+#define CPO_SET_CONTROL  5
+
+enum { TN_DATA, TN_CMD, TN_OPT_WILL, TN_OPT_WONT, TN_OPT_DO, TN_OPT_DONT, TN_SUB, TN_SUB_IAC };
+
+static int _writev_full(struct fx_transport *t, struct iovec *iov, int cnt)
+{
+	while (cnt > 0) {
+		ssize_t n = sock_writev(t, iov, cnt);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN) {
+			struct pollfd pfd = { t->fd, POLLOUT, 0 };
+			if (poll(&pfd, 1, t->timeout) <= 0)
+				return -1;
+			continue;
+		}
+		if (n <= 0)
+			return -1;
+
+		while (cnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+// telnet commands go out as they are, not escaped as data
+static int tn_send(struct fx_transport *t, const unsigned char *buf, int n)
+{
+	struct iovec iov = { (void *)buf, n };
+	return _writev_full(t, &iov, 1);
+}
+
+static int tn_option(struct fx_transport *t, int cmd, int opt)
+{
+	unsigned char buf[3] = { TN_IAC, cmd, opt };
+	return tn_send(t, buf, 3);
+}
+
+static int tn_subneg(struct fx_transport *t, int code, const unsigned char *val, int n)
+{
+	unsigned char buf[32];
+	int i, k = 0;
+
+	buf[k++] = TN_IAC;
+	buf[k++] = TN_SB;
+	buf[k++] = TN_COMPORT;
+	buf[k++] = code;
+	for (i = 0; i < n; i++) {
+		buf[k++] = val[i];
+		if (val[i] == TN_IAC)
+			buf[k++] = TN_IAC;
+	}
+	buf[k++] = TN_IAC;
+	buf[k++] = TN_SE;
+
+	return tn_send(t, buf, k);
+}
+
+static int rfc2217_open(struct fx_transport *t, const char *addr)
+{
+	if (tcp_open(t, addr) != 0)
+		return -1;
+
+	t->tn_state = TN_DATA;
+	if (tn_option(t, TN_WILL, TN_COMPORT) != 0 ||
+			tn_option(t, TN_WILL, TN_BINARY) != 0 ||
+			tn_option(t, TN_DO, TN_BINARY) != 0 ||
+			tn_option(t, TN_DO, TN_SGA) != 0) {
+		fd_close(t);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int rfc2217_setup(struct fx_transport *t, int baude, char bits, char parity, char stop)
+{
+	unsigned char v[4];
+
+	v[0] = baude >> 24; v[1] = baude >> 16; v[2] = baude >> 8; v[3] = baude;
+	if (tn_subneg(t, CPO_SET_BAUDRATE, v, 4) != 0)
+		return -1;
+
+	switch (bits) {
+	case '7': v[0] = 7; break;
+	case '8': v[0] = 8; break;
+	default: return -1;
+	}
+	if (tn_subneg(t, CPO_SET_DATASIZE, v, 1) != 0)
+		return -1;
+
+	switch (parity) {
+	case 'N': case 'n': v[0] = 1; break;
+	case 'O': case 'o': v[0] = 2; break;
+	case 'E': case 'e': v[0] = 3; break;
+	case 'S': case 's': v[0] = 5; break;
+	default: return -1;
+	}
+	if (tn_subneg(t, CPO_SET_PARITY, v, 1) != 0)
+		return -1;
+
+	if (stop != '1')
+		return -1;
+	v[0] = 1;
+	if (tn_subneg(t, CPO_SET_STOPSIZE, v, 1) != 0)
+		return -1;
+
+	v[0] = 1;	/* no flow control */
+	return tn_subneg(t, CPO_SET_CONTROL, v, 1);
+}
+
+/*
+ * Strips telnet commands in place. Option requests we do not know are
+ * refused; server notifications and COM-PORT replies are dropped.
+ */
+static ssize_t rfc2217_read(struct fx_transport *t, void *buf, size_t n)
+{
+	unsigned char *p = buf;
+	ssize_t cnt = read(t->fd, buf, n);
+	ssize_t i, k = 0;
+
+	if (cnt <= 0)
+		return cnt;
+
+	for (i = 0; i < cnt; i++) {
+		unsigned char c = p[i];
+
+		switch (t->tn_state) {
+		case TN_DATA:
+			if (c == TN_IAC)
+				t->tn_state = TN_CMD;
+			else
+				p[k++] = c;
+			break;
+		case TN_CMD:
+			switch (c) {
+			case TN_IAC:  p[k++] = c; t->tn_state = TN_DATA; break;
+			case TN_WILL: t->tn_state = TN_OPT_WILL; break;
+			case TN_WONT: t->tn_state = TN_OPT_WONT; break;
+			case TN_DO:   t->tn_state = TN_OPT_DO; break;
+			case TN_DONT: t->tn_state = TN_OPT_DONT; break;
+			case TN_SB:   t->tn_state = TN_SUB; break;
+			default:      t->tn_state = TN_DATA; break;
+			}
+			break;
+		case TN_OPT_WILL:
+			if (c != TN_BINARY && c != TN_SGA && c != TN_COMPORT)
+				tn_option(t, TN_DONT, c);
+			t->tn_state = TN_DATA;
+			break;
+		case TN_OPT_DO:
+			if (c != TN_BINARY && c != TN_COMPORT)
+				tn_option(t, TN_WONT, c);
+			t->tn_state = TN_DATA;
+			break;
+		case TN_OPT_WONT:
+		case TN_OPT_DONT:
+			t->tn_state = TN_DATA;
+			break;
+		case TN_SUB:
+			if (c == TN_IAC)
+				t->tn_state = TN_SUB_IAC;
+			break;
+		case TN_SUB_IAC:
+			t->tn_state = c == TN_SE ? TN_DATA : TN_SUB;
+			break;
+		}
+	}
+
+	if (k == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return k;
+}
+
+/*
+ * Data bytes equal to IAC go out doubled, by pointing an extra iovec at
+ * a constant IAC instead of copying the data. The frames we send are 7
+ * bit ASCII so normally this is one iovec per input iovec.
+ */
+static ssize_t rfc2217_writev(struct fx_transport *t, const struct iovec *iov, int cnt)
+{
+	static unsigned char iac = TN_IAC;
+	struct iovec out[64];
+	ssize_t total = 0;
+	int i, k = 0;
+
+	for (i = 0; i < cnt; i++) {
+		unsigned char *p = iov[i].iov_base;
+		size_t len = iov[i].iov_len, start = 0, j;
+
+		for (j = 0; j < len; j++) {
+			if (p[j] != TN_IAC)
+				continue;
+			if (k + 3 > 64)
+				goto too_big;
+			out[k].iov_base = p + start;
+			out[k].iov_len = j + 1 - start;
+			k++;
+			out[k].iov_base = &iac;
+			out[k].iov_len = 1;
+			k++;
+			start = j + 1;
+		}
+		if (k + 1 > 64)
+			goto too_big;
+		out[k].iov_base = p + start;
+		out[k].iov_len = len - start;
+		k++;
+		total += len;
+	}
+
+	// all or nothing: a partial write cannot be mapped back to iov
+	if (_writev_full(t, out, k) != 0)
+		return -1;
+	return total;
+
+too_big:
+	errno = EMSGSIZE;
+	return -1;
+}
+
+static const struct fx_transport_ops rfc2217_ops = {
+	.name = "rfc2217",
+	.default_timeout = 5000,
+	.open = rfc2217_open,
+	.setup = rfc2217_setup,
+	.read = rfc2217_read,
+	.writev = rfc2217_writev,
+	.close = fd_close,
+};
+
+// common
+//////////////////////////////////////////////////////////////////
+struct fx_transport *fx_transport_open(const char *device)
+{
+	static const struct {
+		const char *prefix;
+		const struct fx_transport_ops *ops;
+	} backends[] = {
+		{ "tcp:",     &tcp_ops },
+		{ "rfc2217:", &rfc2217_ops },
+		{ "unix:",    &unix_ops },
+	};
+	const struct fx_transport_ops *ops = &tty_ops;
+	const char *addr = device;
+	struct fx_transport *t;
+	size_t i;
+
+	for (i = 0; i < sizeof(backends)/sizeof(backends[0]); i++) {
+		size_t n = strlen(backends[i].prefix);
+		if (strncmp(device, backends[i].prefix, n) == 0) {
+			ops = backends[i].ops;
+			addr = device + n;
+			break;
+		}
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return NULL;
+
+	t->ops = ops;
+	t->fd = -1;
+	t->timeout = ops->default_timeout;
+	t->addr = strdup(addr);
+	if (t->addr == NULL || ops->open(t, addr) != 0) {
+		int err = errno;
+		free(t->addr);
+		free(t);
+		errno = err;
+		return NULL;
+	}
+
+	return t;
+}
+
+int fx_transport_reopen(struct fx_transport *t)
+{
+	t->ops->close(t);
+	t->vmin = 1;
+	return t->ops->open(t, t->addr);
+}
+
+void fx_transport_close(struct fx_transport *t)
+{
+	t->ops->close(t);
+	free(t->addr);
+	free(t);
+}
+
+/*
+ * Waits until the transport has something to read. Returns 1 when
+ * readable, 0 on timeout, -1 on error.
+ */
+int fx_transport_wait(struct fx_transport *t, int timeout)
+{
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = t->fd;
+	pfd.events = POLLIN;
+	do {
+		ret = poll(&pfd, 1, timeout);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret > 0 && (pfd.revents & (POLLERR | POLLNVAL)))
+		return -1;
+	return ret;
+}
+
+/*
+ * Writes all iovecs, resuming after partial writes. Returns the number
+ * of bytes written or -1.
+ */
+int fx_transport_writev(struct fx_transport *t, struct iovec *iov, int cnt)
+{
+	int actual = 0;
+
+	while (cnt > 0) {
+		ssize_t n = t->ops->writev(t, iov, cnt);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN) {
+			struct pollfd pfd = { t->fd, POLLOUT, 0 };
+			if (poll(&pfd, 1, t->timeout) <= 0)
+				return -1;
+			continue;
+		}
+		if (n <= 0)
+			return -1;
+
+		actual += n;
+		while (cnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return actual;
+}
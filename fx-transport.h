@@ -0,0 +1,98 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FX_TRANSPORT_H_
+#define FX_TRANSPORT_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <termios.h>
+
+// Transport layer
+//
+// The device string given to fx_serial_start() picks the backend:
+//   /dev/ttyUSB0          local tty, line set up with termios
+//   tcp:host:port         raw TCP serial device server
+//   rfc2217:host:port     telnet COM-PORT-OPTION server, line set up remotely
+//   unix:/path            Unix stream socket
+//////////////////////////////////////////////////////////////////
+
+struct fx_transport;
+
+struct fx_transport_ops {
+	const char *name;
+	int default_timeout;	/* ms to wait for a response */
+	int (*open)(struct fx_transport *t, const char *addr);
+	int (*setup)(struct fx_transport *t, int baude, char bits, char parity, char stop);
+	// returns bytes, 0 at end of stream, -1 with errno (EAGAIN: nothing for us)
+	ssize_t (*read)(struct fx_transport *t, void *buf, size_t n);
+	ssize_t (*writev)(struct fx_transport *t, const struct iovec *iov, int cnt);
+	void (*close)(struct fx_transport *t);
+	// optional: deliver each answer in one read, see fx_serial_set_framing()
+	int (*framing)(struct fx_transport *t, int on);
+	int (*expect)(struct fx_transport *t, int n);
+};
+
+struct fx_transport {
+	const struct fx_transport_ops *ops;
+	char *addr;		/* device without the backend prefix */
+	int fd;
+	int timeout;		/* ms to wait for a response */
+
+	// rfc2217: telnet receive state
+	int tn_state;
+
+	// tty: line settings as set, VMIN of the answer expected
+	struct termios tio;
+	int framing;
+	int vmin;
+};
+
+struct fx_transport *fx_transport_open(const char *device);
+void fx_transport_close(struct fx_transport *t);
+// closes and opens the same device again; settings must be set again
+int fx_transport_reopen(struct fx_transport *t);
+
+int fx_transport_wait(struct fx_transport *t, int timeout);
+int fx_transport_writev(struct fx_transport *t, struct iovec *iov, int cnt);
+
+static inline int fx_transport_setup(struct fx_transport *t, int baude, char bits, char parity, char stop)
+{
+	return t->ops->setup(t, baude, bits, parity, stop);
+}
+
+static inline int fx_transport_framing(struct fx_transport *t, int on)
+{
+	return t->ops->framing ? t->ops->framing(t, on) : -1;
+}
+
+// size of the next answer, call before sending the request
+static inline int fx_transport_expect(struct fx_transport *t, int n)
+{
+	return t->ops->expect && t->framing ? t->ops->expect(t, n) : 0;
+}
+
+static inline ssize_t fx_transport_read(struct fx_transport *t, void *buf, size_t n)
+{
+	return t->ops->read(t, buf, n);
+}
+
+#endif
@@ -4,95 +4,40 @@
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "fx-serial.h"
+#include "fx-bits.h"
 void* read_print_input(void *a)
 {
 	struct fx_serial *ss=(struct fx_serial *)a;
-	unsigned int X0=0,X1=0,X2=0,X3=0,i=0;
-	unsigned int x0[8]={0},x1[8]={0},x2[8]={0},x3[8]={0};
-	read_x0(ss,&X0);
-	X0=(X0>>8)&0XFF;
-	printf("input is :0X%X\n", X0);
-	for(i=0;i<8;i++)
+	uint64_t X[FX_BITS_WORDS(32)];
+	uint8_t x[32];
+	int i;
+	// X0..X37 in one frame
+	if(fx_bits_get(ss,0,0,32,X)!=0)
+		return NULL;
+	fx_bits_unpack(X,32,x);
+	for(i=0;i<32;i++)
 	{
-		x0[i]=(X0>>i)&1;
-		printf("x0[%d]=%d\n",i,x0[i]);
-	}
-
-
-	read_x1(ss,&X1);
-	X1=(X1>>8)&0XFF;
-	printf("input is :0X%X\n", X1);
-	for(i=0;i<8;i++)
-	{
-		x1[i]=(X1>>i)&1;
-		printf("x1[%d]=%d\n",i,x1[i]);
-	}
-
-	read_x2(ss,&X2);
-	X2=(X2>>8)&0XFF;
-	printf("input is :0X%X\n", X2);
-	for(i=0;i<8;i++)
-	{
-		x2[i]=(X2>>i)&1;
-		printf("x2[%d]=%d\n",i,x2[i]);
-	}
-
-
-	read_x3(ss,&X3);
-	X3=(X3>>8)&0XFF;
-	printf("input is :0X%X\n", X3);
-	for(i=0;i<8;i++)
-	{
-		x3[i]=(X3>>i)&1;
-		printf("x3[%d]=%d\n",i,x3[i]);
+		if(i%8==0)
+			printf("input is :0X%X\n", (unsigned int)(X[0]>>i)&0XFF);
+		printf("x%d[%d]=%d\n",i/8,i%8,x[i]);
 	}
+	return NULL;
 }
 
 void* read_print_output(void *b)
 {
 	struct fx_serial *ss=(struct fx_serial *)b;
-// void read_print_output(struct fx_serial *ss)
-// {
-	unsigned int Y0=0,Y1=0,Y2=0,Y3=0,i=0;
-	unsigned int y0[8]={0},y1[8]={0},y2[8]={0},y3[8]={0};
-	read_y0(ss,&Y0);
-	Y0=(Y0>>8)&0XFF;
-	printf("output is :0X%X\n", Y0);
-	for(i=0;i<8;i++)
-	{
-		y0[i]=(Y0>>i)&1;
-		printf("y0[%d]=%d\n",i,y0[i]);
-	}
-
-
-	read_y1(ss,&Y1);
-	Y1=(Y1>>8)&0XFF;
-	printf("output is :0X%X\n", Y1);
-	for(i=0;i<8;i++)
-	{
-		y1[i]=(Y1>>i)&1;
-		printf("y1[%d]=%d\n",i,y1[i]);
-	}
-
-	read_y2(ss,&Y2);
-	Y2=(Y2>>8)&0XFF;
-	printf("output is :0X%X\n", Y2);
-	for(i=0;i<8;i++)
-	{
-		y2[i]=(Y2>>i)&1;
-		printf("y2[%d]=%d\n",i,y2[i]);
-	}
-
-
-	read_y3(ss,&Y3);
-	Y3=(Y3>>8)&0XFF;
-	printf("output is :0X%X\n", Y3);
-	for(i=0;i<8;i++)
-	{
-		y3[i]=(Y3>>i)&1;
-		printf("y3[%d]=%d\n",i,y3[i]);
-	}
+	uint64_t Y[FX_BITS_WORDS(32)];
+	int i;
+	if(fx_bits_get(ss,1,0,32,Y)!=0)
+		return NULL;
+	printf("output is :0X%X\n", (unsigned int)Y[0]);
+	// only the outputs that are on
+	for(i=fx_bits_next(Y,32,0);i>=0;i=fx_bits_next(Y,32,i+1))
+		printf("Y%o on\n",i);
+	return NULL;
 }
 typedef struct
 {
@@ -120,6 +65,10 @@ int main(int argc, char *argv[])
 	
 	//struct fx_serial *ss = fx_serial_start("/dev/ttyS1", 9600, '7', 'E', '1');//for ubuntu
 	struct fx_serial *ss = fx_serial_start("/dev/ttymxc1", 9600, '7', 'E', '1');//for develop board
+	if (ss == NULL) {
+		printf("cannot open /dev/ttymxc1\n");
+		return 1;
+	}
 	
 	// fx_register_set(ss, 120, 0xab3d);
 	// fx_register_get(ss, 120, &data);